@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cmath> // isinf
+#include <cstdio> // snprintf
+#include <string>
+#include <vector>
+#include "flat_ast.h"
+#include "interval.h"
+
+namespace expr { namespace ast
+{
+	// bounds of built-in fn of arguments within a, b and c, approximations bounded as what
+	// they approximate
+	inline Interval CallRange(char fn, Interval a, Interval b, Interval c){
+		switch (fn)
+		{
+			case fn_log:
+			case fn_fast_log: return Log(a);
+			case fn_exp:
+			case fn_fast_exp: return Exp(a);
+			case fn_sigmoid:
+			case fn_fast_sigmoid: return Sigmoid(a);
+			case fn_pow:
+			case fn_fast_pow: return Pow(a, b);
+			case fn_sqrt: return Sqrt(a);
+			case fn_abs: return Abs(a);
+			case fn_min: return Min(a, b);
+			case fn_max: return Max(a, b);
+			case fn_clamp: return Clamp(a, b, c);
+		}
+		return Interval::Full();
+	}
+
+	// bounds of node n, its children's bounds in done, ranges by symbol position. Symbols
+	// without a range are unbounded
+	inline Interval NodeRange(Node const& n, Interval const* done, std::vector<Interval> const& ranges){
+		switch (n.kind)
+		{
+			case node_const: return Interval::Point(n.value);
+			case node_symbol: return n.lhs < ranges.size() ? ranges[n.lhs] : Interval::Full();
+			case node_neg: return -done[n.lhs];
+			case node_binary:
+				switch (n.sign)
+				{
+					case '+': return done[n.lhs] + done[n.rhs];
+					case '-': return done[n.lhs] - done[n.rhs];
+					case '*': return done[n.lhs] * done[n.rhs];
+					case '/': return done[n.lhs] / done[n.rhs];
+					case '<': return Less(done[n.lhs], done[n.rhs]);
+					case '>': return Less(done[n.rhs], done[n.lhs]);
+					case 'l': return LessEqual(done[n.lhs], done[n.rhs]);
+					case 'g': return LessEqual(done[n.rhs], done[n.lhs]);
+					case '=': return Equal(done[n.lhs], done[n.rhs]);
+					case '!': return NotEqual(done[n.lhs], done[n.rhs]);
+					case '&': return And(done[n.lhs], done[n.rhs]);
+					case '|': return Or(done[n.lhs], done[n.rhs]);
+				}
+				break;
+			case node_not: return Not(done[n.lhs]);
+			case node_select: return Select(done[n.lhs], done[n.rhs], done[n.alt]);
+			case node_call: return CallRange(n.sign, done[n.lhs], done[n.rhs], done[n.alt]);
+		}
+		return Interval::Full();
+	}
+
+	// neither zero nor infinite anywhere in x, so x*0 and 0+x have the sign and value of a
+	// finite nonzero number
+	inline bool FiniteNonZero(Interval x){
+		return (x.lo > 0 && !std::isinf(x.hi)) || (x.hi < 0 && !std::isinf(x.lo));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Bounds of every node of a tree given bounds of its symbols, e.g. like
+	//  in [0, 1e7], and the divisions whose divisor may be zero
+	///////////////////////////////////////////////////////////////////////////
+	class RangeAnalysis
+	{
+		public:
+			RangeAnalysis(Tree const& tree, std::vector<Interval> const& ranges) : root(tree.Root()){
+				for(uint32_t i=0; i<tree.Size(); ++i){
+					Node const& n = tree[i];
+					bounds.push_back(NodeRange(n, bounds.data(), ranges));
+					if(n.kind == node_binary && n.sign == '/' && bounds[n.rhs].Contains(0)){
+						zero_divisors.push_back(n.rhs);
+					}
+				}
+			}
+
+			Interval Of(uint32_t node) const{ return bounds[node]; }
+
+			Interval Output() const{ return bounds.empty() ? Interval::Full() : bounds[root]; }
+
+			// divisor nodes that may be zero, in evaluation order
+			std::vector<uint32_t> const& ZeroDivisors() const{ return zero_divisors; }
+
+			// no node can be infinite, hence none NaN either, for inputs within their ranges
+			bool Finite() const{
+				for(Interval const& b : bounds){
+					if(std::isinf(b.lo) || std::isinf(b.hi)){
+						return false;
+					}
+				}
+				return true;
+			}
+
+		private:
+			uint32_t root;
+			std::vector<Interval> bounds;
+			std::vector<uint32_t> zero_divisors;
+	};
+
+	// binding strength of node i's operator, 1 for ?: up to 9 for operands
+	inline int Precedence(Tree const& tree, uint32_t i){
+		Node const& n = tree[i];
+		switch (n.kind)
+		{
+			case node_select: return 1;
+			case node_binary:
+				switch (n.sign)
+				{
+					case '|': return 2;
+					case '&': return 3;
+					case '=': case '!': return 4;
+					case '<': case '>': case 'l': case 'g': return 5;
+					case '+': case '-': return 6;
+				}
+				return 7;
+			case node_neg:
+			case node_not: return 8;
+			// calls are bracketed already
+			default: break;
+		}
+		return 9;
+	}
+
+	// node i of tree as text the grammar parses back, symbols named by position in names
+	inline std::string Print(Tree const& tree, uint32_t i, std::vector<std::string> const& names){
+		Node const& n = tree[i];
+		// operand printed within brackets when it binds looser than min
+		auto operand = [&](uint32_t c, int min){
+			std::string text = Print(tree, c, names);
+			return Precedence(tree, c) < min ? "(" + text + ")" : text;
+		};
+		switch (n.kind)
+		{
+			case node_const: {
+				char buf[32];
+				std::snprintf(buf, sizeof(buf), "%.9g", n.value);
+				return buf;
+			}
+			case node_symbol: return n.lhs < names.size() ? names[n.lhs] : "?";
+			case node_neg: return "-" + operand(n.lhs, 8);
+			case node_not: return "!" + operand(n.lhs, 8);
+			// chains are left-deep, a right operand of the same precedence is bracketed
+			case node_binary: {
+				int p = Precedence(tree, i);
+				return operand(n.lhs, p) + SignText(n.sign) + operand(n.rhs, p+1);
+			}
+			// right associative
+			case node_select: return operand(n.lhs, 2) + "?" + operand(n.rhs, 1) + ":" + operand(n.alt, 1);
+			case node_call: {
+				const uint32_t arity = Builtins(n.sign).arity;
+				std::string text = std::string(Builtins(n.sign).name) + "(" + Print(tree, n.lhs, names);
+				if(arity > 1){
+					text += "," + Print(tree, n.rhs, names);
+				}
+				if(arity > 2){
+					text += "," + Print(tree, n.alt, names);
+				}
+				return text + ")";
+			}
+		}
+		return "";
+	}
+}}
@@ -1,142 +1,339 @@
 #pragma once
 
-#include <boost/variant/apply_visitor.hpp> // apply_visitor
-
+#include <algorithm> // copy, max, stable_sort
+#include <cstring> // strchr
+#include <memory> // unique_ptr
 #include <type_traits>
-#include "raw_ast.h"
+#include <vector>
+#include "flat_ast.h"
+#include "batch.h"
+#include "optimizer.h" // Apply
+#include "profile.h"
+#include "small_array.h"
 
-namespace expr { namespace ast
+namespace expr
 {
-	// non-variant version	
-	template<class Evalee>
-	class Op{
-		public:		
-			virtual float Eval(Evalee const&) const = 0;
-			virtual ~Op() {}
-	};
-	
-	template<class Evalee>
-	class Value : public Op<Evalee>{
-		public:			
-			Value(float v) : val(v) {}
-
-			float Eval(Evalee const&) const override{
-				return val;
-			} 
-
-			~Value() override{}
-
-		private:
-			float val;
-	};
-
-	template<class Evalee>
-	class SignedOp: public Op<Evalee>{
-		public:			
-			SignedOp(bool s, Op<Evalee>* p) : sign(s), op_ptr(p) {}
+#if EXPR_PROFILE
+	namespace ast{
+		// profile slot of a node: its kind, a binary node's operator or a call's built-in
+		inline uint32_t ProfileSlot(Node const& n){
+			static char const signs[] = "+-*/<l>g=!&|";
+			switch (n.kind)
+			{
+				case node_const: return 0;
+				case node_symbol: return 1;
+				case node_neg: return 2;
+				case node_not: return 3;
+				case node_select: return 4;
+				case node_binary: return 5 + uint32_t(std::strchr(signs, n.sign) - signs);
+				case node_call: return 17 + uint32_t(uint8_t(n.sign));
+			}
+			return profile::kSlots;
+		}
 
-			float Eval(Evalee const& u) const override{
-				return (sign?1:-1)*(op_ptr->Eval(u)); 
-			} 
+		inline std::vector<std::string> ProfileSlotNames(){
+			std::vector<std::string> names = {"const", "symbol", "neg", "not", "select",
+				"+", "-", "*", "/", "<", "<=", ">", ">=", "==", "!=", "&&", "||"};
+			for(int fn=0; fn<fn_count; ++fn){
+				names.push_back(std::string(fn < fn_fast_log ? "" : "fast_") + Builtins(char(fn)).name);
+			}
+			return names;
+		}
+	}
+#endif
 
-			~SignedOp() override { delete op_ptr; }
+	///////////////////////////////////////////////////////////////////////////
+	//  The AST evaluator, walks the flat tree front to back: children precede
+	//  their parent, so one pass over the node array computes every node once
+	//  from values already computed. Both branches of a condition and both
+	//  sides of && and || are computed, the node selects between them. A value
+	//  lives in a slot until its parent reads it, the slot is then reused, and
+	//  the child needing more slots is computed first, so a tree of n nodes
+	//  needs about log2(n) slots whatever its shape
+	///////////////////////////////////////////////////////////////////////////
+	template<class Functor, class Evalee>
+	class AstEvaluator{
+		public:
+			using element_type = Evalee;
 
-		private:
-			bool sign;
-			Op<Evalee>* op_ptr;
-	};
+			// value slots kept on the native stack by operator(), and slot columns by EvalBatch,
+			// trees with more values live at once fall back to heap
+			static const uint32_t kInlineSlots = 64;
+			static const uint32_t kInlineBatchSlots = 16;
+			// nodes and functors kept within the shared program, a short one a single allocation
+			static const uint32_t kInlineProgramNodes = 16;
+			static const uint32_t kInlineFunctors = 8;
 
-	template<class Evalee>
-	class BinaryOp: public Op<Evalee>{
-		public:			
-			BinaryOp(char s, Op<Evalee>* l, Op<Evalee>* r) : sign(s), lop_ptr(l), rop_ptr(r) {}
+			AstEvaluator(ast::Tree const& tree){
+#if EXPR_PROFILE
+				site = profile::Register(tree.Source(), "ast", ast::ProfileSlotNames());
+#endif
+				ast::Tree compact = order(tree);
+				std::vector<ast::Node> nodes;
+				std::vector<Functor> fns;
+				std::vector<uint32_t> symbol2fn;
+				// node -> slot, and the slots whose value has been read
+				std::vector<uint32_t> slots;
+				std::vector<uint32_t> released;
+				uint32_t slot_count = 0;
+				for(uint32_t i=0; i<compact.Size(); ++i){
+					ast::Node n = compact[i];
+					// symbol nodes index fns, each functor cast out of the symbol table once
+					if(n.kind == ast::node_symbol){
+						if(n.lhs >= symbol2fn.size()){
+							symbol2fn.resize(n.lhs+1, uint32_t(-1));
+						}
+						if(symbol2fn[n.lhs] == uint32_t(-1)){
+							symbol2fn[n.lhs] = uint32_t(fns.size());
+							fns.push_back(compact.Fn<Functor>(n.lhs));
+						}
+						n.lhs = symbol2fn[n.lhs];
+					}else if(n.kind != ast::node_const){
+						// a compact tree is a tree, each child read by this node only. Arguments
+						// past a call's arity read the first argument's slot and are ignored
+						const uint32_t arity = children(n);
+						n.lhs = slots[n.lhs];
+						n.rhs = arity > 1 ? slots[n.rhs] : n.lhs;
+						n.alt = arity > 2 ? slots[n.alt] : n.lhs;
+						released.push_back(n.lhs);
+						if(arity > 1) released.push_back(n.rhs);
+						if(arity > 2) released.push_back(n.alt);
+					}
+					if(released.empty()){
+						slots.push_back(slot_count++);
+					}else{
+						slots.push_back(released.back());
+						released.pop_back();
+					}
+					nodes.push_back(n);
+				}
+				program = std::make_shared<Program const>(nodes, fns, slots, slot_count);
+			}
 
-			float Eval(Evalee const& u) const override{
-				float lhs = lop_ptr->Eval(u); 
-				float rhs = rop_ptr->Eval(u); 
-				switch (sign)
-				{
-					case '+': return lhs + rhs;
-					case '-': return lhs - rhs;
-					case '*': return lhs * rhs;
-					case '/': return lhs / rhs;
+			float operator()(element_type const& e) const{
+				if(program->slot_count <= kInlineSlots){
+					float values[kInlineSlots];
+					return eval(e, values);
 				}
-				return 0;
-			} 
+				std::unique_ptr<float[]> values(new float[program->slot_count]);
+				return eval(e, values.get());
+			}
 
-			~BinaryOp() override { delete lop_ptr; delete rop_ptr; }
+			// scratch: caller owned, at least ScratchSize() floats, e.g. one buffer per worker thread
+			float operator()(element_type const& e, float* scratch) const{
+				return eval(e, scratch);
+			}
 
-		private:
-			char sign;
-			Op<Evalee>* lop_ptr;
-			Op<Evalee>* rop_ptr;
-	};
-	
-	template<class Functor, class Evalee>
-	class FnOp : public Op<Evalee>{
-		public:
-			FnOp(ScoreFn  f) : fn(boost::any_cast<Functor>(f)) {}
+			uint32_t ScratchSize() const{ return program->slot_count; }
 
-			float Eval(Evalee const& u) const override{
-				return EvalFn(fn, const_cast<Evalee*>(&u));
+			// score n items into out[0..n)
+			void EvalBatch(element_type const* items, std::size_t n, float* out) const{
+				evalBatch(items, n, out);
 			}
 
-			~FnOp() override {}
+			void EvalBatch(element_type const* const* items, std::size_t n, float* out) const{
+				evalBatch(items, n, out);
+			}
 
 		private:
-			Functor fn;
-	};
-
-	} // end of ns ast
-
-	///////////////////////////////////////////////////////////////////////////
-	//  The AST evaluator
-	///////////////////////////////////////////////////////////////////////////
-	template<class Functor, class Evalee>
-	struct AstTransformer 
-	{
-		typedef ast::Op<Evalee>* result_type;
-
-		result_type operator()(ast::Nil) const { BOOST_ASSERT(0); return nullptr; }
-
-		result_type operator()(float n) const { return new ast::Value<Evalee>(n); }
+			static uint32_t children(ast::Node const& n){
+				switch (n.kind)
+				{
+					case ast::node_const:
+					case ast::node_symbol: return 0;
+					case ast::node_neg:
+					case ast::node_not: return 1;
+					case ast::node_select: return 3;
+					case ast::node_call: return ast::Builtins(n.sign).arity;
+					case ast::node_binary: break;
+				}
+				return 2;
+			}
 
-		result_type operator()(ast::ScoreFn const& fn) const{
-			return new ast::FnOp<Functor,Evalee>(fn); 
-		}
+			// copy of the nodes reachable from the root, each node's children in decreasing order
+			// of the slots they need. Functors are pure, the order they're called in doesn't matter
+			static ast::Tree order(ast::Tree const& tree){
+				ast::Tree compact = ast::Compact(tree);
+				// slots needed by node i, the k-th child computed holding k values of those before it
+				std::vector<uint32_t> need(compact.Size(), 1);
+				for(uint32_t i=0; i<compact.Size(); ++i){
+					uint32_t c[3];
+					const uint32_t m = sorted(compact, need, i, c);
+					for(uint32_t k=0; k<m; ++k){
+						need[i] = std::max(need[i], need[child(compact[i], c[k])] + k);
+					}
+				}
+				ast::Tree ordered(compact.Symbols(), compact.Size());
+				if(compact.Size()){
+					emit(compact, need, compact.Root(), ordered);
+				}
+				return ordered;
+			}
 
-		result_type operator()(ast::Operand const& op) const{
-			return boost::apply_visitor(*this,op);
-		}
+			// k-th child of n, lhs rhs alt
+			static uint32_t child(ast::Node const& n, uint32_t k){
+				return k == 0 ? n.lhs : k == 1 ? n.rhs : n.alt;
+			}
 
-		result_type operator()(ast::Signed const& x) const{
-			return new ast::SignedOp<Evalee>(x.sign=='+', (*this)(x.operand));
-		}
+			// positions of node i's children into c, most slots first, ties left to right
+			static uint32_t sorted(ast::Tree const& tree, std::vector<uint32_t> const& need, uint32_t i, uint32_t* c){
+				ast::Node const& n = tree[i];
+				const uint32_t m = children(n);
+				for(uint32_t k=0; k<m; ++k){
+					c[k] = k;
+				}
+				std::stable_sort(c, c+m, [&](uint32_t a, uint32_t b){ return need[child(n, a)] > need[child(n, b)]; });
+				return m;
+			}
 
-		result_type operator()(ast::Program const& x) const{
-			auto lop_ptr = (*this)(x.first);				
-			for(ast::Operation const& oper : x.rest){
-				lop_ptr = new ast::BinaryOp<Evalee>(oper.sign, lop_ptr, (*this)(oper.operand)); 
+			static uint32_t emit(ast::Tree const& in, std::vector<uint32_t> const& need, uint32_t i, ast::Tree& out){
+				ast::Node const& n = in[i];
+				uint32_t c[3];
+				const uint32_t m = sorted(in, need, i, c);
+				// index in out of each of n's children by position
+				uint32_t at[3] = {0, 0, 0};
+				for(uint32_t k=0; k<m; ++k){
+					at[c[k]] = emit(in, need, child(n, c[k]), out);
+				}
+				switch (n.kind)
+				{
+					case ast::node_const: return out.Constant(n.value);
+					case ast::node_symbol: return out.Symbol(n.lhs);
+					case ast::node_neg: return out.Negate(at[0]);
+					case ast::node_not: return out.Not(at[0]);
+					case ast::node_binary: return out.Binary(n.sign, at[0], at[1]);
+					case ast::node_select: return out.Select(at[0], at[1], at[2]);
+					case ast::node_call: return out.Call(n.sign, at[0], at[1], at[2]);
+				}
+				BOOST_ASSERT(0);
+				return 0;
 			}
-			return lop_ptr;
-		}
-	};
 
-	template<class Functor, class Evalee>
-	class AstEvaluator{
-		public:
-			using element_type = Evalee; 
-			AstEvaluator(ast::Program const& prog) : op_ptr(AstTransformer<Functor, Evalee>()(prog)){}
+			float eval(element_type const& e, float* values) const{
+				ast::Node const* nodes = program->nodes.data();
+				uint32_t const* slots = program->slots.data();
+				const std::size_t size = program->nodes.size();
+				Functor const* fns = program->fns.data();
+				Evalee* u = const_cast<Evalee*>(&e);
+				EXPR_PROFILE_PROBE(probe, site, 1, 1);
+				for(std::size_t i=0; i<size; ++i){
+					ast::Node const& n = nodes[i];
+					float& v = values[slots[i]];
+					EXPR_PROFILE_OP(probe, ast::ProfileSlot(n), 1);
+					switch (n.kind)
+					{
+						case ast::node_const: v = n.value; break;
+						case ast::node_symbol: v = ast::EvalFn(fns[n.lhs], u); break;
+						case ast::node_neg: v = -values[n.lhs]; break;
+						case ast::node_binary:
+							switch (n.sign)
+							{
+								case '+': v = values[n.lhs] + values[n.rhs]; break;
+								case '-': v = values[n.lhs] - values[n.rhs]; break;
+								case '*': v = values[n.lhs] * values[n.rhs]; break;
+								case '/': v = values[n.lhs] / values[n.rhs]; break;
+								default: v = ast::Apply(n.sign, values[n.lhs], values[n.rhs]); break;
+							}
+							break;
+						case ast::node_not: v = values[n.lhs] == 0; break;
+						case ast::node_select: v = values[n.lhs] != 0 ? values[n.rhs] : values[n.alt]; break;
+						// arguments past the arity read the first one's slot, computed and ignored
+						case ast::node_call: v = ast::ApplyBuiltin(n.sign, values[n.lhs], values[n.rhs], values[n.alt]); break;
+					}
+				}
+				return values[slots[size-1]];
+			}
 
-			float operator()(element_type const& e) const{
-				return op_ptr->Eval(e);
+			// one column of batch::kBlockSize values per slot, each node visited once per block
+			template<class Items>
+			void evalBatch(Items items, std::size_t n, float* out) const{
+				if(program->slot_count <= kInlineBatchSlots){
+					float columns[kInlineBatchSlots*batch::kBlockSize];
+					evalBatch(items, n, out, columns);
+				}else{
+					std::unique_ptr<float[]> columns(new float[program->slot_count*batch::kBlockSize]);
+					evalBatch(items, n, out, columns.get());
+				}
 			}
 
-			~AstEvaluator() { delete op_ptr; }
+			template<class Items>
+			void evalBatch(Items items, std::size_t n, float* out, float* columns) const{
+				ast::Node const* nodes = program->nodes.data();
+				uint32_t const* slots = program->slots.data();
+				const std::size_t size = program->nodes.size();
+				Functor const* fns = program->fns.data();
+				const std::size_t B = batch::kBlockSize;
+				EXPR_PROFILE_PROBE(probe, site, n, 1);
+				for(std::size_t base=0; base<n; base+=B){
+					const std::size_t m = batch::BlockLen(base, n);
+					for(std::size_t i=0; i<size; ++i){
+						ast::Node const& nd = nodes[i];
+						EXPR_PROFILE_OP(probe, ast::ProfileSlot(nd), m);
+						float* col = columns + slots[i]*B;
+						float const* lhs = columns + nd.lhs*B;
+						float const* rhs = columns + nd.rhs*B;
+						switch (nd.kind)
+						{
+							case ast::node_const:
+								for(std::size_t j=0; j<m; ++j) col[j] = nd.value;
+								break;
+							case ast::node_symbol:
+								for(std::size_t j=0; j<m; ++j) col[j] = ast::EvalFn(fns[nd.lhs], const_cast<Evalee*>(&batch::At(items, base+j)));
+								break;
+							case ast::node_neg:
+								for(std::size_t j=0; j<m; ++j) col[j] = -lhs[j];
+								break;
+							case ast::node_binary:
+								switch (nd.sign)
+								{
+									case '+': for(std::size_t j=0; j<m; ++j) col[j] = lhs[j] + rhs[j]; break;
+									case '-': for(std::size_t j=0; j<m; ++j) col[j] = lhs[j] - rhs[j]; break;
+									case '*': for(std::size_t j=0; j<m; ++j) col[j] = lhs[j] * rhs[j]; break;
+									case '/': for(std::size_t j=0; j<m; ++j) col[j] = lhs[j] / rhs[j]; break;
+									default: for(std::size_t j=0; j<m; ++j) col[j] = ast::Apply(nd.sign, lhs[j], rhs[j]); break;
+								}
+								break;
+							case ast::node_not:
+								for(std::size_t j=0; j<m; ++j) col[j] = lhs[j] == 0;
+								break;
+							case ast::node_select: {
+								float const* alt = columns + nd.alt*B;
+								for(std::size_t j=0; j<m; ++j) col[j] = lhs[j] != 0 ? rhs[j] : alt[j];
+								break;
+							}
+							case ast::node_call: {
+								float const* alt = columns + nd.alt*B;
+								for(std::size_t j=0; j<m; ++j) col[j] = ast::ApplyBuiltin(nd.sign, lhs[j], rhs[j], alt[j]);
+								break;
+							}
+						}
+					}
+					float const* root = columns + slots[size-1]*B;
+					std::copy(root, root+m, out+base);
+				}
+			}
 
 		private:
-			typename AstTransformer<Functor, Evalee>::result_type op_ptr;
-			
+			struct Program
+			{
+				Program(std::vector<ast::Node> const& n, std::vector<Functor> const& f,
+						std::vector<uint32_t> const& s, uint32_t count) :
+					nodes(n.begin(), n.end()), fns(f.begin(), f.end()), slots(s.begin(), s.end()), slot_count(count){}
+
+				// the tree's nodes in evaluation order, symbol nodes rewritten to index fns and the
+				// children of others to the slots of their values
+				SmallArray<ast::Node, kInlineProgramNodes> nodes;
+				SmallArray<Functor, kInlineFunctors> fns;
+				// slot node i's value is written to
+				SmallArray<uint32_t, kInlineProgramNodes> slots;
+				uint32_t slot_count;
+			};
+
+			// immutable once built, copies of the evaluator share it
+			std::shared_ptr<Program const> program;
+#if EXPR_PROFILE
+			uint32_t site;
+#endif
 	};
 
 }
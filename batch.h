@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef> // size_t
+
+namespace expr { namespace batch
+{
+	// items evaluated together per block, one column of floats per stack slot
+	static const std::size_t kBlockSize = 64;
+
+	// item access for contiguous arrays and pointer arrays alike
+	template<class Evalee>
+	inline Evalee const& At(Evalee const* items, std::size_t i){ return items[i]; }
+
+	template<class Evalee>
+	inline Evalee const& At(Evalee const* const* items, std::size_t i){ return *items[i]; }
+
+	inline std::size_t BlockLen(std::size_t base, std::size_t n){
+		return n-base < kBlockSize ? n-base : kBlockSize;
+	}
+}}
@@ -0,0 +1,506 @@
+// Benchmark suite: generated expressions of a given size and shape, scored over item
+// arrays from cache to memory sized, through every functor kind and evaluator backend.
+// Results go out as json, one record per combination, e.g.
+//
+//	make bench-suite && ./bench-suite --nodes=16,200 --backends=vm,closure > base.json
+//
+// Every run with the same seed and options times the same expressions over the same items.
+
+#include <algorithm> // sort, min
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib> // strtoul
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new> // bad_alloc
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits> // is_arithmetic
+#include <vector>
+
+#include "parser.h"
+#include "raw_evaluator.h"
+#include "vm_evaluator.h"
+#include "regvm_evaluator.h"
+#include "jit_evaluator.h"
+#include "closure_evaluator.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//  Heap allocations counted for the whole program, reported per scored pass
+//  and per parse
+///////////////////////////////////////////////////////////////////////////////
+namespace bench{
+	std::atomic<uint64_t> allocations{0};
+}
+
+// the replacements are kept out of line, so a new expression and its delete are seen as a pair
+// rather than malloc on one side and free on the other
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE
+#endif
+
+BENCH_NOINLINE void* operator new(std::size_t size){
+	bench::allocations.fetch_add(1, std::memory_order_relaxed);
+	if(void* p = std::malloc(size ? size : 1)){
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void* operator new[](std::size_t size){
+	return operator new(size);
+}
+
+BENCH_NOINLINE void operator delete(void* p) noexcept{
+	std::free(p);
+}
+
+BENCH_NOINLINE void operator delete[](void* p) noexcept{
+	std::free(p);
+}
+
+BENCH_NOINLINE void operator delete(void* p, std::size_t) noexcept{
+	std::free(p);
+}
+
+BENCH_NOINLINE void operator delete[](void* p, std::size_t) noexcept{
+	std::free(p);
+}
+
+namespace biz{
+	struct UserScore{ float like; float follow; float comment;
+		float lk() const{ return like;}
+		float fw() const{ return follow;}
+		float cmt() const{ return comment;}
+	};
+
+	float like(UserScore const& user){ return user.like; }
+	float follow(UserScore const& user){ return user.follow; }
+	float comment(UserScore const& user){ return user.comment; }
+
+	// symbols resolved by index into an item that is a plain vector, as UserOp3 of main.cpp
+	struct UserOp3{
+		uint32_t index;
+
+		float operator()(std::vector<float> const& user) const{
+			return user[index];
+		}
+	};
+}
+
+namespace bench{
+	typedef std::chrono::steady_clock Clock;
+
+	struct Options
+	{
+		uint32_t seed = 1;
+		std::vector<uint32_t> nodes = {4, 16, 64, 200};
+		std::vector<std::string> shapes = {"balanced", "left", "right", "mixed"};
+		// ~3KB, ~200KB, ~3MB and ~24MB of UserScore: L1, L2, last level cache and memory
+		std::vector<uint32_t> items = {256, 16384, 262144, 2097152};
+		std::vector<std::string> functors = {"member", "method", "function", "std_function", "vector_index"};
+		std::vector<std::string> backends = {"raw", "ast", "vm", "regvm", "jit", "closure"};
+		std::vector<std::string> modes = {"item", "batch"};
+		uint32_t reps = 7;
+		// a repetition scores the items as many times as it takes to last this long
+		double min_rep_ms = 2;
+		// no more repetitions once a combination took this long, past the first 3
+		double max_cell_ms = 1500;
+		std::string out;
+	};
+
+	std::vector<std::string> Split(std::string const& list){
+		std::vector<std::string> parts;
+		std::stringstream ss(list);
+		std::string part;
+		while(std::getline(ss, part, ',')){
+			if(!part.empty()){
+				parts.push_back(part);
+			}
+		}
+		return parts;
+	}
+
+	std::vector<uint32_t> SplitNumbers(std::string const& list){
+		std::vector<uint32_t> numbers;
+		for(std::string const& part : Split(list)){
+			numbers.push_back(uint32_t(std::strtoul(part.c_str(), nullptr, 10)));
+		}
+		return numbers;
+	}
+
+	bool ParseOptions(int argc, char** argv, Options& o){
+		for(int i=1; i<argc; ++i){
+			std::string arg = argv[i];
+			std::size_t eq = arg.find('=');
+			std::string key = arg.substr(0, eq);
+			std::string value = eq == std::string::npos ? "" : arg.substr(eq+1);
+			if(key == "--seed") o.seed = uint32_t(std::strtoul(value.c_str(), nullptr, 10));
+			else if(key == "--nodes") o.nodes = SplitNumbers(value);
+			else if(key == "--shapes") o.shapes = Split(value);
+			else if(key == "--items") o.items = SplitNumbers(value);
+			else if(key == "--functors") o.functors = Split(value);
+			else if(key == "--backends") o.backends = Split(value);
+			else if(key == "--modes") o.modes = Split(value);
+			else if(key == "--reps") o.reps = std::max(1ul, std::strtoul(value.c_str(), nullptr, 10));
+			else if(key == "--min-rep-ms") o.min_rep_ms = std::atof(value.c_str());
+			else if(key == "--max-cell-ms") o.max_cell_ms = std::atof(value.c_str());
+			else if(key == "--out") o.out = value;
+			else if(key == "--quick"){
+				// a few minutes less, for a check before pushing
+				o.nodes = {4, 64};
+				o.shapes = {"balanced", "mixed"};
+				o.items = {1024, 262144};
+				o.reps = 5;
+			}
+			else{
+				std::cerr << "usage: " << argv[0] << " [--quick] [--seed=N] [--nodes=4,16,..] [--shapes=balanced,left,right,mixed]\n"
+					"\t[--items=256,..] [--functors=member,method,function,std_function,vector_index]\n"
+					"\t[--backends=raw,ast,vm,regvm,jit,closure] [--modes=item,batch]\n"
+					"\t[--reps=N] [--min-rep-ms=X] [--max-cell-ms=X] [--out=file.json]\n";
+				return false;
+			}
+		}
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Random expressions of exactly the requested number of parsed nodes:
+	//  balanced, left or right leaning chains of arithmetic, or mixed with
+	//  functions, comparisons and conditionals
+	///////////////////////////////////////////////////////////////////////////
+	class Generator{
+		public:
+			Generator(std::mt19937& r, std::string const& s) : rng(r), shape(s){}
+
+			std::string operator()(uint32_t nodes){
+				if(nodes <= 1){
+					return leaf();
+				}
+				if(nodes == 2){
+					return "-" + leaf();
+				}
+				if(shape == "mixed"){
+					return mixed(nodes);
+				}
+				// a binary node and its two sides, parenthesized so precedence keeps the shape
+				uint32_t rest = nodes - 1;
+				uint32_t lhs = shape == "left" ? rest - 1 : shape == "right" ? 1 : rest / 2;
+				return "(" + (*this)(lhs) + arithmetic() + (*this)(rest - lhs) + ")";
+			}
+
+		private:
+			std::string leaf(){
+				static const char* symbols[] = {"like", "follow", "comment"};
+				static const char* constants[] = {"0.5", "2", "3", "0.1", "1.5"};
+				return pick(100) < 85 ? symbols[pick(3)] : constants[pick(5)];
+			}
+
+			std::string arithmetic(){
+				static const char* ops[] = {"+", "-", "*", "/"};
+				return ops[pick(4)];
+			}
+
+			std::string mixed(uint32_t nodes){
+				uint32_t rest = nodes - 1;
+				uint32_t kind = pick(100);
+				// kept to functions that stay clear of subnormals, which would time the fpu's slow path
+				if(kind < 10){
+					static const char* unary[] = {"sqrt", "abs", "sigmoid"};
+					return std::string(unary[pick(3)]) + "(" + (*this)(rest) + ")";
+				}
+				uint32_t lhs = 1 + pick(rest - 1);
+				if(kind < 20){
+					static const char* binary[] = {"min", "max"};
+					return std::string(binary[pick(2)]) + "(" + (*this)(lhs) + ", " + (*this)(rest - lhs) + ")";
+				}
+				if(kind < 30){
+					static const char* compare[] = {"<", ">", "<=", ">=", "&&", "||"};
+					return "(" + (*this)(lhs) + compare[pick(6)] + (*this)(rest - lhs) + ")";
+				}
+				if(kind < 38 && rest >= 3){
+					uint32_t cond = 1 + pick(rest - 2);
+					uint32_t then = 1 + pick(rest - cond - 1);
+					return "(" + (*this)(cond) + " ? " + (*this)(then) + " : " + (*this)(rest - cond - then) + ")";
+				}
+				return "(" + (*this)(lhs) + arithmetic() + (*this)(rest - lhs) + ")";
+			}
+
+			uint32_t pick(uint32_t n){
+				return uint32_t(rng() % n);
+			}
+
+		private:
+			std::mt19937& rng;
+			std::string shape;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	//  One timed combination
+	///////////////////////////////////////////////////////////////////////////
+	struct Case
+	{
+		std::string shape;
+		uint32_t nodes;
+		std::string expression;
+		std::string functor;
+		uint32_t items;
+		std::size_t bytes;
+	};
+
+	struct Result
+	{
+		Case c;
+		std::string backend;
+		std::string mode;
+		uint32_t tree_nodes = 0;
+		double build_us = 0;
+		uint64_t build_allocs = 0;
+		uint32_t reps = 0;
+		uint64_t passes = 0;
+		// ns per item of each repetition, sorted
+		std::vector<double> samples;
+		double allocs_per_pass = 0;
+		float checksum = 0;
+	};
+
+	double Percentile(std::vector<double> const& sorted, double p){
+		double at = p * (sorted.size() - 1);
+		std::size_t lo = std::size_t(at);
+		std::size_t hi = std::min(lo + 1, sorted.size() - 1);
+		return sorted[lo] + (sorted[hi] - sorted[lo]) * (at - lo);
+	}
+
+	double Ms(Clock::duration d){
+		return std::chrono::duration<double, std::milli>(d).count();
+	}
+
+	template<class Evaluator, class Item>
+	void Score(Evaluator const& eval, std::vector<Item> const& items, bool batch, std::vector<float>& out){
+		if(batch){
+			eval.EvalBatch(items.data(), items.size(), out.data());
+			return;
+		}
+		for(std::size_t i=0; i<items.size(); ++i){
+			out[i] = eval(items[i]);
+		}
+	}
+
+	template<class Evaluator, class Item>
+	void Measure(Evaluator const& eval, std::vector<Item> const& items, Options const& o, Result& r){
+		const bool batch = r.mode == "batch";
+		std::vector<float> out(items.size());
+		// a warm up pass sizes the repetitions
+		Clock::time_point start = Clock::now();
+		Score(eval, items, batch, out);
+		double pass_ms = std::max(Ms(Clock::now() - start), 1e-6);
+		const uint64_t passes = std::max<uint64_t>(1, uint64_t(std::ceil(o.min_rep_ms / pass_ms)));
+
+		r.samples.reserve(o.reps);
+		const uint64_t allocs = allocations.load(std::memory_order_relaxed);
+		Clock::time_point cell = Clock::now();
+		for(uint32_t rep=0; rep<o.reps; ++rep){
+			if(rep >= 3 && Ms(Clock::now() - cell) > o.max_cell_ms){
+				break;
+			}
+			start = Clock::now();
+			for(uint64_t pass=0; pass<passes; ++pass){
+				Score(eval, items, batch, out);
+				r.checksum += out.back();
+			}
+			double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+			r.samples.push_back(ns / (double(passes) * items.size()));
+			r.passes += passes;
+		}
+		r.reps = uint32_t(r.samples.size());
+		r.allocs_per_pass = double(allocations.load(std::memory_order_relaxed) - allocs) / r.passes;
+		std::sort(r.samples.begin(), r.samples.end());
+	}
+
+	template<template<class, class> class Evaluator, class Parser, class Item>
+	void Run(Parser const& parser, std::vector<Item> const& items, Options const& o, Result r, std::vector<Result>& results){
+		r.tree_nodes = parser.ParseTree(r.c.expression).Size();
+		const uint64_t allocs = allocations.load(std::memory_order_relaxed);
+		Clock::time_point start = Clock::now();
+		auto eval = parser.template Parse<Evaluator>(r.c.expression);
+		r.build_us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+		r.build_allocs = allocations.load(std::memory_order_relaxed) - allocs;
+		for(std::string const& mode : o.modes){
+			r.mode = mode;
+			r.samples.clear();
+			r.passes = 0;
+			Measure(eval, items, o, r);
+			std::cerr << r.c.shape << ' ' << r.c.nodes << ' ' << r.c.functor << ' ' << r.c.items << ' '
+				<< r.backend << ' ' << mode << ": " << Percentile(r.samples, 0.5) << " ns/item\n";
+			results.push_back(r);
+		}
+	}
+
+	// every backend of one parser, i.e. one functor kind
+	template<class Parser, class Item>
+	void RunBackends(Parser const& parser, std::vector<Item> const& items, Case const& c, Options const& o, std::vector<Result>& results){
+		for(std::string const& backend : o.backends){
+			Result r;
+			r.c = c;
+			r.backend = backend;
+			if(backend == "raw") Run<expr::RawEvaluator>(parser, items, o, r, results);
+			else if(backend == "ast") Run<expr::AstEvaluator>(parser, items, o, r, results);
+			else if(backend == "vm") Run<expr::VMEvaluator>(parser, items, o, r, results);
+			else if(backend == "regvm") Run<expr::RegVMEvaluator>(parser, items, o, r, results);
+			else if(backend == "jit") Run<expr::JitEvaluator>(parser, items, o, r, results);
+			else if(backend == "closure") Run<expr::ClosureEvaluator>(parser, items, o, r, results);
+			else std::cerr << "unknown backend " << backend << '\n';
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  json output
+	///////////////////////////////////////////////////////////////////////////
+	std::string Quoted(std::string const& s){
+		std::string q = "\"";
+		for(char ch : s){
+			if(ch == '"' || ch == '\\'){
+				q += '\\';
+			}
+			q += ch;
+		}
+		return q + "\"";
+	}
+
+	template<class List>
+	std::string Array(List const& list){
+		std::ostringstream os;
+		os << '[';
+		for(auto it = list.begin(); it != list.end(); ++it){
+			os << (it == list.begin() ? "" : ", ");
+			std::ostringstream item;
+			item << *it;
+			os << (std::is_arithmetic<typename List::value_type>::value ? item.str() : Quoted(item.str()));
+		}
+		return os.str() + ']';
+	}
+
+	std::string Simd(){
+#if defined(__AVX512F__)
+		return "avx512f";
+#elif defined(__AVX2__)
+		return "avx2";
+#elif defined(__AVX__)
+		return "avx";
+#elif defined(__SSE__)
+		return "sse";
+#else
+		return "none";
+#endif
+	}
+
+	void Write(std::ostream& os, Options const& o, std::vector<Result> const& results){
+		os.precision(6);
+		os << "{\n";
+		os << "  \"compiler\": " << Quoted(__VERSION__) << ",\n";
+		os << "  \"simd\": " << Quoted(Simd()) << ",\n";
+		os << "  \"vm_threaded\": " << (EXPR_VM_THREADED ? "true" : "false") << ",\n";
+		os << "  \"options\": {\"seed\": " << o.seed << ", \"nodes\": " << Array(o.nodes)
+			<< ", \"shapes\": " << Array(o.shapes) << ", \"items\": " << Array(o.items)
+			<< ", \"functors\": " << Array(o.functors) << ", \"backends\": " << Array(o.backends)
+			<< ", \"modes\": " << Array(o.modes) << ", \"reps\": " << o.reps
+			<< ", \"min_rep_ms\": " << o.min_rep_ms << ", \"max_cell_ms\": " << o.max_cell_ms << "},\n";
+		os << "  \"results\": [";
+		for(std::size_t i=0; i<results.size(); ++i){
+			Result const& r = results[i];
+			const double median = Percentile(r.samples, 0.5);
+			os << (i ? ",\n" : "\n") << "    {"
+				<< "\"shape\": " << Quoted(r.c.shape) << ", \"nodes\": " << r.c.nodes << ", \"tree_nodes\": " << r.tree_nodes
+				<< ", \"functor\": " << Quoted(r.c.functor) << ", \"backend\": " << Quoted(r.backend) << ", \"mode\": " << Quoted(r.mode)
+				<< ", \"items\": " << r.c.items << ", \"bytes\": " << r.c.bytes
+				<< ", \"reps\": " << r.reps << ", \"passes\": " << r.passes
+				<< ", \"ns_per_item\": {\"min\": " << r.samples.front() << ", \"p10\": " << Percentile(r.samples, 0.1)
+				<< ", \"median\": " << median << ", \"p90\": " << Percentile(r.samples, 0.9) << ", \"max\": " << r.samples.back() << "}"
+				<< ", \"items_per_sec\": " << 1e9 / median
+				<< ", \"allocs_per_pass\": " << r.allocs_per_pass
+				<< ", \"build_us\": " << r.build_us << ", \"build_allocs\": " << r.build_allocs
+				<< ", \"expression\": " << Quoted(r.c.expression) << "}";
+		}
+		os << "\n  ]\n}\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	bench::Options o;
+	if(!bench::ParseOptions(argc, argv, o)){
+		return 1;
+	}
+
+	// values kept near 1 so long products and quotients stay clear of subnormals
+	std::mt19937 rng(o.seed);
+	std::uniform_real_distribution<float> value(0.5f, 2.f);
+	const uint32_t max_items = *std::max_element(o.items.begin(), o.items.end());
+	std::vector<biz::UserScore> all;
+	for(uint32_t i=0; i<max_items; ++i){
+		float like = value(rng), follow = value(rng);
+		all.push_back({like, follow, value(rng)});
+	}
+
+	auto symbols = {"like", "follow", "comment"};
+	auto members = {&biz::UserScore::like, &biz::UserScore::follow, &biz::UserScore::comment};
+	auto methods = {&biz::UserScore::lk, &biz::UserScore::fw, &biz::UserScore::cmt};
+	auto functions = {&biz::like, &biz::follow, &biz::comment};
+	std::vector<std::function<float(biz::UserScore const&)>> std_functions = {&biz::like, &biz::follow, &biz::comment};
+	std::vector<biz::UserOp3> indexes = {{0}, {1}, {2}};
+	auto&& member_parser = expr::MakeParser(symbols, members);
+	auto&& method_parser = expr::MakeParser(symbols, methods);
+	auto&& function_parser = expr::MakeParser(symbols, functions);
+	auto&& std_function_parser = expr::MakeParser(symbols, std_functions);
+	auto&& index_parser = expr::TypeHint<std::vector<float>>::MakeParser(symbols, indexes);
+
+	std::vector<bench::Result> results;
+	for(std::string const& shape : o.shapes){
+		for(uint32_t nodes : o.nodes){
+			// one expression per shape and size, the same for every functor, backend and item count
+			const std::string expression = bench::Generator(rng, shape)(nodes);
+			for(uint32_t n : o.items){
+				std::vector<biz::UserScore> items(all.begin(), all.begin() + n);
+				for(std::string const& functor : o.functors){
+					bench::Case c{shape, nodes, expression, functor, n, n * sizeof(biz::UserScore)};
+					if(functor == "member") bench::RunBackends(member_parser, items, c, o, results);
+					else if(functor == "method") bench::RunBackends(method_parser, items, c, o, results);
+					else if(functor == "function") bench::RunBackends(function_parser, items, c, o, results);
+					else if(functor == "std_function") bench::RunBackends(std_function_parser, items, c, o, results);
+					else if(functor == "vector_index"){
+						std::vector<std::vector<float>> rows;
+						for(auto const& u : items){
+							rows.push_back({u.like, u.follow, u.comment});
+						}
+						// each row a separate heap block of 3 floats besides the vector itself
+						c.bytes = n * (sizeof(std::vector<float>) + 3*sizeof(float));
+						bench::RunBackends(index_parser, rows, c, o, results);
+					}
+					else std::cerr << "unknown functor " << functor << '\n';
+				}
+			}
+		}
+	}
+
+	float checksum = 0;
+	for(bench::Result const& r : results){
+		checksum += r.checksum;
+	}
+	std::cerr << "checksum " << checksum << '\n';
+	if(o.out.empty()){
+		bench::Write(std::cout, o, results);
+	}else{
+		std::ofstream file(o.out);
+		bench::Write(file, o, results);
+	}
+	return 0;
+}
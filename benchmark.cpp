@@ -10,10 +10,21 @@
 #include <vector>
 #include <chrono>
 #include <functional> //mem_fn
+#include <algorithm> // partial_sort
 
 #include "grammar.h"
+#include "parser.h"
 #include "vm_evaluator.h"
+#include "regvm_evaluator.h"
 #include "raw_evaluator.h"
+#include "parallel.h"
+#include "jit_evaluator.h"
+#include "static_evaluator.h"
+#include "closure_evaluator.h"
+#include "expression_cache.h"
+#include "vm_image.h"
+#include "multi_evaluator.h"
+#include "topk.h"
 
 namespace biz{
 	struct UserScore{ float like; float follow; float comment;
@@ -79,6 +90,43 @@ int main()
 		std::cout << "ast parsed function took " << cost << "ms, result=" <<  f <<'\n';
 	}
 
+	{
+		// same formulas compiled in, bound to fnList as gram is
+		expr::ct::Symbol<0> like; expr::ct::Symbol<1> follow; expr::ct::Symbol<2> comment;
+		auto user_eval1 = EXPR_STATIC(fnList, like+follow+comment);	
+		auto user_eval2 = EXPR_STATIC(fnList, like*follow/(comment-follow)*(like+follow)-0.1);	
+		auto user_eval3 = EXPR_STATIC(fnList, (like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment));	
+	
+		f=0.f;
+		auto now = std::chrono::system_clock::now();
+		for(int i=0; i<1000000; ++i){
+			for(auto& u : users){
+				f += user_eval1(u)	+ user_eval2(u) + user_eval3(u);		
+			}
+		}	
+		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "static function took " << cost << "ms, result=" <<  f <<'\n';
+
+		// member object pointers are plain loads once inlined, no call is left
+		auto fieldList  = {&biz::UserScore::like,
+			&biz::UserScore::follow,
+			&biz::UserScore::comment
+		};
+		auto field_eval1 = EXPR_STATIC(fieldList, like+follow+comment);	
+		auto field_eval2 = EXPR_STATIC(fieldList, like*follow/(comment-follow)*(like+follow)-0.1);	
+		auto field_eval3 = EXPR_STATIC(fieldList, (like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment));	
+	
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000000; ++i){
+			for(auto& u : users){
+				f += field_eval1(u)	+ field_eval2(u) + field_eval3(u);		
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "static member function took " << cost << "ms, result=" <<  f <<'\n';
+	}
+
 	{
 		auto user_eval1 = gram.Parse<expr::RawEvaluator>(std::string{"like+follow+comment"});	
 		auto user_eval2 = gram.Parse<expr::RawEvaluator>(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
@@ -95,6 +143,22 @@ int main()
 		std::cout << "raw parsed function took " << cost << "ms, result=" <<  f <<'\n';
 	}
 
+	{
+		auto user_eval1 = gram.Parse<expr::ClosureEvaluator>(std::string{"like+follow+comment"});	
+		auto user_eval2 = gram.Parse<expr::ClosureEvaluator>(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
+		auto user_eval3 = gram.Parse<expr::ClosureEvaluator>(std::string{"(like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment)"});	
+	
+		f=0.f;
+		auto now = std::chrono::system_clock::now();
+		for(int i=0; i<1000000; ++i){
+			for(auto& u : users){
+				f += user_eval1(u)	+ user_eval2(u) + user_eval3(u);		
+			}
+		}	
+		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "closure parsed function took " << cost << "ms, result=" <<  f <<'\n';
+	}
+
 	{
 		auto user_eval1 = gram.Parse<expr::VMEvaluator>(std::string{"like+follow+comment"});	
 		auto user_eval2 = gram.Parse<expr::VMEvaluator>(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
@@ -108,7 +172,382 @@ int main()
 			}
 		}	
 		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
-		std::cout << "vm parsed function took " << cost << "ms, result=" <<  f <<'\n';
+		std::cout << "vm parsed function(" << (EXPR_VM_THREADED ? "threaded" : "switch") << ") took " << cost << "ms, result=" <<  f <<'\n';
+	}
+
+	{
+		auto user_eval1 = gram.Parse<expr::RegVMEvaluator>(std::string{"like+follow+comment"});	
+		auto user_eval2 = gram.Parse<expr::RegVMEvaluator>(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
+		auto user_eval3 = gram.Parse<expr::RegVMEvaluator>(std::string{"(like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment)"});	
+	
+		f=0.f;
+		auto now = std::chrono::system_clock::now();
+		for(int i=0; i<1000000; ++i){
+			for(auto& u : users){
+				f += user_eval1(u)	+ user_eval2(u) + user_eval3(u);		
+			}
+		}	
+		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "regvm parsed function(" << (EXPR_VM_THREADED ? "threaded" : "switch") << ") took " << cost << "ms, result=" <<  f <<'\n';
+	}
+
+	{
+		auto user_eval1 = gram.Parse<expr::JitEvaluator>(std::string{"like+follow+comment"});	
+		auto user_eval2 = gram.Parse<expr::JitEvaluator>(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
+		auto user_eval3 = gram.Parse<expr::JitEvaluator>(std::string{"(like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment)"});	
+	
+		f=0.f;
+		auto now = std::chrono::system_clock::now();
+		for(int i=0; i<1000000; ++i){
+			for(auto& u : users){
+				f += user_eval1(u)	+ user_eval2(u) + user_eval3(u);		
+			}
+		}	
+		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "jit parsed function took " << cost << "ms, result=" <<  f <<'\n';
+	}
+
+	{
+		auto user_eval1 = gram.Parse(std::string{"like+follow+comment"});	
+		auto user_eval2 = gram.Parse(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
+		auto user_eval3 = gram.Parse(std::string{"(like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment)"});	
+		auto vm_eval1 = gram.Parse<expr::VMEvaluator>(std::string{"like+follow+comment"});	
+		auto vm_eval2 = gram.Parse<expr::VMEvaluator>(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
+		auto vm_eval3 = gram.Parse<expr::VMEvaluator>(std::string{"(like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment)"});	
+
+		// same number of evaluations as above, scored 3000 items per EvalBatch call
+		std::vector<biz::UserScore> items;
+		for(int i=0; i<1000; ++i){
+			items.insert(items.end(), users.begin(), users.end());
+		}
+		std::vector<float> out1(items.size()), out2(items.size()), out3(items.size());
+
+		f=0.f;
+		auto now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			user_eval1.EvalBatch(items.data(), items.size(), out1.data());
+			user_eval2.EvalBatch(items.data(), items.size(), out2.data());
+			user_eval3.EvalBatch(items.data(), items.size(), out3.data());
+			for(size_t j=0; j<items.size(); ++j){
+				f += out1[j] + out2[j] + out3[j];
+			}
+		}	
+		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "ast batch function took " << cost << "ms, result=" <<  f <<'\n';
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			vm_eval1.EvalBatch(items.data(), items.size(), out1.data());
+			vm_eval2.EvalBatch(items.data(), items.size(), out2.data());
+			vm_eval3.EvalBatch(items.data(), items.size(), out3.data());
+			for(size_t j=0; j<items.size(); ++j){
+				f += out1[j] + out2[j] + out3[j];
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm batch function took " << cost << "ms, result=" <<  f <<'\n';
+
+		// the three formulas as one program, symbol loads and (like+follow) shared
+		auto multi_eval = gram.Parse<expr::MultiEvaluator>(std::vector<std::string>{"like+follow+comment",
+			"like*follow/(comment-follow)*(like+follow)-0.1",
+			"(like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment)"});
+		std::vector<float> rows(items.size()*multi_eval.Size());
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			multi_eval.EvalRows(items.data(), items.size(), rows.data());
+			for(size_t j=0; j<items.size(); ++j){
+				f += rows[j*3] + rows[j*3+1] + rows[j*3+2];
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "multi batch function took " << cost << "ms, result=" <<  f <<'\n';
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		float row[3];
+		for(int i=0; i<1000000; ++i){
+			for(auto& u : users){
+				multi_eval(u, row);
+				f += row[0] + row[1] + row[2];
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "multi parsed function took " << cost << "ms, result=" <<  f <<'\n';
+
+		// member object pointers are gathered column-wise from the item array
+		auto fieldList  = {&biz::UserScore::like,
+			&biz::UserScore::follow,
+			&biz::UserScore::comment
+		};
+		auto&& field_gram = expr::MakeGrammar(symbols, fieldList);
+		auto field_eval1 = field_gram.Parse<expr::VMEvaluator>(std::string{"like+follow+comment"});	
+		auto field_eval2 = field_gram.Parse<expr::VMEvaluator>(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
+		auto field_eval3 = field_gram.Parse<expr::VMEvaluator>(std::string{"(like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment)"});	
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			field_eval1.EvalBatch(items.data(), items.size(), out1.data());
+			field_eval2.EvalBatch(items.data(), items.size(), out2.data());
+			field_eval3.EvalBatch(items.data(), items.size(), out3.data());
+			for(size_t j=0; j<items.size(); ++j){
+				f += out1[j] + out2[j] + out3[j];
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm batch member gather took " << cost << "ms, result=" <<  f <<'\n';
+
+		// a threshold gate applied in a second pass over the scores, then fused into the program
+		auto gate_eval = field_gram.Parse<expr::VMEvaluator>(std::string{"like > 2 && comment > follow ? like*follow/(comment-follow)*(like+follow)-0.1 : 0"});
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			field_eval2.EvalBatch(items.data(), items.size(), out2.data());
+			for(size_t j=0; j<items.size(); ++j){
+				f += items[j].like > 2 && items[j].comment > items[j].follow ? out2[j] : 0;
+			}
+		}
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm batch then c++ gate took " << cost << "ms, result=" <<  f <<'\n';
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			gate_eval.EvalBatch(items.data(), items.size(), out2.data());
+			for(size_t j=0; j<items.size(); ++j){
+				f += out2[j];
+			}
+		}
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm batch gated in program took " << cost << "ms, result=" <<  f <<'\n';
+
+		// a logistic score as written in c++, then by the exact and the approximated built-ins
+		const std::string logistic = "sigmoid(0.3*like - log(follow+1)) * pow(comment, 0.5)";
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			for(size_t j=0; j<items.size(); ++j){
+				f += 1/(1+std::exp(-(0.3f*items[j].like - std::log(items[j].follow+1)))) * std::pow(items[j].comment, 0.5f);
+			}
+		}
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "c++ logistic took " << cost << "ms, result=" <<  f <<'\n';
+
+		auto logistic_eval = field_gram.Parse<expr::VMEvaluator>(logistic);
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			logistic_eval.EvalBatch(items.data(), items.size(), out2.data());
+			for(size_t j=0; j<items.size(); ++j){
+				f += out2[j];
+			}
+		}
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm batch logistic took " << cost << "ms, result=" <<  f <<'\n';
+
+		auto&& fast_gram = expr::MakeGrammar(symbols, fieldList);
+		expr::ast::OptimizeOptions fast_functions;
+		fast_functions.fast_functions = true;
+		fast_gram.SetOptimizeOptions(fast_functions);
+		auto fast_logistic_eval = fast_gram.Parse<expr::VMEvaluator>(logistic);
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<1000; ++i){
+			fast_logistic_eval.EvalBatch(items.data(), items.size(), out2.data());
+			for(size_t j=0; j<items.size(); ++j){
+				f += out2[j];
+			}
+		}
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm batch fast logistic took " << cost << "ms, result=" <<  f <<'\n';
+	}
+
+	{
+		// parse throughput, as on a config push re-parsing every experiment's formulas
+		auto&& parser = expr::MakeParser(symbols, fnList);
+		std::vector<std::string> statements = {"like+follow+comment",
+			"like*follow/(comment-follow)*(like+follow)-0.1",
+			"(like+follow)*(like+comment)*(follow+comment)/(comment-follow)/(like-follow)/(like-comment)"};
+
+		f=0.f;
+		auto now = std::chrono::system_clock::now();
+		for(int i=0; i<10000; ++i){
+			for(auto& s : statements){
+				f += gram.Parse<expr::RawEvaluator>(s)(users[0]);
+			}
+		}	
+		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "spirit parse took " << cost << "ms, result=" <<  f <<'\n';
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<10000; ++i){
+			for(auto& s : statements){
+				f += parser.Parse<expr::RawEvaluator>(s)(users[0]);
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "recursive descent parse took " << cost << "ms, result=" <<  f <<'\n';
+
+		// parse, build and evaluate once, the lifetime of a short-lived expression
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<10000; ++i){
+			for(auto& s : statements){
+				f += parser.Parse<expr::ClosureEvaluator>(s)(users[0]);
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "closure one-shot took " << cost << "ms, result=" <<  f <<'\n';
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<10000; ++i){
+			for(auto& s : statements){
+				f += parser.Parse<expr::VMEvaluator>(s)(users[0]);
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm one-shot took " << cost << "ms, result=" <<  f <<'\n';
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<10000; ++i){
+			for(auto& s : statements){
+				f += parser.Parse<expr::JitEvaluator>(s)(users[0]);
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "jit one-shot took " << cost << "ms, result=" <<  f <<'\n';
+
+		// the same formulas looked up again, as delivered to every request context
+		auto programs = expr::MakeCache(gram);
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<10000; ++i){
+			for(auto& s : statements){
+				f += (*programs->Get<expr::VMEvaluator>(s))(users[0]);
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "cached vm parse took " << cost << "ms, result=" <<  f <<'\n';
+
+		// the formulas compiled ahead of time into an image and bound at startup instead of parsed
+		expr::vm::ImageWriter writer(gram);
+		for(auto& s : statements){
+			writer.Add(s, gram.Parse<expr::VMEvaluator>(s));
+		}
+		std::vector<uint32_t> data = writer.Data();
+		expr::vm::Image image(data.data(), data.size()*sizeof(uint32_t));
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<10000; ++i){
+			for(uint32_t p=0; p<image.Size(); ++p){
+				f += image.Load(p, gram)(users[0]);
+			}
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm image load took " << cost << "ms, result=" <<  f <<'\n';
+	}
+
+	{
+		// best 100 of 100k candidates, retrieved in descending relevance as `like`
+		auto user_eval = gram.Parse<expr::VMEvaluator>(std::string{"like*(1+follow/10)+comment"});	
+		const std::size_t n = 100000, k = 100, B = expr::batch::kBlockSize;
+		std::vector<biz::UserScore> items;
+		for(std::size_t i=0; i<n; ++i){
+			items.push_back({float(n-i) + float(i%7), float(i%11), float(i%13)});
+		}
+		// per block min and max of every field, as kept by a columnar store
+		std::vector<std::vector<expr::Interval>> zones;
+		for(std::size_t base=0; base<n; base+=B){
+			std::vector<expr::Interval> zone(3, expr::Interval{items[base].like, items[base].like});
+			zone[1] = expr::Interval{items[base].follow, items[base].follow};
+			zone[2] = expr::Interval{items[base].comment, items[base].comment};
+			for(std::size_t i=base; i<std::min(n, base+B); ++i){
+				float v[] = {items[i].like, items[i].follow, items[i].comment};
+				for(int z=0; z<3; ++z){
+					zone[z].lo = std::min(zone[z].lo, v[z]);
+					zone[z].hi = std::max(zone[z].hi, v[z]);
+				}
+			}
+			zones.push_back(zone);
+		}
+
+		std::vector<float> scores(n);
+		std::vector<std::size_t> order(n);
+		f=0.f;
+		auto now = std::chrono::system_clock::now();
+		for(int i=0; i<100; ++i){
+			user_eval.EvalBatch(items.data(), n, scores.data());
+			for(std::size_t j=0; j<n; ++j) order[j] = j;
+			std::partial_sort(order.begin(), order.begin()+k, order.end(), [&](std::size_t a, std::size_t b){
+				return scores[a] > scores[b];
+			});
+			f += scores[order[k-1]];
+		}	
+		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm batch and partial sort took " << cost << "ms, result=" <<  f <<'\n';
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<100; ++i){
+			f += expr::TopK(user_eval, items.data(), n, k).back().score;
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm topk took " << cost << "ms, result=" <<  f <<'\n';
+
+		f=0.f;
+		now = std::chrono::system_clock::now();
+		for(int i=0; i<100; ++i){
+			f += expr::TopK(user_eval, items.data(), n, k, [&](std::size_t begin, std::size_t){
+				return user_eval.Range(zones[begin/B]).hi;
+			}).back().score;
+		}	
+		cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		std::cout << "vm topk with block bounds took " << cost << "ms, result=" <<  f <<'\n';
+	}
+
+	{
+		auto user_eval = gram.Parse<expr::VMEvaluator>(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});	
+
+		// scaling curve of ParallelEval over 4M items, doubling workers up to the hardware threads
+		std::vector<biz::UserScore> items;
+		for(int i=0; i<(1<<22); ++i){
+			items.push_back(users[i%users.size()]);
+		}
+		std::vector<float> out(items.size());
+		const unsigned max_threads = std::max(2u, std::thread::hardware_concurrency());
+		for(unsigned threads=1; threads<=max_threads; threads*=2){
+			auto now = std::chrono::system_clock::now();
+			for(int i=0; i<10; ++i){
+				expr::ParallelEval(user_eval, items.data(), items.size(), out.data(), threads);
+			}	
+			auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+			std::cout << "vm parallel batch with " << threads << " threads took " << cost << "ms, result=" <<  out.back() <<'\n';
+		}
+	}
+
+	{
+		// bounds of score2 for like, follow and comment in [0, 1e7], and its divisions that may be by zero
+		auto tree = gram.ParseTree(std::string{"like*follow/(comment-follow)*(like+follow)-0.1"});
+		std::vector<expr::Interval> ranges(3, expr::Interval{0, 1e7f});
+		std::vector<std::string> names = {"like", "follow", "comment"};
+		std::size_t divisors = 0;
+		auto now = std::chrono::system_clock::now();
+		for(int i=0; i<100000; ++i){
+			divisors += expr::ast::RangeAnalysis(tree, ranges).ZeroDivisors().size();
+		}	
+		auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()-now).count();
+		expr::ast::RangeAnalysis analysis(tree, ranges);
+		std::cout << "range analysis took " << cost << "ms, result=" << divisors << ", output in ["
+			<< analysis.Output().lo << ", " << analysis.Output().hi << "]\n";
+		for(uint32_t node : analysis.ZeroDivisors()){
+			expr::Interval b = analysis.Of(node);
+			std::cout << "divisor " << expr::ast::Print(tree, node, names) << " may be zero, in [" << b.lo << ", " << b.hi << "]\n";
+		}
 	}
 
 	return 0;
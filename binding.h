@@ -0,0 +1,93 @@
+#pragma once
+
+#include <boost/type_traits.hpp> //  function_traits 
+
+#include <string>
+#include <type_traits>
+
+// how symbols get bound to functors: the item type evaluated is deduced from the functors'
+// first argument, or given with TypeHint. Shared by every front end, none of which is
+// included here
+namespace expr
+{
+	template <typename Iterator, typename Functor, class Item>
+	struct CalcGrammar; // grammar.h
+	template <typename Iterator, typename Functor, class Item>
+	class CalcParser; // parser.h
+	template<class Expr, class Functor, class Item>
+	class StaticEvaluator; // static_evaluator.h
+
+	// support function pointer, member object/function pointer
+	template<class F>
+	struct arg1_type : boost::false_type{};
+	template<class R, class T, class... U>
+	struct arg1_type<R(T,U...)> : boost::true_type{
+		using type = typename boost::remove_cv<
+					typename boost::remove_reference<T>::type
+				>::type;
+		
+	};
+	template<class R, class... A>
+	struct arg1_type<R(*)(A...)> : arg1_type<R(A...)>{};
+	template<class R, class... A>
+	struct arg1_type<R(&)(A...)> : arg1_type<R(A...)>{};
+	template<class R, class T>
+	struct arg1_type<R T::*> : arg1_type<void(T)>{};
+	// for (boost|std)::function<Sig> or std::mem_fn alike
+	template<class Sig, template<class> class Functor>
+	struct arg1_type<Functor<Sig>> : arg1_type<Sig>{};
+	// for boost::mem_fn alike
+	template<class R, class... A, template<class...> class Functor>
+	struct arg1_type<Functor<R,A...>> : arg1_type<R(A...)>{};
+
+	template<class StrType>
+	struct StringTraits{};
+	template<class CharType>
+	struct StringTraits<std::basic_string<CharType>>{
+		using char_type = CharType;
+	};
+	template<class CharType>
+	struct StringTraits<CharType*>{
+		using char_type = typename std::remove_const<CharType>::type;
+	};
+
+	template<class Keywords>
+	struct IteratorFromKeywords{
+		using value_type = typename Keywords::value_type; // basic_string or const char*
+		using string_type = std::basic_string<typename StringTraits<value_type>::char_type>;
+		using type = typename string_type::const_iterator;
+	};
+
+	template<class Container>
+	struct ContainedType{
+		using type = typename std::remove_const<
+				typename std::remove_reference<
+					typename Container::value_type				
+				>::type
+			>::type;
+	};
+
+	template<class Item>
+	struct TypeHint{
+		template<class Keywords, class Functors, 
+			class KeyIterator=typename IteratorFromKeywords<Keywords>::type, 
+			class Functor=typename ContainedType<Functors>::type>
+		static CalcGrammar<KeyIterator, Functor, Item> MakeGrammar(Keywords const& keywords, Functors const& fnList){
+			return {keywords, fnList};
+		}
+
+		template<class Keywords, class Functors, 
+			class KeyIterator=typename IteratorFromKeywords<Keywords>::type, 
+			class Functor=typename ContainedType<Functors>::type>
+		static CalcParser<KeyIterator, Functor, Item> MakeParser(Keywords const& keywords, Functors const& fnList){
+			return {keywords, fnList};
+		}
+
+		// see EXPR_STATIC_HINT
+		template<class Functors, class Expr,
+			class Functor=typename ContainedType<Functors>::type>
+		static StaticEvaluator<Expr, Functor, Item> MakeStatic(Functors const& fnList, Expr const& e, std::string text){
+			return {fnList, e, std::move(text)};
+		}
+	};
+}
@@ -0,0 +1,447 @@
+#pragma once
+
+#include <cstdint> // uint32_t
+#include <vector>
+#include "flat_ast.h"
+#include "batch.h"
+#include "optimizer.h" // Apply
+#include "profile.h"
+
+namespace expr{
+	namespace closure{
+		///////////////////////////////////////////////////////////////////////////
+		//  Closure compilation: every operator node becomes a function pointer
+		//  specialized at build time for its operator and the kind of each
+		//  operand, functor and constant operands folded into their parent.
+		//  Closures sit in one array in evaluation order, the root last. The
+		//  untaken branch of a condition and a deciding && or || lhs's rhs are
+		//  not evaluated. Built-in calls are specialized for their function
+		///////////////////////////////////////////////////////////////////////////
+
+		// where a closure reads an operand from
+		enum ArgKind : uint8_t
+		{
+			arg_fn,     // calls fn
+			arg_const,  // value
+			arg_node    // result of closure `node`, the generic case
+		};
+
+		template<class Functor, class Evalee>
+		struct Closure
+		{
+			typedef float (*Eval)(Closure const* closures, Functor const* fns, Closure const& self, Evalee* u);
+
+			// fn indexes the program's functors, node its closures
+			struct Arg
+			{
+				uint32_t fn;
+				float value;
+				uint32_t node;
+			};
+
+			Eval eval;
+			Arg lhs;
+			Arg rhs;
+		};
+
+		template<class Functor, class Evalee>
+		class Compiler
+		{
+			public:
+				typedef Closure<Functor, Evalee> closure_type;
+				typedef typename closure_type::Arg Arg;
+				typedef typename closure_type::Eval Eval;
+
+				// closures of tree in evaluation order, the root last, and the functors they call
+				struct Program
+				{
+					std::vector<closure_type> closures;
+					std::vector<Functor> fns;
+				};
+
+				static Program Compile(ast::Tree const& tree){
+					Program program;
+					std::vector<closure_type>& closures = program.closures;
+					closures.reserve(tree.Size());
+					Compiler c(tree, closures, program.fns);
+					ast::Node const& root = tree[tree.Root()];
+					if(root.kind == ast::node_const || root.kind == ast::node_symbol){
+						closure_type leaf;
+						leaf.eval = unary<'+'>(c.arg(tree.Root(), leaf.lhs));
+						closures.push_back(leaf);
+					}else{
+						c.build(tree.Root());
+					}
+					return program;
+				}
+
+			private:
+				Compiler(ast::Tree const& t, std::vector<closure_type>& out, std::vector<Functor>& f) : tree(t), closures(out), fns(f){}
+
+				struct FnArg
+				{
+					static float Get(closure_type const*, Functor const* fns, Arg const& a, Evalee* u){ return ast::EvalFn(fns[a.fn], u); }
+				};
+
+				struct ConstArg
+				{
+					static float Get(closure_type const*, Functor const*, Arg const& a, Evalee*){ return a.value; }
+				};
+
+				struct NodeArg
+				{
+					static float Get(closure_type const* closures, Functor const* fns, Arg const& a, Evalee* u){
+						closure_type const& c = closures[a.node];
+						return c.eval(closures, fns, c, u);
+					}
+				};
+
+				// Op: '+' the operand itself, '-' negated, '!' not
+				template<char Op, class L>
+				static float evalUnary(closure_type const* closures, Functor const* fns, closure_type const& self, Evalee* u){
+					float v = L::Get(closures, fns, self.lhs, u);
+					return Op=='-' ? -v : Op=='!' ? float(v == 0) : v;
+				}
+
+				// operands are evaluated left to right, as by the other evaluators
+				template<char Sign, class L, class R>
+				static float evalBinary(closure_type const* closures, Functor const* fns, closure_type const& self, Evalee* u){
+					float l = L::Get(closures, fns, self.lhs, u);
+					return ast::Apply(Sign, l, R::Get(closures, fns, self.rhs, u));
+				}
+
+				// && and ||, rhs only evaluated when lhs doesn't decide the result
+				template<char Sign, class L, class R>
+				static float evalLogical(closure_type const* closures, Functor const* fns, closure_type const& self, Evalee* u){
+					bool l = L::Get(closures, fns, self.lhs, u) != 0;
+					if(l == (Sign=='|')){
+						return l;
+					}
+					return R::Get(closures, fns, self.rhs, u) != 0;
+				}
+
+				// the branches are the arms closure's lhs and rhs, only the one taken is evaluated
+				template<class C, class T, class E>
+				static float evalSelect(closure_type const* closures, Functor const* fns, closure_type const& self, Evalee* u){
+					closure_type const& arms = closures[self.rhs.node];
+					return C::Get(closures, fns, self.lhs, u) != 0 ? T::Get(closures, fns, arms.lhs, u) : E::Get(closures, fns, arms.rhs, u);
+				}
+
+				// built-in Fn of one or two arguments
+				template<char Fn, class A>
+				static float evalCall(closure_type const* closures, Functor const* fns, closure_type const& self, Evalee* u){
+					return ast::ApplyBuiltin(Fn, A::Get(closures, fns, self.lhs, u), 0, 0);
+				}
+
+				template<char Fn, class A, class B>
+				static float evalCall(closure_type const* closures, Functor const* fns, closure_type const& self, Evalee* u){
+					float a = A::Get(closures, fns, self.lhs, u);
+					return ast::ApplyBuiltin(Fn, a, B::Get(closures, fns, self.rhs, u), 0);
+				}
+
+				// the bounds are the lhs and rhs of a closure of their own, as select's arms
+				template<class X, class Lo, class Hi>
+				static float evalClamp(closure_type const* closures, Functor const* fns, closure_type const& self, Evalee* u){
+					closure_type const& bounds = closures[self.rhs.node];
+					float x = X::Get(closures, fns, self.lhs, u);
+					float lo = Lo::Get(closures, fns, bounds.lhs, u);
+					return ast::ApplyBuiltin(ast::fn_clamp, x, lo, Hi::Get(closures, fns, bounds.rhs, u));
+				}
+
+				template<char Op>
+				static Eval unary(ArgKind k){
+					switch (k)
+					{
+						case arg_fn: return &evalUnary<Op, FnArg>;
+						case arg_const: return &evalUnary<Op, ConstArg>;
+						case arg_node: break;
+					}
+					return &evalUnary<Op, NodeArg>;
+				}
+
+				template<char Sign, class L>
+				static Eval binary(ArgKind r){
+					if(ast::IsLogical(Sign)){
+						switch (r)
+						{
+							case arg_fn: return &evalLogical<Sign, L, FnArg>;
+							case arg_const: return &evalLogical<Sign, L, ConstArg>;
+							case arg_node: break;
+						}
+						return &evalLogical<Sign, L, NodeArg>;
+					}
+					switch (r)
+					{
+						case arg_fn: return &evalBinary<Sign, L, FnArg>;
+						case arg_const: return &evalBinary<Sign, L, ConstArg>;
+						case arg_node: break;
+					}
+					return &evalBinary<Sign, L, NodeArg>;
+				}
+
+				template<char Sign>
+				static Eval binary(ArgKind l, ArgKind r){
+					switch (l)
+					{
+						case arg_fn: return binary<Sign, FnArg>(r);
+						case arg_const: return binary<Sign, ConstArg>(r);
+						case arg_node: break;
+					}
+					return binary<Sign, NodeArg>(r);
+				}
+
+				static Eval binary(char sign, ArgKind l, ArgKind r){
+					switch (sign)
+					{
+						case '+': return binary<'+'>(l, r);
+						case '-': return binary<'-'>(l, r);
+						case '*': return binary<'*'>(l, r);
+						case '<': return binary<'<'>(l, r);
+						case '>': return binary<'>'>(l, r);
+						case 'l': return binary<'l'>(l, r);
+						case 'g': return binary<'g'>(l, r);
+						case '=': return binary<'='>(l, r);
+						case '!': return binary<'!'>(l, r);
+						case '&': return binary<'&'>(l, r);
+						case '|': return binary<'|'>(l, r);
+					}
+					return binary<'/'>(l, r);
+				}
+
+				template<class C, class T>
+				static Eval select(ArgKind e){
+					switch (e)
+					{
+						case arg_fn: return &evalSelect<C, T, FnArg>;
+						case arg_const: return &evalSelect<C, T, ConstArg>;
+						case arg_node: break;
+					}
+					return &evalSelect<C, T, NodeArg>;
+				}
+
+				template<class C>
+				static Eval select(ArgKind t, ArgKind e){
+					switch (t)
+					{
+						case arg_fn: return select<C, FnArg>(e);
+						case arg_const: return select<C, ConstArg>(e);
+						case arg_node: break;
+					}
+					return select<C, NodeArg>(e);
+				}
+
+				static Eval select(ArgKind c, ArgKind t, ArgKind e){
+					switch (c)
+					{
+						case arg_fn: return select<FnArg>(t, e);
+						case arg_const: return select<ConstArg>(t, e);
+						case arg_node: break;
+					}
+					return select<NodeArg>(t, e);
+				}
+
+				template<char Fn>
+				static Eval call(ArgKind a){
+					switch (a)
+					{
+						case arg_fn: return &evalCall<Fn, FnArg>;
+						case arg_const: return &evalCall<Fn, ConstArg>;
+						case arg_node: break;
+					}
+					return &evalCall<Fn, NodeArg>;
+				}
+
+				static Eval call(char fn, ArgKind a){
+					switch (fn)
+					{
+						case ast::fn_log: return call<ast::fn_log>(a);
+						case ast::fn_exp: return call<ast::fn_exp>(a);
+						case ast::fn_sqrt: return call<ast::fn_sqrt>(a);
+						case ast::fn_abs: return call<ast::fn_abs>(a);
+						case ast::fn_sigmoid: return call<ast::fn_sigmoid>(a);
+						case ast::fn_fast_log: return call<ast::fn_fast_log>(a);
+						case ast::fn_fast_exp: return call<ast::fn_fast_exp>(a);
+					}
+					return call<ast::fn_fast_sigmoid>(a);
+				}
+
+				template<char Fn, class A>
+				static Eval call(ArgKind b){
+					switch (b)
+					{
+						case arg_fn: return &evalCall<Fn, A, FnArg>;
+						case arg_const: return &evalCall<Fn, A, ConstArg>;
+						case arg_node: break;
+					}
+					return &evalCall<Fn, A, NodeArg>;
+				}
+
+				template<char Fn>
+				static Eval call(ArgKind a, ArgKind b){
+					switch (a)
+					{
+						case arg_fn: return call<Fn, FnArg>(b);
+						case arg_const: return call<Fn, ConstArg>(b);
+						case arg_node: break;
+					}
+					return call<Fn, NodeArg>(b);
+				}
+
+				static Eval call(char fn, ArgKind a, ArgKind b){
+					switch (fn)
+					{
+						case ast::fn_pow: return call<ast::fn_pow>(a, b);
+						case ast::fn_min: return call<ast::fn_min>(a, b);
+						case ast::fn_max: return call<ast::fn_max>(a, b);
+					}
+					return call<ast::fn_fast_pow>(a, b);
+				}
+
+				template<class X, class Lo>
+				static Eval clamp(ArgKind hi){
+					switch (hi)
+					{
+						case arg_fn: return &evalClamp<X, Lo, FnArg>;
+						case arg_const: return &evalClamp<X, Lo, ConstArg>;
+						case arg_node: break;
+					}
+					return &evalClamp<X, Lo, NodeArg>;
+				}
+
+				template<class X>
+				static Eval clamp(ArgKind lo, ArgKind hi){
+					switch (lo)
+					{
+						case arg_fn: return clamp<X, FnArg>(hi);
+						case arg_const: return clamp<X, ConstArg>(hi);
+						case arg_node: break;
+					}
+					return clamp<X, NodeArg>(hi);
+				}
+
+				static Eval clamp(ArgKind x, ArgKind lo, ArgKind hi){
+					switch (x)
+					{
+						case arg_fn: return clamp<FnArg>(lo, hi);
+						case arg_const: return clamp<ConstArg>(lo, hi);
+						case arg_node: break;
+					}
+					return clamp<NodeArg>(lo, hi);
+				}
+
+				// constants and functors are read in place, anything else gets its own closure
+				ArgKind arg(uint32_t i, Arg& a){
+					ast::Node const& n = tree[i];
+					a = Arg{0, 0, 0};
+					switch (n.kind)
+					{
+						case ast::node_const:
+							a.value = n.value;
+							return arg_const;
+						case ast::node_symbol:
+							// each functor cast out of the symbol table once, as by AstEvaluator
+							if(n.lhs >= symbol2fn.size()){
+								symbol2fn.resize(n.lhs+1, uint32_t(-1));
+							}
+							if(symbol2fn[n.lhs] == uint32_t(-1)){
+								symbol2fn[n.lhs] = uint32_t(fns.size());
+								fns.push_back(tree.Fn<Functor>(n.lhs));
+							}
+							a.fn = symbol2fn[n.lhs];
+							return arg_fn;
+						default:
+							a.node = build(i);
+							return arg_node;
+					}
+				}
+
+				// children are built first, so a closure only refers to closures before it
+				uint32_t build(uint32_t i){
+					ast::Node const& n = tree[i];
+					closure_type c;
+					if(n.kind == ast::node_neg || n.kind == ast::node_not){
+						c.eval = n.kind == ast::node_neg ? unary<'-'>(arg(n.lhs, c.lhs)) : unary<'!'>(arg(n.lhs, c.lhs));
+						c.rhs = Arg{0, 0, 0};
+					}else if(n.kind == ast::node_select){
+						// the branches are kept by a closure of their own, which is never evaluated
+						ArgKind k = arg(n.lhs, c.lhs);
+						closure_type arms;
+						arms.eval = nullptr;
+						ArgKind t = arg(n.rhs, arms.lhs);
+						ArgKind e = arg(n.alt, arms.rhs);
+						closures.push_back(arms);
+						c.rhs = Arg{0, 0, uint32_t(closures.size()-1)};
+						c.eval = select(k, t, e);
+					}else if(n.kind == ast::node_call && ast::Builtins(n.sign).arity == 3){
+						ArgKind x = arg(n.lhs, c.lhs);
+						closure_type bounds;
+						bounds.eval = nullptr;
+						ArgKind lo = arg(n.rhs, bounds.lhs);
+						ArgKind hi = arg(n.alt, bounds.rhs);
+						closures.push_back(bounds);
+						c.rhs = Arg{0, 0, uint32_t(closures.size()-1)};
+						c.eval = clamp(x, lo, hi);
+					}else if(n.kind == ast::node_call && ast::Builtins(n.sign).arity == 2){
+						ArgKind a = arg(n.lhs, c.lhs);
+						ArgKind b = arg(n.rhs, c.rhs);
+						c.eval = call(n.sign, a, b);
+					}else if(n.kind == ast::node_call){
+						c.eval = call(n.sign, arg(n.lhs, c.lhs));
+						c.rhs = Arg{0, 0, 0};
+					}else{
+						ArgKind l = arg(n.lhs, c.lhs);
+						ArgKind r = arg(n.rhs, c.rhs);
+						c.eval = binary(n.sign, l, r);
+					}
+					closures.push_back(c);
+					return uint32_t(closures.size()-1);
+				}
+
+			private:
+				ast::Tree const& tree;
+				std::vector<closure_type>& closures;
+				std::vector<Functor>& fns;
+				std::vector<uint32_t> symbol2fn;
+		};
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  The closure evaluator, cheap to build and without a dispatch loop, for
+	//  short-lived expressions where the jit or vm compilation wouldn't pay off
+	///////////////////////////////////////////////////////////////////////////
+	template<class Functor, class Evalee>
+	class ClosureEvaluator{
+		public:
+			using element_type = Evalee;
+
+			ClosureEvaluator(ast::Tree const& tree) : program(closure::Compiler<Functor, Evalee>::Compile(tree)){
+#if EXPR_PROFILE
+				site = profile::Register(tree.Source(), "closure");
+#endif
+			}
+
+			float operator()(element_type const& e) const{
+				EXPR_PROFILE_PROBE(probe, site, 1, profile::kSlots);
+				closure_type const& root = program.closures.back();
+				return root.eval(program.closures.data(), program.fns.data(), root, const_cast<Evalee*>(&e));
+			}
+
+			// no dispatch to amortize here, batch is a plain loop kept for api parity
+			void EvalBatch(element_type const* items, std::size_t n, float* out) const{
+				for(std::size_t i=0; i<n; ++i) out[i] = (*this)(batch::At(items, i));
+			}
+
+			void EvalBatch(element_type const* const* items, std::size_t n, float* out) const{
+				for(std::size_t i=0; i<n; ++i) out[i] = (*this)(batch::At(items, i));
+			}
+
+		private:
+			typedef closure::Closure<Functor, Evalee> closure_type;
+
+			typename closure::Compiler<Functor, Evalee>::Program program;
+#if EXPR_PROFILE
+			// expression totals only, no per-op counts
+			uint32_t site;
+#endif
+	};
+}
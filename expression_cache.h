@@ -0,0 +1,244 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint> // uint64_t
+#include <functional> // hash
+#include <list>
+#include <memory> // shared_ptr
+#include <mutex>
+#include <string>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+#include "flat_ast.h"
+
+namespace expr{
+	namespace cache{
+		struct Options
+		{
+			// independently locked partitions, each holding its share of the bounds below
+			std::size_t shards = 16;
+			std::size_t max_entries = 16384;
+			std::size_t max_bytes = 64u<<20;
+		};
+
+		struct Stats
+		{
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t evictions;
+			std::size_t entries;
+			std::size_t bytes;
+		};
+
+		// whitespace, as skipped by the grammar
+		template<class Char>
+		bool IsSpace(Char c){ return c==' ' || (c>='\t' && c<='\r'); }
+
+		// whether s[0..end) ends in a mantissa and its exponent mark, as "1e" before "-5"
+		template<class String>
+		bool InExponent(String const& s, std::size_t end){
+			return end >= 2 && (s[end-1]=='e' || s[end-1]=='E') && ((s[end-2]>='0' && s[end-2]<='9') || s[end-2]=='.');
+		}
+
+		// text with whitespace dropped where it separates nothing and other runs of it
+		// collapsed to one space. Blanks around '*', '/', brackets and signs are dropped,
+		// except next to an exponent sign, so "1e -5" stays invalid instead of becoming
+		// "1e-5". Expressions normalizing to the same text parse to the same program,
+		// provided symbol names contain neither whitespace nor operators
+		template<class String>
+		String Normalize(String const& text){
+			String out;
+			out.reserve(text.size());
+			for(std::size_t i=0; i<text.size(); ){
+				if(!IsSpace(text[i])){
+					out.push_back(text[i++]);
+					continue;
+				}
+				std::size_t j = i;
+				while(j < text.size() && IsSpace(text[j])) ++j;
+				if(!out.empty() && j < text.size()){
+					auto prev = out.back();
+					auto next = text[j];
+					bool separable = prev=='*' || prev=='/' || prev=='(' || prev==')'
+						|| next=='*' || next=='/' || next=='(' || next==')';
+					if(!separable && (next=='+' || next=='-')){
+						separable = !InExponent(out, out.size());
+					}
+					if(!separable && (prev=='+' || prev=='-')){
+						separable = !InExponent(out, out.size()-1);
+					}
+					if(!separable){
+						out.push_back(' ');
+					}
+				}
+				i = j;
+			}
+			return out;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Compiled expression cache in front of a grammar (CalcGrammar or
+	//  CalcParser), keyed by normalized text, evaluator kind and the grammar's
+	//  optimize options, programs compiled under options since replaced by
+	//  SetOptimizeOptions are no longer served and age out. Programs are
+	//  shared and immutable, safe to evaluate from any thread. Shards are LRU
+	//  ordered and evict their least recently used programs past their share
+	//  of the entry and byte bounds.
+	//  The grammar is held by reference and must outlive the cache
+	///////////////////////////////////////////////////////////////////////////
+	template<class Grammar>
+	class ExpressionCache{
+		public:
+			using func_type = typename Grammar::func_type;
+			using item_type = typename Grammar::item_type;
+			using string_type = typename Grammar::string_type;
+
+			explicit ExpressionCache(Grammar const& g, cache::Options const& options = cache::Options()) :
+				grammar(g),
+				shards(options.shards ? options.shards : 1),
+				max_entries((options.max_entries + shards.size() - 1) / shards.size()),
+				max_bytes((options.max_bytes + shards.size() - 1) / shards.size()){}
+
+			// the program for statement, parsed on a miss. Throws as Grammar::Parse for invalid
+			// statements, which are not cached
+			template<template<class, class> class Evaluator>
+			std::shared_ptr<Evaluator<func_type, item_type> const> Get(string_type const& statement){
+				typedef Evaluator<func_type, item_type> evaluator_type;
+				Key key{std::type_index(typeid(evaluator_type)), grammar.OptimizeGeneration(), cache::Normalize(statement)};
+				std::size_t hash = KeyHash()(key);
+				Shard& shard = shards[hash % shards.size()];
+				{
+					std::lock_guard<std::mutex> guard(shard.lock);
+					auto it = shard.index.find(key);
+					if(it != shard.index.end()){
+						shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+						hits.fetch_add(1, std::memory_order_relaxed);
+						return std::static_pointer_cast<evaluator_type const>(it->second->program);
+					}
+				}
+				misses.fetch_add(1, std::memory_order_relaxed);
+
+				// parsed outside the lock, a concurrent miss on the same key may parse it too and
+				// the first one inserted is kept
+				std::shared_ptr<evaluator_type const> program = std::make_shared<evaluator_type const>(
+					grammar.template Parse<Evaluator>(key.text));
+				std::size_t bytes = charge(key.text, *program);
+
+				std::lock_guard<std::mutex> guard(shard.lock);
+				auto it = shard.index.find(key);
+				if(it != shard.index.end()){
+					return std::static_pointer_cast<evaluator_type const>(it->second->program);
+				}
+				shard.lru.push_front(Entry{key, program, bytes});
+				shard.index.emplace(std::move(key), shard.lru.begin());
+				shard.bytes += bytes;
+				evict(shard);
+				return program;
+			}
+
+			cache::Stats GetStats() const{
+				cache::Stats stats{hits.load(std::memory_order_relaxed), misses.load(std::memory_order_relaxed),
+					evictions.load(std::memory_order_relaxed), 0, 0};
+				for(Shard const& shard : shards){
+					std::lock_guard<std::mutex> guard(shard.lock);
+					stats.entries += shard.lru.size();
+					stats.bytes += shard.bytes;
+				}
+				return stats;
+			}
+
+			// drops every program, those already handed out stay valid
+			void Clear(){
+				for(Shard& shard : shards){
+					std::lock_guard<std::mutex> guard(shard.lock);
+					shard.index.clear();
+					shard.lru.clear();
+					shard.bytes = 0;
+				}
+			}
+
+		private:
+			struct Key
+			{
+				std::type_index kind;
+				// the grammar's OptimizeGeneration
+				uint64_t generation;
+				string_type text;
+
+				bool operator==(Key const& other) const{
+					return kind == other.kind && generation == other.generation && text == other.text;
+				}
+			};
+
+			struct KeyHash
+			{
+				std::size_t operator()(Key const& k) const{
+					return std::hash<string_type>()(k.text) ^ ((k.kind.hash_code() + k.generation) * 0x9e3779b97f4a7c15ull);
+				}
+			};
+
+			struct Entry
+			{
+				Key key;
+				std::shared_ptr<void const> program;
+				std::size_t bytes;
+			};
+
+			struct Shard
+			{
+				mutable std::mutex lock;
+				// most recently used first
+				std::list<Entry> lru;
+				std::unordered_map<Key, typename std::list<Entry>::iterator, KeyHash> index;
+				std::size_t bytes = 0;
+			};
+
+			// the evaluator and its text, plus an upper bound of what it compiled to: a program has
+			// at most one node per character and each node compiles to about a node and a functor.
+			// Evaluators holding more than that report it, e.g. the jit's code pages
+			template<class Evaluator>
+			static std::size_t charge(string_type const& text, Evaluator const& program){
+				return sizeof(Entry) + sizeof(Evaluator) + 2*text.size()*sizeof(typename string_type::value_type)
+					+ text.size()*(sizeof(ast::Node) + sizeof(func_type)) + footprint(program, 0);
+			}
+
+			template<class Evaluator>
+			static auto footprint(Evaluator const& program, int) -> decltype(std::size_t(program.Footprint())){
+				return program.Footprint();
+			}
+
+			template<class Evaluator>
+			static std::size_t footprint(Evaluator const&, long){
+				return 0;
+			}
+
+			// the newest entry is kept even if it alone is over the bounds
+			void evict(Shard& shard){
+				while(shard.lru.size() > 1 && (shard.lru.size() > max_entries || shard.bytes > max_bytes)){
+					Entry const& victim = shard.lru.back();
+					shard.bytes -= victim.bytes;
+					shard.index.erase(victim.key);
+					shard.lru.pop_back();
+					evictions.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+
+		private:
+			Grammar const& grammar;
+			std::vector<Shard> shards;
+			const std::size_t max_entries;
+			const std::size_t max_bytes;
+			std::atomic<uint64_t> hits{0};
+			std::atomic<uint64_t> misses{0};
+			std::atomic<uint64_t> evictions{0};
+	};
+
+	// the cache is neither copyable nor movable, it is made on the heap for grammars of unnamed type
+	template<class Grammar>
+	std::unique_ptr<ExpressionCache<Grammar>> MakeCache(Grammar const& grammar, cache::Options const& options = cache::Options()){
+		return std::unique_ptr<ExpressionCache<Grammar>>(new ExpressionCache<Grammar>(grammar, options));
+	}
+}
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <boost/any.hpp> // any
+#include <boost/variant/apply_visitor.hpp> // apply_visitor
+
+#include <cstdint> // uint32_t
+#include <cstring> // strcmp
+#include <exception> // invalid_argument
+#include <memory> // shared_ptr
+#include <string>
+#include <vector>
+#include "raw_ast.h"
+
+namespace expr { namespace ast
+{
+	///////////////////////////////////////////////////////////////////////////
+	//  The flat AST: nodes in one array referencing their children by index,
+	//  functors kept once in a symbol table shared by every tree parsed with
+	//  the same grammar
+	///////////////////////////////////////////////////////////////////////////
+	enum NodeKind : uint8_t
+	{
+		node_const,   // value
+		node_symbol,  // lhs: position of the symbol in the symbol table
+		node_neg,     // -lhs
+		node_binary,  // lhs sign rhs
+		node_not,     // !lhs, 1 if lhs is 0 else 0
+		node_select,  // lhs ? rhs : alt
+		node_call     // built-in function sign of lhs, rhs, alt, as many as it takes
+	};
+
+	// operator of a binary node's sign: + - * / < > as themselves, the two-char ones as
+	// 'l' <=, 'g' >=, '=' ==, '!' !=, '&' &&, '|' ||. Comparisons and logical operators
+	// yield 1 or 0, a value is true when it is not 0, NaN included
+	inline char const* SignText(char sign){
+		switch (sign)
+		{
+			case 'l': return "<=";
+			case 'g': return ">=";
+			case '=': return "==";
+			case '!': return "!=";
+			case '&': return "&&";
+			case '|': return "||";
+			case '+': return "+";
+			case '-': return "-";
+			case '*': return "*";
+			case '/': return "/";
+			case '<': return "<";
+			case '>': return ">";
+		}
+		return "?";
+	}
+
+	// comparisons and logical operators, which yield 1 or 0
+	inline bool IsBoolean(char sign){
+		return sign != '+' && sign != '-' && sign != '*' && sign != '/';
+	}
+
+	// && and ||, whose rhs is only evaluated when lhs doesn't decide the result
+	inline bool IsLogical(char sign){
+		return sign == '&' || sign == '|';
+	}
+
+	// built-in functions by node_call sign
+	enum Builtin : char
+	{
+		fn_log,
+		fn_exp,
+		fn_sqrt,
+		fn_abs,
+		fn_sigmoid,   // 1/(1+exp(-x))
+		fn_pow,
+		fn_min,       // a < b ? a : b
+		fn_max,       // a > b ? a : b
+		fn_clamp,     // min(max(x, lo), hi)
+		// polynomial approximations of log, exp, sigmoid and pow, see OptimizeOptions::fast_functions
+		fn_fast_log,
+		fn_fast_exp,
+		fn_fast_sigmoid,
+		fn_fast_pow,
+		fn_count
+	};
+
+	struct BuiltinInfo
+	{
+		char const* name;
+		uint32_t arity;
+	};
+
+	// approximations are spelled as the function they approximate
+	inline BuiltinInfo const& Builtins(char fn){
+		static const BuiltinInfo info[fn_count] = {
+			{"log", 1}, {"exp", 1}, {"sqrt", 1}, {"abs", 1}, {"sigmoid", 1}, {"pow", 2}, {"min", 2}, {"max", 2},
+			{"clamp", 3}, {"log", 1}, {"exp", 1}, {"sigmoid", 1}, {"pow", 2}
+		};
+		return info[uint8_t(fn)];
+	}
+
+	// the function spelled name, fn_count if none
+	inline Builtin FindBuiltin(char const* name){
+		for(int fn=0; fn<fn_fast_log; ++fn){
+			if(std::strcmp(Builtins(char(fn)).name, name) == 0){
+				return Builtin(fn);
+			}
+		}
+		return fn_count;
+	}
+
+	// the approximation of fn, fn itself if it is exact anyway
+	inline Builtin FastBuiltin(char fn){
+		switch (fn)
+		{
+			case fn_log: return fn_fast_log;
+			case fn_exp: return fn_fast_exp;
+			case fn_sigmoid: return fn_fast_sigmoid;
+			case fn_pow: return fn_fast_pow;
+		}
+		return Builtin(fn);
+	}
+
+	struct Node
+	{
+		NodeKind kind;
+		char sign;
+		uint32_t lhs;
+		uint32_t rhs;
+		float value;
+		uint32_t alt;  // else branch of node_select, third argument of node_call
+	};
+
+	// symbol position -> boost::any holding the grammar's Functor
+	typedef std::vector<boost::any> SymbolTable;
+
+	// a program is a left fold, a chain a op b op c is stored as the left-deep (a op b) op c.
+	// Children are added before their parent, so the array is in evaluation order
+	class Tree
+	{
+		public:
+			Tree() = default;
+
+			// reserve: expected node count, the whole tree then lives in one allocation
+			explicit Tree(std::shared_ptr<SymbolTable const> table, std::size_t reserve=0) : symbols(std::move(table)){
+				nodes.reserve(reserve);
+			}
+
+			uint32_t Constant(float v){ return add(Node{node_const, 0, 0, 0, v, 0}); }
+			uint32_t Symbol(uint32_t index){ return add(Node{node_symbol, 0, index, 0, 0, 0}); }
+			uint32_t Negate(uint32_t child){ return add(Node{node_neg, '-', child, 0, 0, 0}); }
+			uint32_t Binary(char sign, uint32_t lhs, uint32_t rhs){ return add(Node{node_binary, sign, lhs, rhs, 0, 0}); }
+			uint32_t Not(uint32_t child){ return add(Node{node_not, '!', child, 0, 0, 0}); }
+			uint32_t Select(uint32_t cond, uint32_t then, uint32_t other){ return add(Node{node_select, '?', cond, then, 0, other}); }
+			// arguments past fn's arity are 0
+			uint32_t Call(char fn, uint32_t a, uint32_t b=0, uint32_t c=0){ return add(Node{node_call, fn, a, b, 0, c}); }
+
+			// the last node added unless set otherwise
+			uint32_t Root() const{ return root; }
+			void SetRoot(uint32_t r){ root = r; }
+
+			Node const& operator[](uint32_t i) const{ return nodes[i]; }
+			uint32_t Size() const{ return uint32_t(nodes.size()); }
+
+			std::shared_ptr<SymbolTable const> const& Symbols() const{ return symbols; }
+
+			// statement the tree was parsed from, empty for trees built otherwise. Keys profile counts
+			std::string const& Source() const{ return source; }
+			void SetSource(std::string text){ source = std::move(text); }
+
+			template<class Functor>
+			Functor Fn(uint32_t symbol) const{
+				return boost::any_cast<Functor>((*symbols)[symbol]);
+			}
+
+		private:
+			uint32_t add(Node const& n){
+				nodes.push_back(n);
+				return root = uint32_t(nodes.size()-1);
+			}
+
+		private:
+			std::vector<Node> nodes;
+			uint32_t root = 0;
+			std::shared_ptr<SymbolTable const> symbols;
+			std::string source;
+	};
+
+	// appends the nodes reachable from root in from to to, in evaluation order, and
+	// returns the index of the copied root. Both trees use the same symbol table
+	inline uint32_t CopyInto(Tree const& from, uint32_t root, Tree& to){
+		struct Copier
+		{
+			Tree const& from;
+			Tree& to;
+
+			uint32_t operator()(uint32_t i) const{
+				Node const& n = from[i];
+				switch (n.kind)
+				{
+					case node_const: return to.Constant(n.value);
+					case node_symbol: return to.Symbol(n.lhs);
+					case node_neg: return to.Negate((*this)(n.lhs));
+					case node_binary: {
+						uint32_t lhs = (*this)(n.lhs);
+						return to.Binary(n.sign, lhs, (*this)(n.rhs));
+					}
+					case node_not: return to.Not((*this)(n.lhs));
+					case node_select: {
+						uint32_t cond = (*this)(n.lhs);
+						uint32_t then = (*this)(n.rhs);
+						return to.Select(cond, then, (*this)(n.alt));
+					}
+					case node_call: {
+						uint32_t arity = Builtins(n.sign).arity;
+						uint32_t a = (*this)(n.lhs);
+						uint32_t b = arity > 1 ? (*this)(n.rhs) : 0;
+						return to.Call(n.sign, a, b, arity > 2 ? (*this)(n.alt) : 0);
+					}
+				}
+				BOOST_ASSERT(0);
+				return 0;
+			}
+		};
+		return Copier{from, to}(root);
+	}
+
+	// copy of the nodes reachable from root, in evaluation order
+	inline Tree Compact(Tree const& tree){
+		Tree compact(tree.Symbols(), tree.Size());
+		if(tree.Size()){
+			CopyInto(tree, tree.Root(), compact);
+		}
+		compact.SetSource(tree.Source());
+		return compact;
+	}
+
+	// a comparison, logical operator or condition among the nodes, which the register vm and
+	// the jit leave to the stack vm
+	inline bool HasConditions(Tree const& tree){
+		for(uint32_t i=0; i<tree.Size(); ++i){
+			Node const& n = tree[i];
+			if(n.kind == node_not || n.kind == node_select || (n.kind == node_binary && IsBoolean(n.sign))){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// a built-in function call among the nodes, also left to the stack vm
+	inline bool HasCalls(Tree const& tree){
+		for(uint32_t i=0; i<tree.Size(); ++i){
+			if(tree[i].kind == node_call){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// the grammar's functors in symbol order
+	template<class Functors>
+	std::shared_ptr<SymbolTable const> MakeSymbolTable(Functors const& fns){
+		auto table = std::make_shared<SymbolTable>();
+		for(auto const& fn : fns){
+			table->push_back(fn);
+		}
+		return table;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  ast::Program, as produced by CalcGrammar, to Tree
+	///////////////////////////////////////////////////////////////////////////
+	struct TreeBuilder
+	{
+		typedef uint32_t result_type;
+
+		Tree& tree;
+
+		result_type operator()(Nil) const { BOOST_ASSERT(0); return 0; }
+
+		result_type operator()(float n) const { return tree.Constant(n); }
+
+		result_type operator()(ScoreFn const& fn) const { return tree.Symbol(fn.index); }
+
+		result_type operator()(Operand const& op) const{
+			return boost::apply_visitor(*this,op);
+		}
+
+		// unary plus is the identity and is not stored
+		result_type operator()(Signed const& x) const{
+			result_type operand = (*this)(x.operand);
+			switch (x.sign)
+			{
+				case '-': return tree.Negate(operand);
+				case '!': return tree.Not(operand);
+			}
+			return operand;
+		}
+
+		result_type operator()(Call const& x) const{
+			if(x.args.size() != Builtins(x.fn).arity){
+				throw std::invalid_argument(std::string(Builtins(x.fn).name) + " takes "
+					+ std::to_string(Builtins(x.fn).arity) + " arguments");
+			}
+			uint32_t args[3] = {0, 0, 0};
+			uint32_t k = 0;
+			for(Program const& arg : x.args){
+				args[k++] = (*this)(arg);
+			}
+			return tree.Call(x.fn, args[0], args[1], args[2]);
+		}
+
+		// cond ? a : b comes as the operations '?' a and ':' b following cond
+		result_type operator()(Program const& x) const{
+			result_type state = (*this)(x.first);
+			for(auto it = x.rest.begin(); it != x.rest.end(); ++it){
+				if(it->sign == '?'){
+					result_type then = (*this)(it->operand);
+					++it;
+					BOOST_ASSERT(it != x.rest.end() && it->sign == ':');
+					state = tree.Select(state, then, (*this)(it->operand));
+				}else{
+					state = tree.Binary(it->sign, state, (*this)(it->operand));
+				}
+			}
+			return state;
+		}
+	};
+
+	inline Tree ToTree(Program const& prog, std::shared_ptr<SymbolTable const> table){
+		Tree tree(std::move(table));
+		tree.SetRoot(TreeBuilder{tree}(prog));
+		return tree;
+	}
+}}
@@ -1,37 +1,15 @@
 #pragma once
 
 #include "ast_evaluator.h"
+#include "binding.h"
+#include "optimizer.h"
 
 #include <boost/spirit/include/qi.hpp> // qi::xxx 
-#include <boost/type_traits.hpp> //  function_traits 
 
 #include <exception> //invalid_argument
 
 namespace expr
 {
-	// support function pointer, member object/function pointer
-	template<class F>
-	struct arg1_type : boost::false_type{};
-	template<class R, class T, class... U>
-	struct arg1_type<R(T,U...)> : boost::true_type{
-		using type = typename boost::remove_cv<
-					typename boost::remove_reference<T>::type
-				>::type;
-		
-	};
-	template<class R, class... A>
-	struct arg1_type<R(*)(A...)> : arg1_type<R(A...)>{};
-	template<class R, class... A>
-	struct arg1_type<R(&)(A...)> : arg1_type<R(A...)>{};
-	template<class R, class T>
-	struct arg1_type<R T::*> : arg1_type<void(T)>{};
-	// for (boost|std)::function<Sig> or std::mem_fn alike
-	template<class Sig, template<class> class Functor>
-	struct arg1_type<Functor<Sig>> : arg1_type<Sig>{};
-	// for boost::mem_fn alike
-	template<class R, class... A, template<class...> class Functor>
-	struct arg1_type<Functor<R,A...>> : arg1_type<R(A...)>{};
-
 	///////////////////////////////////////////////////////////////////////////////
 	//  The calculator grammar
 	///////////////////////////////////////////////////////////////////////////////
@@ -42,16 +20,50 @@ namespace expr
 		struct CalcGrammar : qi::grammar<Iterator, ast::Program(), ascii::space_type>
 	{
 		using func_type = Functor;
+		using item_type = Item;
 		using string_type = std::basic_string<typename std::iterator_traits<Iterator>::value_type>;
 
 		template<class Symbols, class Functors>
 		CalcGrammar(Symbols&& symbols, Functors&& fns) : CalcGrammar::base_type(expression),
-			symbol2fn(symbols, fns)
+			symbol2fn(symbols, ast::MakeScoreFns(fns)), table(ast::MakeSymbolTable(fns))
 		{
+			for(auto const& symbol : symbols){
+				if(names.size() == table->size()){
+					break;
+				}
+				names.push_back(string_type(symbol));
+			}
+
 			qi::float_type float_;
 			qi::char_type char_;
 
+			// ?: binds loosest and right to left, then || && == != < <= > >= + - * / as in C
 			expression =
+				logical_or
+				>> -(branch >> other)
+				;
+
+			branch = char_('?') >> expression;
+			other = char_(':') >> expression;
+
+			or_op.add("||", '|');
+			and_op.add("&&", '&');
+			equality_op.add("==", '=')("!=", '!');
+			relational_op.add("<", '<')("<=", 'l')(">", '>')(">=", 'g');
+
+			// built-in name(args), tried before the symbols so a symbol may share a name
+			// that isn't followed by '('
+			for(int fn=0; fn<ast::fn_fast_log; ++fn){
+				builtin.add(ast::Builtins(char(fn)).name, char(fn));
+			}
+			call = builtin >> '(' >> (expression % ',') >> ')';
+
+			logical_or = logical_and >> *(or_op >> logical_and);
+			logical_and = equality >> *(and_op >> equality);
+			equality = relational >> *(equality_op >> relational);
+			relational = additive >> *(relational_op >> additive);
+
+			additive =
 				term
 				>> *(   (char_('+') >> term)
 					|   (char_('-') >> term)
@@ -67,13 +79,41 @@ namespace expr
 
 			factor =
 				float_
+				|   call
                                 |   symbol2fn 
 				|   '(' >> expression >> ')'
 				|   (char_('-') >> factor)
 				|   (char_('+') >> factor)
+				|   (char_('!') >> factor)
 				;
 		}
 
+		// functors by symbol position, shared by every program parsed here
+		std::shared_ptr<ast::SymbolTable const> const& Symbols() const{
+			return table;
+		}
+
+		// names by symbol position, e.g. to check a vm::Image is bound to the symbols it was written for
+		std::vector<string_type> const& SymbolNames() const{
+			return names;
+		}
+
+		// optimization applied to every parsed program before it reaches an evaluator
+		void SetOptimizeOptions(ast::OptimizeOptions const& options){
+			optimize_options = options;
+			++optimize_generation;
+		}
+
+		// changes with every SetOptimizeOptions, e.g. to tell programs parsed before it from later ones
+		uint64_t OptimizeGeneration() const{
+			return optimize_generation;
+		}
+
+		// the optimized tree evaluators are built from, e.g. for ast::RangeAnalysis
+		ast::Tree ParseTree(string_type const& statement) const{
+			return doParse(statement);
+		}
+
 		AstEvaluator<Functor, Item> Parse(string_type const& statement) const{
 			return doParse(statement);
 		}
@@ -83,52 +123,57 @@ namespace expr
 			return doParse(statement);
 		}
 
+		// several statements for one evaluator taking their trees, e.g. MultiEvaluator
+		template<template<class, class> class Evaluator>
+		Evaluator<Functor, Item> Parse(std::vector<string_type> const& statements) const{
+			std::vector<ast::Tree> trees;
+			for(string_type const& statement : statements){
+				trees.push_back(doParse(statement));
+			}
+			return trees;
+		}
+
 		private:
-			expr::ast::Program doParse(string_type const& statement) const{
+			ast::Tree doParse(string_type const& statement) const{
 				expr::ast::Program program;
 				auto iter = statement.begin();
 				auto end = statement.end();
 				boost::spirit::ascii::space_type space;
 				bool r = boost::spirit::qi::phrase_parse(iter, end, *this, space, program);
 				if (r && iter == end){
-					return program; 
+					// a built-in with the wrong number of arguments parses, ToTree rejects it
+					try{
+						ast::Tree tree = ast::Optimize(ast::ToTree(program, table), optimize_options);
+						tree.SetSource(std::string(statement.begin(), statement.end()));
+						return tree;
+					}catch(std::invalid_argument const&){
+					}
 				}
 				throw std::invalid_argument("invalid statement:"+statement);
 			}
 
+			ast::OptimizeOptions optimize_options;
+			uint64_t optimize_generation = 0;
 			qi::symbols<char, ast::ScoreFn>  symbol2fn;
+			std::shared_ptr<ast::SymbolTable const> table;
+			std::vector<string_type> names;
+			// operator token -> binary node sign
+			qi::symbols<char, char> or_op, and_op, equality_op, relational_op;
+			// function name -> ast::Builtin
+			qi::symbols<char, char> builtin;
+			qi::rule<Iterator, ast::Call(), ascii::space_type> call;
 			qi::rule<Iterator, ast::Program(), ascii::space_type> expression;
+			qi::rule<Iterator, ast::Operation(), ascii::space_type> branch;
+			qi::rule<Iterator, ast::Operation(), ascii::space_type> other;
+			qi::rule<Iterator, ast::Program(), ascii::space_type> logical_or;
+			qi::rule<Iterator, ast::Program(), ascii::space_type> logical_and;
+			qi::rule<Iterator, ast::Program(), ascii::space_type> equality;
+			qi::rule<Iterator, ast::Program(), ascii::space_type> relational;
+			qi::rule<Iterator, ast::Program(), ascii::space_type> additive;
 			qi::rule<Iterator, ast::Program(), ascii::space_type> term;
 			qi::rule<Iterator, ast::Operand(), ascii::space_type> factor;
 	};
 
-	template<class StrType>
-	struct StringTraits{};
-	template<class CharType>
-	struct StringTraits<std::basic_string<CharType>>{
-		using char_type = CharType;
-	};
-	template<class CharType>
-	struct StringTraits<CharType*>{
-		using char_type = typename std::remove_const<CharType>::type;
-	};
-
-	template<class Keywords>
-	struct IteratorFromKeywords{
-		using value_type = typename Keywords::value_type; // basic_string or const char*
-		using string_type = std::basic_string<typename StringTraits<value_type>::char_type>;
-		using type = typename string_type::const_iterator;
-	};
-
-	template<class Container>
-	struct ContainedType{
-		using type = typename std::remove_const<
-				typename std::remove_reference<
-					typename Container::value_type				
-				>::type
-			>::type;
-	};
-
 	template<class Keywords, class Functors, 
 		class KeyIterator=typename IteratorFromKeywords<Keywords>::type, 
 		class Functor=typename ContainedType<Functors>::type>
@@ -137,15 +182,4 @@ namespace expr
 		return {keywords, fnList};
 	}
 
-	template<class Item>
-	struct TypeHint{
-		template<class Keywords, class Functors, 
-			class KeyIterator=typename IteratorFromKeywords<Keywords>::type, 
-			class Functor=typename ContainedType<Functors>::type>
-		static CalcGrammar<KeyIterator, Functor, Item> MakeGrammar(Keywords const& keywords, Functors const& fnList){
-			return {keywords, fnList};
-		}
-
-	};
-
 }
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm> // min, max
+#include <cmath> // isinf, isnan, fabs, log, exp, sqrt
+#include <limits>
+
+namespace expr{
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Closed float interval [lo, hi] bounding every value an expression can
+	//  take. Operations round their bounds as the evaluators round values, so
+	//  the bounds hold for the computed floats too. A result that may be NaN
+	//  widens to Full(), NaN itself is never bounded
+	///////////////////////////////////////////////////////////////////////////
+	struct Interval
+	{
+		float lo;
+		float hi;
+
+		static Interval Full(){
+			return Interval{-std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity()};
+		}
+
+		static Interval Point(float v){
+			return std::isnan(v) ? Full() : Interval{v, v};
+		}
+
+		bool Contains(float v) const{ return lo <= v && v <= hi; }
+	};
+
+	// smallest interval holding a, b, c and d, Full() if any is NaN
+	inline Interval Hull(float a, float b, float c, float d){
+		if(std::isnan(a) || std::isnan(b) || std::isnan(c) || std::isnan(d)){
+			return Interval::Full();
+		}
+		return Interval{std::min(std::min(a, b), std::min(c, d)), std::max(std::max(a, b), std::max(c, d))};
+	}
+
+	inline Interval operator-(Interval x){
+		return Interval{-x.hi, -x.lo};
+	}
+
+	// inf-inf is NaN, so the sums are checked as the products are
+	inline Interval operator+(Interval x, Interval y){
+		return Hull(x.lo + y.lo, x.hi + y.hi, x.lo + y.lo, x.hi + y.hi);
+	}
+
+	inline Interval operator-(Interval x, Interval y){
+		return Hull(x.lo - y.hi, x.hi - y.lo, x.lo - y.hi, x.hi - y.lo);
+	}
+
+	inline Interval operator*(Interval x, Interval y){
+		return Hull(x.lo*y.lo, x.lo*y.hi, x.hi*y.lo, x.hi*y.hi);
+	}
+
+	// a divisor that may be zero leaves the quotient unbounded
+	inline Interval operator/(Interval x, Interval y){
+		if(y.Contains(0)){
+			return Interval::Full();
+		}
+		return Hull(x.lo/y.lo, x.lo/y.hi, x.hi/y.lo, x.hi/y.hi);
+	}
+
+	// 1 or 0 where every pair of values compares alike, [0, 1] otherwise. Full() may hold
+	// NaN, which compares false to everything but by !=
+	inline Interval Truth(bool always, bool never){
+		return always ? Interval::Point(1) : never ? Interval::Point(0) : Interval{0, 1};
+	}
+
+	inline bool MayBeNaN(Interval x){
+		return std::isinf(x.lo) && std::isinf(x.hi) && x.lo < x.hi;
+	}
+
+	inline Interval Less(Interval x, Interval y){
+		return Truth(!MayBeNaN(x) && !MayBeNaN(y) && x.hi < y.lo, x.lo >= y.hi);
+	}
+
+	inline Interval LessEqual(Interval x, Interval y){
+		return Truth(!MayBeNaN(x) && !MayBeNaN(y) && x.hi <= y.lo, x.lo > y.hi);
+	}
+
+	inline Interval Equal(Interval x, Interval y){
+		return Truth(!MayBeNaN(x) && !MayBeNaN(y) && x.lo == x.hi && y.lo == y.hi && x.lo == y.lo, x.hi < y.lo || y.hi < x.lo);
+	}
+
+	// Equal is only ever true without NaN, so its negation is exact
+	inline Interval NotEqual(Interval x, Interval y){
+		Interval eq = Equal(x, y);
+		return Interval{1 - eq.hi, 1 - eq.lo};
+	}
+
+	inline Interval Not(Interval x){
+		return Truth(x.lo == 0 && x.hi == 0, !x.Contains(0));
+	}
+
+	inline Interval And(Interval x, Interval y){
+		return Truth(!x.Contains(0) && !y.Contains(0), (x.lo == 0 && x.hi == 0) || (y.lo == 0 && y.hi == 0));
+	}
+
+	inline Interval Or(Interval x, Interval y){
+		return Truth(!x.Contains(0) || !y.Contains(0), x.lo == 0 && x.hi == 0 && y.lo == 0 && y.hi == 0);
+	}
+
+	// cond ? then : other
+	inline Interval Select(Interval cond, Interval then, Interval other){
+		if(!cond.Contains(0)){
+			return then;
+		}
+		if(cond.lo == 0 && cond.hi == 0){
+			return other;
+		}
+		return Hull(then.lo, then.hi, other.lo, other.hi);
+	}
+
+	// a monotone function's bounds, computed within a few ulp as by std::log or the
+	// approximations, widened outward by far more than their error
+	inline Interval Widen(Interval x){
+		const float slack = 1.f/4096;
+		return Interval{std::isinf(x.lo) ? x.lo : x.lo - std::fabs(x.lo)*slack,
+			std::isinf(x.hi) ? x.hi : x.hi + std::fabs(x.hi)*slack};
+	}
+
+	inline Interval Log(Interval x){
+		if(x.lo < 0){
+			return Interval::Full();
+		}
+		return Widen(Interval{std::log(x.lo), std::log(x.hi)});
+	}
+
+	// the approximation flushes below the smallest normal float to 0
+	inline Interval Exp(Interval x){
+		if(MayBeNaN(x)){
+			return Interval::Full();
+		}
+		Interval y = Widen(Interval{std::exp(x.lo), std::exp(x.hi)});
+		return Interval{y.lo < std::numeric_limits<float>::min() ? 0 : y.lo, y.hi};
+	}
+
+	inline Interval Sigmoid(Interval x){
+		if(MayBeNaN(x)){
+			return Interval::Full();
+		}
+		Interval y = Widen(Interval{1 / (1 + std::exp(-x.lo)), 1 / (1 + std::exp(-x.hi))});
+		return Interval{std::max(y.lo, 0.f), std::min(y.hi, 1.f)};
+	}
+
+	// as exp(y*log(x)) for a positive x. std::pow of a zero or negative x may be
+	// -inf or finite where the approximation is NaN, so those get no bounds
+	inline Interval Pow(Interval x, Interval y){
+		if(!(x.lo > 0)){
+			return Interval::Full();
+		}
+		return Exp(y * Log(x));
+	}
+
+	// correctly rounded, so exact
+	inline Interval Sqrt(Interval x){
+		if(x.lo < 0){
+			return Interval::Full();
+		}
+		return Interval{std::sqrt(x.lo), std::sqrt(x.hi)};
+	}
+
+	inline Interval Abs(Interval x){
+		if(MayBeNaN(x)){
+			return Interval::Full();
+		}
+		if(x.lo >= 0){
+			return x;
+		}
+		if(x.hi <= 0){
+			return -x;
+		}
+		return Interval{0, std::max(-x.lo, x.hi)};
+	}
+
+	// a < b ? a : b, b when either is NaN
+	inline Interval Min(Interval a, Interval b){
+		if(MayBeNaN(b)){
+			return Interval::Full();
+		}
+		return Interval{std::min(a.lo, b.lo), std::min(a.hi, b.hi)};
+	}
+
+	inline Interval Max(Interval a, Interval b){
+		if(MayBeNaN(b)){
+			return Interval::Full();
+		}
+		return Interval{std::max(a.lo, b.lo), std::max(a.hi, b.hi)};
+	}
+
+	inline Interval Clamp(Interval x, Interval lo, Interval hi){
+		return Min(Max(x, lo), hi);
+	}
+}
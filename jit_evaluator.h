@@ -0,0 +1,428 @@
+#pragma once
+
+#include <cstring> // memcpy
+#include <cstddef> // ptrdiff_t
+#include <deque>
+#include <exception> // exception_ptr
+#include <limits> // quiet_NaN
+#include <memory> // shared_ptr
+#include <unordered_map>
+#include <vector>
+
+#include "flat_ast.h"
+#include "batch.h"
+#include "vm_evaluator.h"
+
+// native code generation is done for the System V x86-64 calling convention only,
+// other targets run JitEvaluator on the bytecode vm
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define EXPR_JIT_X86_64 1
+#include <sys/mman.h> // mmap, mprotect
+#include <unistd.h> // sysconf
+#else
+#define EXPR_JIT_X86_64 0
+#endif
+
+namespace expr{
+	namespace jit{
+#if EXPR_JIT_X86_64
+		// executable copy of the generated code, written once then remapped read+exec
+		class CodeBuffer{
+			public:
+				CodeBuffer(std::vector<uint8_t> const& code) : size(code.size()){
+					void* p = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+					if(p == MAP_FAILED){
+						return;
+					}
+					std::memcpy(p, code.data(), size);
+					if(mprotect(p, size, PROT_READ|PROT_EXEC) != 0){
+						munmap(p, size);
+						return;
+					}
+					page = p;
+				}
+
+				CodeBuffer(CodeBuffer const&) = delete;
+				CodeBuffer& operator=(CodeBuffer const&) = delete;
+
+				~CodeBuffer(){
+					if(page) munmap(page, size);
+				}
+
+				void* Entry() const{ return page; }
+
+				// mapped bytes, whole pages
+				std::size_t Bytes() const{
+					const std::size_t page_size = std::size_t(sysconf(_SC_PAGESIZE));
+					return page ? (size + page_size - 1) / page_size * page_size : 0;
+				}
+
+			private:
+				void* 	    page = nullptr;
+				std::size_t size;
+		};
+
+		enum Reg{ rax=0, rcx=1, rdx=2, rbx=3, rsp=4, rbp=5, rsi=6, rdi=7 };
+
+		// the handful of x86-64 instructions the code generator needs, scalar sse only
+		class Assembler{
+			public:
+				std::vector<uint8_t> const& Code() const{ return code; }
+
+				// movss xmm, [base+disp]
+				void MovssLoad(int xmm, int base, int32_t disp){ sseMem(0x10, xmm, base, disp); }
+				// movss [base+disp], xmm
+				void MovssStore(int base, int32_t disp, int xmm){ sseMem(0x11, xmm, base, disp); }
+
+				void Movss(int dst, int src){ sseReg(0xF3, 0x10, dst, src); }
+				void Addss(int dst, int src){ sseReg(0xF3, 0x58, dst, src); }
+				void Mulss(int dst, int src){ sseReg(0xF3, 0x59, dst, src); }
+				void Subss(int dst, int src){ sseReg(0xF3, 0x5C, dst, src); }
+				void Divss(int dst, int src){ sseReg(0xF3, 0x5E, dst, src); }
+				void Xorps(int dst, int src){ sseReg(0, 0x57, dst, src); }
+
+				// mov eax, bits(v); movd xmm, eax
+				void LoadConst(int xmm, float v){
+					uint32_t bits;
+					std::memcpy(&bits, &v, sizeof(bits));
+					byte(0xB8);
+					imm32(bits);
+					byte(0x66);
+					rex(false, xmm>=8, false);
+					byte(0x0F);
+					byte(0x6E);
+					modrm(3, xmm, rax);
+				}
+
+				// mov reg, imm64
+				void MovImm64(int reg, uint64_t v){
+					byte(0x48);
+					byte(0xB8+reg);
+					for(int i=0; i<8; ++i) byte(uint8_t(v >> (8*i)));
+				}
+
+				// mov dst, src
+				void Mov(int dst, int src){ byte(0x48); byte(0x89); modrm(3, src, dst); }
+				void CallRax(){ byte(0xFF); byte(0xD0); }
+				void Push(int reg){ byte(0x50+reg); }
+				void Pop(int reg){ byte(0x58+reg); }
+				void SubRsp(int32_t v){ byte(0x48); byte(0x81); modrm(3, 5, rsp); imm32(v); }
+				void AddRsp(int32_t v){ byte(0x48); byte(0x81); modrm(3, 0, rsp); imm32(v); }
+				void Ret(){ byte(0xC3); }
+
+			private:
+				// F3 [rex] 0F op modrm [sib] disp32, base is one of the low 8 gprs
+				void sseMem(uint8_t op, int xmm, int base, int32_t disp){
+					byte(0xF3);
+					rex(false, xmm>=8, false);
+					byte(0x0F);
+					byte(op);
+					modrm(2, xmm, base);
+					if(base == rsp) byte(0x24);
+					imm32(disp);
+				}
+
+				void sseReg(uint8_t prefix, uint8_t op, int dst, int src){
+					if(prefix) byte(prefix);
+					rex(false, dst>=8, src>=8);
+					byte(0x0F);
+					byte(op);
+					modrm(3, dst, src);
+				}
+
+				void rex(bool w, bool r, bool b){
+					if(w || r || b) byte(0x40 | (w<<3) | (r<<2) | int(b));
+				}
+
+				void modrm(int mod, int reg, int rm){ byte(uint8_t((mod<<6) | ((reg&7)<<3) | (rm&7))); }
+
+				void imm32(uint32_t v){
+					for(int i=0; i<4; ++i) byte(uint8_t(v >> (8*i)));
+				}
+
+				void byte(uint8_t b){ code.push_back(b); }
+
+			private:
+				std::vector<uint8_t> code;
+		};
+#endif
+
+		// per call state passed to the generated code. Generated frames have no unwind info, so an
+		// exception thrown by a functor is caught before it reaches them and rethrown by the caller
+		struct CallContext{
+			std::exception_ptr error;
+
+			void Rethrow() const{
+				if(error) std::rethrow_exception(error);
+			}
+		};
+
+		// generated code and the functors it calls into, immutable once built
+		template<class Functor, class Evalee>
+		struct Module{
+			typedef float (*Entry)(Evalee const*, CallContext*);
+
+			std::deque<Functor> fns; // deque keeps functor addresses baked into the code stable
+#if EXPR_JIT_X86_64
+			std::unique_ptr<CodeBuffer> code;
+#endif
+			Entry entry = nullptr;
+
+			// the module, its code pages and the functors' deque blocks, of 512 bytes as in libstdc++
+			std::size_t Bytes() const{
+				const std::size_t block = sizeof(Functor) > 512 ? sizeof(Functor) : 512;
+				std::size_t bytes = sizeof(*this) + (fns.size()*sizeof(Functor)/block + 1)*block + 8*sizeof(void*);
+#if EXPR_JIT_X86_64
+				bytes += code ? code->Bytes() : 0;
+#endif
+				return bytes;
+			}
+		};
+
+#if EXPR_JIT_X86_64
+		// lowers ast::Tree to `float(Evalee const*, CallContext*)` the way vm::Compiler lowers it to
+		// bytecode, except that stack slot i lives in xmm i and xmm15 is kept as scratch
+		template<class Functor, class Evalee>
+		struct Codegen
+		{
+			static const int kMaxDepth = 15;
+			static const int kScratch = 15;
+			// functors other than float members are called, item pointer then lives in rbx and
+			// the call context in rbp
+			static const bool kCalls = !ast::IsFloatMember<Functor>::value;
+
+			Codegen(Assembler& a, std::deque<Functor>& f) : as(a), fns(f){}
+
+			// called functors run once per distinct symbol before the expression, with no live xmm
+			// to spill, and each occurrence reloads the result from its frame slot
+			void Prologue(ast::Tree const& tree){
+				if(kCalls){
+					collect(tree, tree.Root());
+					// with the two pushes below keeps rsp 16-byte aligned at the calls
+					frame = 8 + 16*int32_t((symbols.size() + 3)/4);
+					as.Push(rbx);
+					as.Push(rbp);
+					as.Mov(rbx, rdi);
+					as.Mov(rbp, rsi);
+					as.SubRsp(frame);
+					for(uint32_t symbol : symbols){
+						call(tree.Fn<Functor>(symbol));
+						as.MovssStore(rsp, slots[symbol], 0);
+					}
+				}
+			}
+
+			void Epilogue(){
+				if(kCalls){
+					as.AddRsp(frame);
+					as.Pop(rbp);
+					as.Pop(rbx);
+				}
+				as.Ret();
+			}
+
+			void operator()(ast::Tree const& tree, uint32_t i){
+				ast::Node const& n = tree[i];
+				switch (n.kind)
+				{
+					case ast::node_const:
+						as.LoadConst(depth++, n.value);
+						break;
+					case ast::node_symbol:
+						load(tree.Fn<Functor>(n.lhs), n.lhs);
+						break;
+					case ast::node_neg:
+						(*this)(tree, n.lhs);
+						as.LoadConst(kScratch, -0.f);
+						as.Xorps(depth-1, kScratch);
+						break;
+					case ast::node_binary:
+						(*this)(tree, n.lhs);
+						(*this)(tree, n.rhs);
+						--depth;
+						switch (n.sign)
+						{
+							case '+': as.Addss(depth-1, depth); break;
+							case '-': as.Subss(depth-1, depth); break;
+							case '*': as.Mulss(depth-1, depth); break;
+							case '/': as.Divss(depth-1, depth); break;
+						}
+						break;
+					default:
+						// HasConditions and HasCalls trees are left to the vm
+						BOOST_ASSERT(0);
+						break;
+				}
+			}
+
+			private:
+				// movss xmm, [rdi+offset], member object pointers are plain offsets in the itanium abi
+				template<class F>
+				auto load(F fn, uint32_t)
+				-> typename std::enable_if<ast::IsFloatMember<F>::value>::type{
+					static_assert(sizeof(F) == sizeof(std::ptrdiff_t), "member object pointer expected to be an offset");
+					std::ptrdiff_t offset;
+					std::memcpy(&offset, &fn, sizeof(offset));
+					as.MovssLoad(depth++, rdi, int32_t(offset));
+				}
+
+				// movss xmm, [rsp+slot], filled by the prologue
+				template<class F>
+				auto load(F const&, uint32_t symbol)
+				-> typename std::enable_if<!ast::IsFloatMember<F>::value>::type{
+					as.MovssLoad(depth++, rsp, slots[symbol]);
+				}
+
+				// xmm0 = Trampoline(&fn, item, context)
+				void call(Functor const& fn){
+					fns.push_back(fn);
+					as.MovImm64(rdi, reinterpret_cast<uint64_t>(&fns.back()));
+					as.Mov(rsi, rbx);
+					as.Mov(rdx, rbp);
+					as.MovImm64(rax, reinterpret_cast<uint64_t>(&Trampoline));
+					as.CallRax();
+				}
+
+				// symbols reachable from i in evaluation order, as operator() visits them
+				void collect(ast::Tree const& tree, uint32_t i){
+					ast::Node const& n = tree[i];
+					switch (n.kind)
+					{
+						case ast::node_symbol:
+							if(!slots.count(n.lhs)){
+								slots[n.lhs] = 4*int32_t(symbols.size());
+								symbols.push_back(n.lhs);
+							}
+							break;
+						case ast::node_neg:
+							collect(tree, n.lhs);
+							break;
+						case ast::node_binary:
+							collect(tree, n.lhs);
+							collect(tree, n.rhs);
+							break;
+						default:
+							break;
+					}
+				}
+
+				// nothing may unwind through the generated code, the first exception is kept for the
+				// caller and the rest of the program runs on NaN without calling further functors
+				static float Trampoline(Functor const* fn, Evalee* item, CallContext* context) noexcept{
+					if(!context->error){
+						try{
+							return ast::EvalFn(*fn, item);
+						}catch(...){
+							context->error = std::current_exception();
+						}
+					}
+					return std::numeric_limits<float>::quiet_NaN();
+				}
+
+			private:
+				Assembler& as;
+				std::deque<Functor>& fns;
+				int depth = 0;
+				int32_t frame = 0;
+				// frame offset of each called symbol, in order of first occurrence
+				std::unordered_map<uint32_t, int32_t> slots;
+				std::vector<uint32_t> symbols;
+		};
+#endif
+
+		// nullptr when the program can't be compiled natively on this target
+		template<class Functor, class Evalee>
+		std::shared_ptr<Module<Functor, Evalee>> Compile(ast::Tree const& tree){
+#if EXPR_JIT_X86_64
+			if(!tree.Size() || vm::StackSize(tree) > uint32_t(Codegen<Functor, Evalee>::kMaxDepth)
+				|| ast::HasConditions(tree) || ast::HasCalls(tree)){
+				return nullptr;
+			}
+			auto module = std::make_shared<Module<Functor, Evalee>>();
+			Assembler as;
+			Codegen<Functor, Evalee> gen(as, module->fns);
+			gen.Prologue(tree);
+			gen(tree, tree.Root());
+			gen.Epilogue();
+			module->code.reset(new CodeBuffer(as.Code()));
+			if(module->code->Entry() == nullptr){
+				return nullptr;
+			}
+			module->entry = reinterpret_cast<typename Module<Functor, Evalee>::Entry>(module->code->Entry());
+			return module;
+#else
+			return nullptr;
+#endif
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  The native code evaluator, runs on the bytecode vm where it can't compile,
+	//  e.g. programs with conditions
+	///////////////////////////////////////////////////////////////////////////
+	template<class Functor, class Evalee>
+	class JitEvaluator{
+		public:
+			using element_type = Evalee;
+
+			JitEvaluator(ast::Tree const& tree) : module(jit::Compile<Functor, Evalee>(tree)){
+				if(module){
+					entry = module->entry;
+				}else{
+					fallback = std::make_shared<VMEvaluator<Functor, Evalee>>(tree);
+				}
+#if EXPR_PROFILE
+				site = profile::Register(tree.Source(), "jit");
+#endif
+			}
+
+			// a functor's exception propagates as from the vm
+			float operator()(element_type const& e) const{
+				EXPR_PROFILE_PROBE(probe, site, 1, profile::kSlots);
+				if(!entry){
+					return (*fallback)(e);
+				}
+				jit::CallContext context;
+				float v = entry(&e, &context);
+				context.Rethrow();
+				return v;
+			}
+
+			void EvalBatch(element_type const* items, std::size_t n, float* out) const{
+				EXPR_PROFILE_PROBE(probe, site, n, profile::kSlots);
+				if(!entry){
+					return fallback->EvalBatch(items, n, out);
+				}
+				jit::CallContext context;
+				for(std::size_t i=0; i<n; ++i) out[i] = entry(items+i, &context);
+				context.Rethrow();
+			}
+
+			void EvalBatch(element_type const* const* items, std::size_t n, float* out) const{
+				EXPR_PROFILE_PROBE(probe, site, n, profile::kSlots);
+				if(!entry){
+					return fallback->EvalBatch(items, n, out);
+				}
+				jit::CallContext context;
+				for(std::size_t i=0; i<n; ++i) out[i] = entry(items[i], &context);
+				context.Rethrow();
+			}
+
+			// false when running on the vm fallback
+			bool Native() const{ return entry != nullptr; }
+
+			// bytes held by the native code, e.g. for ExpressionCache to charge, 0 on the vm
+			// fallback whose program is about as big as its tree
+			std::size_t Footprint() const{ return module ? module->Bytes() : 0; }
+
+		private:
+			// shared and immutable, copies of an evaluator run the same code
+			std::shared_ptr<jit::Module<Functor, Evalee>> module;
+			typename jit::Module<Functor, Evalee>::Entry entry = nullptr;
+			std::shared_ptr<VMEvaluator<Functor, Evalee>> fallback;
+#if EXPR_PROFILE
+			// expression totals only, no per-op counts
+			uint32_t site;
+#endif
+	};
+}
@@ -12,6 +12,9 @@
 #include "grammar.h"
 #include "raw_evaluator.h"
 #include "vm_evaluator.h"
+#include "regvm_evaluator.h"
+#include "jit_evaluator.h"
+#include "closure_evaluator.h"
 
 namespace biz{
 	struct UserScore{ float like; float follow; float comment;
@@ -157,6 +160,9 @@ int main()
 		auto user_eval4 = gram4.Parse<expr::VMEvaluator>(str);	
 		auto user_eval5 = gram5.Parse<expr::VMEvaluator>(str);	
 		auto user_eval6 = gram6.Parse<expr::VMEvaluator>(str);	
+		auto user_eval7 = gram1.Parse<expr::JitEvaluator>(str);	
+		auto user_eval8 = gram1.Parse<expr::RegVMEvaluator>(str);	
+		auto user_eval9 = gram1.Parse<expr::ClosureEvaluator>(str);	
 
 		biz::UserScore user1 ={1,2,3}, user2={2,3,4};
 		// NOTE initializer_list<UserScore> won't work for user_eval4 here, b' initializer_list only return const iterator while fnList4 has non-const function
@@ -169,6 +175,9 @@ int main()
 			std::cout << "weighted score is : " << user_eval4(user) << '\n' << std::endl;
 			std::cout << "weighted score is : " << user_eval5(user) << '\n' << std::endl;
 			std::cout << "weighted score is : " << user_eval6(std::vector<float>({user.like, user.follow, user.comment})) << '\n' << std::endl;
+			std::cout << "weighted score is : " << user_eval7(user) << '\n' << std::endl;
+			std::cout << "weighted score is : " << user_eval8(user) << '\n' << std::endl;
+			std::cout << "weighted score is : " << user_eval9(user) << '\n' << std::endl;
 		}
 		std::cout << "-------------------------\n";
 	}
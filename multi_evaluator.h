@@ -0,0 +1,74 @@
+#pragma once
+
+#include <exception> // invalid_argument
+#include <memory> // shared_ptr
+#include <vector>
+#include "flat_ast.h"
+#include "vm_evaluator.h"
+
+namespace expr{
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Several formulas compiled into one vm program: every symbol functor is
+	//  called once per item and subexpressions shared by formulas are computed
+	//  once, each item producing a row of one score per formula, in the order
+	//  the formulas were given
+	///////////////////////////////////////////////////////////////////////////
+	template<class Functor, class Evalee>
+	class MultiEvaluator{
+		public:
+			using element_type = Evalee;
+
+			// trees: parsed by the same grammar, as by its Parse(statements)
+			MultiEvaluator(std::vector<ast::Tree> const& trees) : vm_ptr(compile(trees)){}
+
+			// scores per item
+			uint32_t Size() const{ return vm_ptr->Outputs(); }
+
+			// row: Size() floats
+			void operator()(element_type const& e, float* row) const{
+				vm_ptr->EvalRow(e, row);
+			}
+
+			std::vector<float> operator()(element_type const& e) const{
+				std::vector<float> row(Size());
+				vm_ptr->EvalRow(e, row.data());
+				return row;
+			}
+
+			// n rows of Size() floats into out, row i for items[i]. Not named EvalBatch, which
+			// ParallelEval and TopK take to write one score per item
+			void EvalRows(element_type const* items, std::size_t n, float* out) const{
+				vm_ptr->EvalBatch(items, n, out);
+			}
+
+			void EvalRows(element_type const* const* items, std::size_t n, float* out) const{
+				vm_ptr->EvalBatch(items, n, out);
+			}
+
+		private:
+			// the formulas copied side by side into one tree, one root each
+			static std::shared_ptr<vm::VirtualMachine<Functor, Evalee>> compile(std::vector<ast::Tree> const& trees){
+				if(trees.empty()){
+					throw std::invalid_argument("no formula to evaluate");
+				}
+				std::size_t size = 0;
+				for(ast::Tree const& t : trees){
+					size += t.Size();
+				}
+				ast::Tree merged(trees.front().Symbols(), size);
+				std::vector<uint32_t> roots;
+				std::string source;
+				for(ast::Tree const& t : trees){
+					BOOST_ASSERT(t.Symbols() == merged.Symbols());
+					roots.push_back(ast::CopyInto(t, t.Root(), merged));
+					source += (source.empty() ? "" : "; ") + t.Source();
+				}
+				merged.SetSource(source);
+				return vm::Compiler<Functor, Evalee>().Compile(merged, roots);
+			}
+
+		private:
+			std::shared_ptr<vm::VirtualMachine<Functor, Evalee> const> vm_ptr;
+	};
+}
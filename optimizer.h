@@ -0,0 +1,556 @@
+#pragma once
+
+#include <algorithm> // max
+#include <cmath> // frexp, isnormal, signbit
+#include <cstring> // memcpy
+#include <queue> // priority_queue
+#include <unordered_map>
+#include <vector>
+#include "analysis.h"
+#include "flat_ast.h"
+#include "simd.h"
+
+namespace expr { namespace ast
+{
+	struct OptimizeOptions
+	{
+		// constant folding and identity removal, results are bit exact with the unoptimized program.
+		// fast_math and fast_functions apply with or without it
+		bool fold = true;
+		// also x/c -> x*(1/c) for any c and x+0 -> x, and chains of + - and of * regrouped into
+		// balanced trees, see Reassociator. Results may round differently or differ in the sign of zero
+		bool fast_math = false;
+		// bounds of the symbols by position, e.g. like in [0, 1e7]. Rewrites fast_math would
+		// allow are made exact where the bounds rule out the values they differ on, e.g.
+		// x*0 -> 0 for x finite and positive
+		std::vector<Interval> ranges;
+		// log, exp, sigmoid and pow by polynomial approximations, within a few ulp of the
+		// standard library's and several times faster in batches, exp flushing below FLT_MIN
+		bool fast_functions = false;
+	};
+
+	inline float Apply(char sign, float lhs, float rhs){
+		switch (sign)
+		{
+			case '+': return lhs + rhs;
+			case '-': return lhs - rhs;
+			case '*': return lhs * rhs;
+			case '/': return lhs / rhs;
+			case '<': return lhs < rhs;
+			case '>': return lhs > rhs;
+			case 'l': return lhs <= rhs;
+			case 'g': return lhs >= rhs;
+			case '=': return lhs == rhs;
+			case '!': return lhs != rhs;
+			case '&': return lhs != 0 && rhs != 0;
+			case '|': return lhs != 0 || rhs != 0;
+		}
+		BOOST_ASSERT(0);
+		return 0;
+	}
+
+	// built-in fn of its arguments, those past its arity ignored
+	inline float ApplyBuiltin(char fn, float a, float b, float c){
+		switch (fn)
+		{
+			case fn_log: return simd::Log::Apply(a);
+			case fn_exp: return simd::Exp::Apply(a);
+			case fn_sqrt: return simd::Sqrt::Apply(a);
+			case fn_abs: return simd::Abs::Apply(a);
+			case fn_sigmoid: return simd::Sigmoid::Apply(a);
+			case fn_pow: return simd::Pow::Apply(a, b);
+			case fn_min: return simd::Min::Apply(a, b);
+			case fn_max: return simd::Max::Apply(a, b);
+			case fn_clamp: return simd::Min::Apply(simd::Max::Apply(a, b), c);
+			case fn_fast_log: return simd::FastLog::Apply(a);
+			case fn_fast_exp: return simd::FastExp::Apply(a);
+			case fn_fast_sigmoid: return simd::FastSigmoid::Apply(a);
+			case fn_fast_pow: return simd::FastPow::Apply(a, b);
+		}
+		BOOST_ASSERT(0);
+		return 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Constant folding and algebraic simplification, from one tree into another
+	///////////////////////////////////////////////////////////////////////////
+	struct ConstantFolder
+	{
+		OptimizeOptions const& options;
+		Tree const& in;
+		Tree& out;
+		// bounds of the nodes of out, filled as far as asked for
+		mutable std::vector<Interval> bounds;
+
+		// index in out of the folded node i of in
+		uint32_t operator()(uint32_t i) const{
+			Node const& n = in[i];
+			switch (n.kind)
+			{
+				case node_const: return out.Constant(n.value);
+				case node_symbol: return out.Symbol(n.lhs);
+				case node_neg: return negate((*this)(n.lhs));
+				case node_binary: {
+					uint32_t lhs = (*this)(n.lhs);
+					if(IsLogical(n.sign)){
+						return logical(n.sign, lhs, n.rhs);
+					}
+					return binary(n.sign, lhs, (*this)(n.rhs));
+				}
+				case node_not: {
+					uint32_t c = (*this)(n.lhs);
+					int t = truth(c);
+					return t < 0 ? out.Not(c) : out.Constant(float(!t));
+				}
+				// a known condition leaves only the branch taken
+				case node_select: {
+					uint32_t cond = (*this)(n.lhs);
+					int t = truth(cond);
+					if(t >= 0){
+						return (*this)(t ? n.rhs : n.alt);
+					}
+					uint32_t then = (*this)(n.rhs);
+					return out.Select(cond, then, (*this)(n.alt));
+				}
+				case node_call: return call(n);
+			}
+			BOOST_ASSERT(0);
+			return 0;
+		}
+
+		private:
+			// nodes are added children first, so the bounds of out are filled forward
+			Interval range(uint32_t i) const{
+				while(bounds.size() <= i){
+					bounds.push_back(NodeRange(out[uint32_t(bounds.size())], bounds.data(), options.ranges));
+				}
+				return bounds[i];
+			}
+
+			// finite and nonzero, whose sum with 0 is exact and product with 0 is a zero of known sign
+			bool finiteNonZero(uint32_t i) const{
+				return !options.ranges.empty() && FiniteNonZero(range(i));
+			}
+
+			// 1 or 0 when node i of out is known to be true or false, -1 otherwise
+			int truth(uint32_t i) const{
+				if(out[i].kind == node_const){
+					return out[i].value != 0;
+				}
+				if(options.ranges.empty()){
+					return -1;
+				}
+				Interval x = range(i);
+				return !x.Contains(0) ? 1 : x.lo == 0 && x.hi == 0 ? 0 : -1;
+			}
+
+			// yields 1 or 0 only
+			bool boolean(uint32_t i) const{
+				Node const& n = out[i];
+				return n.kind == node_not || (n.kind == node_binary && IsBoolean(n.sign));
+			}
+
+			// x != 0
+			uint32_t test(uint32_t i) const{
+				return boolean(i) ? i : out.Binary('!', i, out.Constant(0));
+			}
+
+			// l && r, l || r with r node r of in, folded only when l doesn't decide the result.
+			// Functors are pure, so a side known to decide it drops the other
+			uint32_t logical(char sign, uint32_t l, uint32_t in_r) const{
+				const int decisive = sign == '|';
+				int tl = truth(l);
+				if(tl == decisive){
+					return out.Constant(float(decisive));
+				}
+				uint32_t r = (*this)(in_r);
+				int tr = truth(r);
+				if(tr == decisive){
+					return out.Constant(float(decisive));
+				}
+				if(tl >= 0){
+					return tr >= 0 ? out.Constant(float(tr)) : test(r);
+				}
+				return tr >= 0 ? test(l) : out.Binary(sign, l, r);
+			}
+
+			// calls of constants are computed as the evaluators would, approximations included
+			uint32_t call(Node const& n) const{
+				const uint32_t arity = Builtins(n.sign).arity;
+				const char fn = options.fast_functions ? char(FastBuiltin(n.sign)) : n.sign;
+				uint32_t args[3] = {0, 0, 0};
+				bool constant = true;
+				for(uint32_t k=0; k<arity; ++k){
+					args[k] = (*this)(k == 0 ? n.lhs : k == 1 ? n.rhs : n.alt);
+					constant = constant && out[args[k]].kind == node_const;
+				}
+				if(constant){
+					return out.Constant(ApplyBuiltin(fn, out[args[0]].value, out[args[1]].value, out[args[2]].value));
+				}
+				return out.Call(fn, args[0], args[1], args[2]);
+			}
+
+			uint32_t negate(uint32_t c) const{
+				if(out[c].kind == node_const){
+					return out.Constant(-out[c].value);
+				}
+				// -(-x) -> x
+				if(out[c].kind == node_neg){
+					return out[c].lhs;
+				}
+				return out.Negate(c);
+			}
+
+			uint32_t binary(char sign, uint32_t l, uint32_t r) const{
+				const bool lc = out[l].kind == node_const;
+				const bool rc = out[r].kind == node_const;
+				// c op c
+				if(lc && rc){
+					return out.Constant(Apply(sign, out[l].value, out[r].value));
+				}
+				// comparisons decided by the bounds of their operands
+				if(!options.ranges.empty() && IsBoolean(sign)){
+					range(std::max(l, r));
+					Interval x = NodeRange(Node{node_binary, sign, l, r, 0, 0}, bounds.data(), options.ranges);
+					if(x.lo == x.hi){
+						return out.Constant(x.lo);
+					}
+				}
+				if(lc){
+					float c = out[l].value;
+					// 1*x, 0+x
+					if((sign=='*' && c==1) || (sign=='+' && c==0 && (std::signbit(c) || options.fast_math || finiteNonZero(r)))){
+						return r;
+					}
+					// 0*x for x finite and nonzero
+					if(sign=='*' && c==0 && finiteNonZero(r)){
+						return out.Constant(range(r).lo > 0 ? c : -c);
+					}
+				}
+				if(rc){
+					float c = out[r].value;
+					// x*1, x/1, x-(+0), x+(-0) are exact, x+(+0) only differs for x == -0
+					if(((sign=='*' || sign=='/') && c==1)
+						|| (sign=='-' && c==0 && !std::signbit(c))
+						|| (sign=='+' && c==0 && (std::signbit(c) || options.fast_math || finiteNonZero(l)))){
+						return l;
+					}
+					// x*0 for x finite and nonzero
+					if(sign=='*' && c==0 && finiteNonZero(l)){
+						return out.Constant(range(l).lo > 0 ? c : -c);
+					}
+					// x/c -> x*(1/c), exact whenever c is a power of two with a normal reciprocal
+					if(sign=='/' && c!=0){
+						int exp;
+						float reciprocal = 1 / c;
+						bool exact = std::frexp(c, &exp) == 0.5f || std::frexp(c, &exp) == -0.5f;
+						if(std::isnormal(reciprocal) && (exact || options.fast_math)){
+							return out.Binary('*', l, out.Constant(reciprocal));
+						}
+					}
+				}
+				return out.Binary(sign, l, r);
+			}
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Reassociation, under fast_math: a chain of + and -, or of *, is split
+	//  into its terms and rebuilt pairing the two shallowest operands first,
+	//  so a sum of n leaves takes log2(n) dependent adds rather than n-1 and
+	//  a deep term is added last. Constants of a chain are folded into one
+	///////////////////////////////////////////////////////////////////////////
+	struct Reassociator
+	{
+		Tree const& in;
+		Tree& out;
+		// ops on the longest path from a leaf to each node of out, filled as far as asked for
+		std::vector<uint32_t> heights;
+
+		// index in out of the reassociated node i of in
+		uint32_t operator()(uint32_t i){
+			Node const& n = in[i];
+			switch (n.kind)
+			{
+				case node_const: return out.Constant(n.value);
+				case node_symbol: return out.Symbol(n.lhs);
+				case node_neg:
+					return additive(in[n.lhs]) ? chain('+', i) : out.Negate((*this)(n.lhs));
+				case node_binary: {
+					if(additive(n) || n.sign == '*'){
+						return chain(n.sign == '*' ? '*' : '+', i);
+					}
+					uint32_t lhs = (*this)(n.lhs);
+					return out.Binary(n.sign, lhs, (*this)(n.rhs));
+				}
+				case node_not: return out.Not((*this)(n.lhs));
+				case node_select: {
+					uint32_t cond = (*this)(n.lhs);
+					uint32_t then = (*this)(n.rhs);
+					return out.Select(cond, then, (*this)(n.alt));
+				}
+				case node_call: {
+					uint32_t arity = Builtins(n.sign).arity;
+					uint32_t a = (*this)(n.lhs);
+					uint32_t b = arity > 1 ? (*this)(n.rhs) : 0;
+					return out.Call(n.sign, a, b, arity > 2 ? (*this)(n.alt) : 0);
+				}
+			}
+			BOOST_ASSERT(0);
+			return 0;
+		}
+
+		private:
+			// a term of a chain, node of out, subtracted when negative. seq orders equal heights
+			// by their position in the chain, keeping the grouping balanced
+			struct Term
+			{
+				uint32_t node;
+				bool negative;
+				uint32_t height;
+				uint32_t seq;
+
+				bool operator<(Term const& t) const{
+					return height != t.height ? height > t.height : seq > t.seq;
+				}
+			};
+
+			static bool additive(Node const& n){
+				return n.kind == node_binary && (n.sign == '+' || n.sign == '-');
+			}
+
+			uint32_t height(uint32_t j){
+				while(heights.size() <= j){
+					Node const& n = out[uint32_t(heights.size())];
+					uint32_t h = 0;
+					switch (n.kind)
+					{
+						case node_const:
+						case node_symbol: break;
+						case node_neg:
+						case node_not: h = heights[n.lhs] + 1; break;
+						case node_binary: h = std::max(heights[n.lhs], heights[n.rhs]) + 1; break;
+						case node_select: h = std::max(heights[n.lhs], std::max(heights[n.rhs], heights[n.alt])) + 1; break;
+						case node_call: {
+							uint32_t arity = Builtins(n.sign).arity;
+							h = std::max(heights[n.lhs], std::max(arity > 1 ? heights[n.rhs] : 0, arity > 2 ? heights[n.alt] : 0)) + 1;
+							break;
+						}
+					}
+					heights.push_back(h);
+				}
+				return heights[j];
+			}
+
+			// the operands of the chain through node i of in, constants summed or multiplied into c
+			void collect(char op, uint32_t i, bool negative, std::vector<uint32_t>& terms,
+					std::vector<bool>& signs, float& c){
+				Node const& n = in[i];
+				if(op == '+' && additive(n)){
+					collect(op, n.lhs, negative, terms, signs, c);
+					collect(op, n.rhs, n.sign == '-' ? !negative : negative, terms, signs, c);
+					return;
+				}
+				// -(a+b) is -a-b exactly, -x a subtracted term
+				if(op == '+' && n.kind == node_neg){
+					collect(op, n.lhs, !negative, terms, signs, c);
+					return;
+				}
+				if(op == '*' && n.kind == node_binary && n.sign == '*'){
+					collect(op, n.lhs, false, terms, signs, c);
+					collect(op, n.rhs, false, terms, signs, c);
+					return;
+				}
+				uint32_t j = (*this)(i);
+				if(out[j].kind == node_const){
+					float v = negative ? -out[j].value : out[j].value;
+					c = op == '+' ? c + v : c * v;
+					return;
+				}
+				terms.push_back(j);
+				signs.push_back(negative);
+			}
+
+			uint32_t chain(char op, uint32_t i){
+				std::vector<uint32_t> terms;
+				std::vector<bool> signs;
+				const float identity = op == '+' ? 0.f : 1.f;
+				float c = identity;
+				collect(op, i, false, terms, signs, c);
+				if(terms.empty()){
+					return out.Constant(c);
+				}
+				std::priority_queue<Term> heap;
+				uint32_t seq = 0;
+				for(std::size_t k=0; k<terms.size(); ++k){
+					heap.push(Term{terms[k], signs[k], height(terms[k]), seq++});
+				}
+				// -0 is the identity of +, x+0 -> x is a fast_math rewrite anyway
+				if(c != identity){
+					heap.push(Term{out.Constant(c), false, 0, seq++});
+				}
+				while(heap.size() > 1){
+					Term a = heap.top();
+					heap.pop();
+					Term b = heap.top();
+					heap.pop();
+					// a-b for one subtracted operand, -(a+b) carried up for two
+					uint32_t j = a.negative == b.negative ? out.Binary(op, a.node, b.node)
+						: a.negative ? out.Binary('-', b.node, a.node) : out.Binary('-', a.node, b.node);
+					heap.push(Term{j, a.negative && b.negative, height(j), seq++});
+				}
+				Term root = heap.top();
+				return root.negative ? out.Negate(root.node) : root.node;
+			}
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Common subexpressions: hash-consed numbering of the nodes reachable from
+	//  the root, or roots, equal subtrees get equal numbers
+	///////////////////////////////////////////////////////////////////////////
+	class ValueNumbering
+	{
+		public:
+			typedef uint32_t result_type;
+
+			void Number(Tree const& tree){
+				numbers.assign(tree.Size(), 0);
+				if(tree.Size()){
+					number(tree, tree.Root());
+				}
+			}
+
+			// nodes reachable from any of roots, counts summed over all of them
+			void Number(Tree const& tree, std::vector<uint32_t> const& roots){
+				numbers.assign(tree.Size(), 0);
+				for(uint32_t root : roots){
+					number(tree, root);
+				}
+			}
+
+			// number of node i
+			result_type Of(uint32_t i) const{ return numbers[i]; }
+
+			// occurrences of the subexpression in the tree
+			uint32_t Count(result_type vn) const{ return counts[vn]; }
+
+			bool IsConstant(result_type vn) const{ return kinds[vn] == 'c'; }
+
+		private:
+			result_type number(Tree const& tree, uint32_t i){
+				Node const& n = tree[i];
+				result_type vn = 0;
+				switch (n.kind)
+				{
+					case node_const: {
+						uint32_t bits;
+						std::memcpy(&bits, &n.value, sizeof(bits));
+						vn = intern('c', bits, 0);
+						break;
+					}
+					case node_symbol: vn = intern('s', n.lhs, 0); break;
+					case node_neg: vn = intern('n', number(tree, n.lhs), 0); break;
+					case node_binary: {
+						result_type lhs = number(tree, n.lhs);
+						vn = intern(n.sign, lhs, number(tree, n.rhs));
+						break;
+					}
+					case node_not: vn = intern('~', number(tree, n.lhs), 0); break;
+					// the branches are numbered as a pair, which is never a node itself
+					case node_select: {
+						result_type cond = number(tree, n.lhs);
+						result_type then = number(tree, n.rhs);
+						vn = intern('?', cond, intern(':', then, number(tree, n.alt)));
+						break;
+					}
+					// keyed by the function, a third argument paired with the second
+					case node_call: {
+						const uint32_t arity = Builtins(n.sign).arity;
+						result_type a = number(tree, n.lhs);
+						result_type b = arity > 1 ? number(tree, n.rhs) : 0;
+						vn = intern(n.sign, a, arity > 2 ? intern(',', b, number(tree, n.alt)) : b);
+						break;
+					}
+				}
+				++counts[vn];
+				return numbers[i] = vn;
+			}
+
+			struct Key
+			{
+				char kind;
+				uint32_t lhs;
+				uint32_t rhs;
+
+				bool operator==(Key const& k) const{
+					return kind == k.kind && lhs == k.lhs && rhs == k.rhs;
+				}
+			};
+
+			struct KeyHash
+			{
+				std::size_t operator()(Key const& k) const{
+					uint64_t h = (uint64_t(k.lhs) << 32 | k.rhs) * 0x9E3779B97F4A7C15ull;
+					return std::size_t(h ^ (h >> 29) ^ uint64_t(uint8_t(k.kind)));
+				}
+			};
+
+			result_type intern(char kind, uint32_t lhs, uint32_t rhs){
+				auto it = table.emplace(Key{kind, lhs, rhs}, result_type(counts.size()));
+				if(it.second){
+					counts.push_back(0);
+					kinds.push_back(kind);
+				}
+				return it.first->second;
+			}
+
+		private:
+			std::unordered_map<Key, result_type, KeyHash> table;
+			// node index -> value number
+			std::vector<result_type> numbers;
+			std::vector<uint32_t> counts;
+			std::vector<char> kinds;
+	};
+
+	// tree with its built-in calls replaced by their approximations, node for node. The folder
+	// does this itself, for trees that aren't folded
+	inline Tree FastFunctions(Tree const& tree){
+		Tree out(tree.Symbols(), tree.Size());
+		for(uint32_t i=0; i<tree.Size(); ++i){
+			Node const& n = tree[i];
+			switch (n.kind)
+			{
+				case node_const: out.Constant(n.value); break;
+				case node_symbol: out.Symbol(n.lhs); break;
+				case node_neg: out.Negate(n.lhs); break;
+				case node_binary: out.Binary(n.sign, n.lhs, n.rhs); break;
+				case node_not: out.Not(n.lhs); break;
+				case node_select: out.Select(n.lhs, n.rhs, n.alt); break;
+				case node_call: out.Call(char(FastBuiltin(n.sign)), n.lhs, n.rhs, n.alt); break;
+			}
+		}
+		out.SetRoot(tree.Root());
+		out.SetSource(tree.Source());
+		return out;
+	}
+
+	// taken by value, an unoptimized tree is moved through instead of copied
+	inline Tree Optimize(Tree tree, OptimizeOptions const& options){
+		if(!tree.Size() || (!options.fold && !options.fast_math && !options.fast_functions)){
+			return tree;
+		}
+		if(options.fold){
+			Tree folded(tree.Symbols(), tree.Size());
+			folded.SetRoot(ConstantFolder{options, tree, folded, {}}(tree.Root()));
+			tree = std::move(folded);
+		}else if(options.fast_functions){
+			tree = FastFunctions(tree);
+		}
+		if(options.fast_math){
+			Tree balanced(tree.Symbols(), tree.Size());
+			balanced.SetRoot(Reassociator{tree, balanced, {}}(tree.Root()));
+			return Compact(balanced);
+		}
+		// folding leaves the nodes it replaced behind
+		return options.fold ? Compact(tree) : tree;
+	}
+}}
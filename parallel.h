@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm> // min
+#include <atomic>
+#include <deque>
+#include <exception> // exception_ptr
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+
+namespace expr{
+	namespace parallel{
+
+		// item indices [begin, end)
+		struct Range{
+			std::size_t begin;
+			std::size_t end;
+		};
+
+		// chunks owned by one worker, the owner takes from the back (most recently pushed,
+		// still warm in its cache) while idle workers steal from the front
+		class WorkQueue{
+			public:
+				void Push(Range r){
+					std::lock_guard<std::mutex> guard(lock);
+					chunks.push_back(r);
+				}
+
+				bool Pop(Range& r){
+					std::lock_guard<std::mutex> guard(lock);
+					if(chunks.empty()) return false;
+					r = chunks.back();
+					chunks.pop_back();
+					return true;
+				}
+
+				bool Steal(Range& r){
+					std::lock_guard<std::mutex> guard(lock);
+					if(chunks.empty()) return false;
+					r = chunks.front();
+					chunks.pop_front();
+					return true;
+				}
+
+			private:
+				std::mutex 	  lock;
+				std::deque<Range> chunks;
+		};
+
+		// items per chunk: big enough to amortize queue locking, small enough to leave
+		// every worker a few dozen chunks to balance with
+		inline std::size_t ChunkSize(std::size_t n, std::size_t threads){
+			std::size_t chunk = n / (threads*32) / batch::kBlockSize * batch::kBlockSize;
+			return chunk < 16*batch::kBlockSize ? 16*batch::kBlockSize : chunk;
+		}
+
+		template<class Evaluator, class Items>
+		void Run(Evaluator const& evaluator, Items items, std::size_t n, float* out, std::size_t threads){
+			if(threads == 0){
+				threads = std::thread::hardware_concurrency();
+			}
+			const std::size_t chunk = ChunkSize(n, threads ? threads : 1);
+			const std::size_t chunks = (n + chunk - 1) / chunk;
+			if(threads > chunks){
+				threads = chunks;
+			}
+			if(threads <= 1){
+				evaluator.EvalBatch(items, n, out);
+				return;
+			}
+
+			// worker w starts with a contiguous share of the chunks
+			std::vector<WorkQueue> queues(threads);
+			for(std::size_t c=0; c<chunks; ++c){
+				Range r{c*chunk, std::min(n, (c+1)*chunk)};
+				queues[c*threads/chunks].Push(r);
+			}
+
+			std::exception_ptr error;
+			std::mutex error_lock;
+			std::atomic<bool> failed(false);
+
+			auto work = [&](std::size_t self){
+				try{
+					Range r;
+					while(!failed.load(std::memory_order_relaxed)){
+						bool found = queues[self].Pop(r);
+						// nothing is pushed after start, so all queues empty means all work is taken
+						for(std::size_t k=1; !found && k<threads; ++k){
+							found = queues[(self+k)%threads].Steal(r);
+						}
+						if(!found) break;
+						evaluator.EvalBatch(items+r.begin, r.end-r.begin, out+r.begin);
+					}
+				}catch(...){
+					std::lock_guard<std::mutex> guard(error_lock);
+					if(!error) error = std::current_exception();
+					failed = true;
+				}
+			};
+
+			std::vector<std::thread> workers;
+			for(std::size_t w=1; w<threads; ++w){
+				workers.emplace_back(work, w);
+			}
+			work(0);
+			for(auto& t : workers){
+				t.join();
+			}
+			if(error){
+				std::rethrow_exception(error);
+			}
+		}
+	}
+
+	// score n items into out[0..n) on `threads` workers (0 for one per hardware thread),
+	// chunks are balanced by work stealing. Evaluator is any evaluator with EvalBatch,
+	// shared read-only by all workers
+	template<class Evaluator>
+	void ParallelEval(Evaluator const& evaluator, typename Evaluator::element_type const* items,
+			std::size_t n, float* out, std::size_t threads=0){
+		parallel::Run(evaluator, items, n, out, threads);
+	}
+
+	template<class Evaluator>
+	void ParallelEval(Evaluator const& evaluator, typename Evaluator::element_type const* const* items,
+			std::size_t n, float* out, std::size_t threads=0){
+		parallel::Run(evaluator, items, n, out, threads);
+	}
+}
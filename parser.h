@@ -0,0 +1,445 @@
+#pragma once
+
+#include "ast_evaluator.h"
+#include "binding.h"
+#include "flat_ast.h"
+#include "optimizer.h"
+
+#include <algorithm> // sort, lower_bound
+#include <cerrno>
+#include <cmath> // isinf
+#include <cstdlib> // strtof
+#include <exception> //invalid_argument
+#include <memory> // shared_ptr
+#include <string>
+#include <vector>
+
+namespace expr
+{
+	///////////////////////////////////////////////////////////////////////////////
+	//  Recursive descent parser for the calculator grammar, a drop-in for
+	//  CalcGrammar without Spirit:
+	//
+	//	expression = logical_or ['?' expression ':' expression]
+	//	logical_or = logical_and ('||' logical_and)*, and so on down through
+	//	             && == != < <= > >=
+	//	additive   = term (('+'|'-') term)*
+	//	term       = factor (('*'|'/') factor)*
+	//	factor     = float | builtin '(' expression (',' expression)* ')' | symbol
+	//	           | '(' expression ')' | '-' factor | '+' factor | '!' factor
+	//
+	//  alternatives are tried in CalcGrammar's order, so "-2" is a number and
+	//  "-x" a negation, symbols match their longest entry, ascii space skipped
+	//  between tokens
+	///////////////////////////////////////////////////////////////////////////////
+	template <typename Iterator, typename Functor, class Item>
+	class CalcParser
+	{
+		public:
+			using func_type = Functor;
+			using item_type = Item;
+			using char_type = typename std::iterator_traits<Iterator>::value_type;
+			using string_type = std::basic_string<char_type>;
+
+			template<class Symbols, class Functors>
+			CalcParser(Symbols&& symbols, Functors&& fns) : table(ast::MakeSymbolTable(fns)){
+				uint32_t index = 0;
+				for(auto const& symbol : symbols){
+					if(index == table->size()){
+						break;
+					}
+					string_type name(symbol);
+					names.push_back(name);
+					if(!name.empty()){
+						entries.push_back(Entry{name, index});
+					}
+					++index;
+				}
+				// the first of duplicated names wins, as in qi::symbols
+				std::stable_sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b){
+					return a.name < b.name;
+				});
+				entries.erase(std::unique(entries.begin(), entries.end(), [](Entry const& a, Entry const& b){
+					return a.name == b.name;
+				}), entries.end());
+			}
+
+			// functors by symbol position, shared by every program parsed here
+			std::shared_ptr<ast::SymbolTable const> const& Symbols() const{
+				return table;
+			}
+
+			// names by symbol position, e.g. to check a vm::Image is bound to the symbols it was written for
+			std::vector<string_type> const& SymbolNames() const{
+				return names;
+			}
+
+			// optimization applied to every parsed program before it reaches an evaluator
+			void SetOptimizeOptions(ast::OptimizeOptions const& options){
+				optimize_options = options;
+				++optimize_generation;
+			}
+
+			// changes with every SetOptimizeOptions, e.g. to tell programs parsed before it from later ones
+			uint64_t OptimizeGeneration() const{
+				return optimize_generation;
+			}
+
+			// the optimized tree evaluators are built from, e.g. for ast::RangeAnalysis
+			ast::Tree ParseTree(string_type const& statement) const{
+				return doParse(statement.data(), statement.data()+statement.size());
+			}
+
+			AstEvaluator<Functor, Item> Parse(string_type const& statement) const{
+				return doParse(statement.data(), statement.data()+statement.size());
+			}
+
+			template<template<class, class> class Evaluator>
+			Evaluator<Functor, Item> Parse(string_type const& statement) const{
+				return doParse(statement.data(), statement.data()+statement.size());
+			}
+
+			// several statements for one evaluator taking their trees, e.g. MultiEvaluator
+			template<template<class, class> class Evaluator>
+			Evaluator<Functor, Item> Parse(std::vector<string_type> const& statements) const{
+				std::vector<ast::Tree> trees;
+				for(string_type const& statement : statements){
+					trees.push_back(doParse(statement.data(), statement.data()+statement.size()));
+				}
+				return trees;
+			}
+
+			// [first, last) parsed in place, e.g. a slice of a bigger config buffer
+			AstEvaluator<Functor, Item> Parse(char_type const* first, char_type const* last) const{
+				return doParse(first, last);
+			}
+
+			template<template<class, class> class Evaluator>
+			Evaluator<Functor, Item> Parse(char_type const* first, char_type const* last) const{
+				return doParse(first, last);
+			}
+
+		private:
+			struct Entry
+			{
+				string_type name;
+				uint32_t symbol;
+			};
+
+			// one statement being parsed into tree, throws on the first mismatch.
+			// Each rule returns the index of the node it added
+			struct Cursor
+			{
+				CalcParser const& parser;
+				ast::Tree& tree;
+				char_type const* pos;
+				char_type const* end;
+
+				// cond ? a : b binds loosest and right to left, then || && == != < <= > >= + - * / as in C
+				uint32_t Expression(){
+					uint32_t cond = logicalOr();
+					if(!peek('?')){
+						return cond;
+					}
+					++pos;
+					uint32_t then = Expression();
+					if(!peek(':')){
+						fail();
+					}
+					++pos;
+					uint32_t other = Expression();
+					return tree.Select(cond, then, other);
+				}
+
+				void SkipSpace(){
+					while(pos != end && (*pos==' ' || (*pos>='\t' && *pos<='\r'))){
+						++pos;
+					}
+				}
+
+				private:
+					uint32_t logicalOr(){
+						uint32_t lhs = logicalAnd();
+						while(pair('|', '|')){
+							uint32_t rhs = logicalAnd();
+							lhs = tree.Binary('|', lhs, rhs);
+						}
+						return lhs;
+					}
+
+					uint32_t logicalAnd(){
+						uint32_t lhs = equality();
+						while(pair('&', '&')){
+							uint32_t rhs = equality();
+							lhs = tree.Binary('&', lhs, rhs);
+						}
+						return lhs;
+					}
+
+					uint32_t equality(){
+						uint32_t lhs = relational();
+						for(;;){
+							char sign = pair('=', '=') ? '=' : pair('!', '=') ? '!' : 0;
+							if(!sign){
+								return lhs;
+							}
+							uint32_t rhs = relational();
+							lhs = tree.Binary(sign, lhs, rhs);
+						}
+					}
+
+					// < <= > >= as the signs < l > g
+					uint32_t relational(){
+						uint32_t lhs = additive();
+						while(peek('<') || peek('>')){
+							char sign = char(*pos++);
+							if(pos != end && *pos == '='){
+								++pos;
+								sign = sign=='<' ? 'l' : 'g';
+							}
+							uint32_t rhs = additive();
+							lhs = tree.Binary(sign, lhs, rhs);
+						}
+						return lhs;
+					}
+
+					uint32_t additive(){
+						uint32_t lhs = term();
+						while(peek('+') || peek('-')){
+							char sign = char(*pos++);
+							uint32_t rhs = term();
+							lhs = tree.Binary(sign, lhs, rhs);
+						}
+						return lhs;
+					}
+
+					uint32_t term(){
+						uint32_t lhs = factor();
+						while(peek('*') || peek('/')){
+							char sign = char(*pos++);
+							uint32_t rhs = factor();
+							lhs = tree.Binary(sign, lhs, rhs);
+						}
+						return lhs;
+					}
+
+					// unary plus is the identity and adds no node
+					uint32_t factor(){
+						SkipSpace();
+						float n;
+						if(number(n)){
+							return tree.Constant(n);
+						}
+						uint32_t index;
+						if(call(index)){
+							return index;
+						}
+						if(symbol(index)){
+							return tree.Symbol(index);
+						}
+						if(peek('(')){
+							++pos;
+							uint32_t inner = Expression();
+							if(!peek(')')){
+								fail();
+							}
+							++pos;
+							return inner;
+						}
+						if(peek('-') || peek('+')){
+							char sign = char(*pos++);
+							uint32_t operand = factor();
+							return sign=='-' ? tree.Negate(operand) : operand;
+						}
+						if(peek('!')){
+							++pos;
+							return tree.Not(factor());
+						}
+						fail();
+						return 0;
+					}
+
+					// built-in name(args) at pos, which is left alone if no '(' follows the name.
+					// node: the call added
+					bool call(uint32_t& node){
+						char_type const* start = pos;
+						char name[8];
+						std::size_t len = 0;
+						while(pos != end && len+1 < sizeof(name) && *pos >= 'a' && *pos <= 'z'){
+							name[len++] = char(*pos++);
+						}
+						name[len] = 0;
+						ast::Builtin fn = len ? ast::FindBuiltin(name) : ast::fn_count;
+						if(fn == ast::fn_count || !peek('(')){
+							pos = start;
+							return false;
+						}
+						++pos;
+						const uint32_t arity = ast::Builtins(fn).arity;
+						uint32_t args[3] = {0, 0, 0};
+						for(uint32_t k=0; k<arity; ++k){
+							if(k){
+								if(!peek(',')){
+									fail();
+								}
+								++pos;
+							}
+							args[k] = Expression();
+						}
+						if(!peek(')')){
+							fail();
+						}
+						++pos;
+						node = tree.Call(fn, args[0], args[1], args[2]);
+						return true;
+					}
+
+					bool peek(char c){
+						SkipSpace();
+						return pos != end && *pos == char_type(c);
+					}
+
+					// the two-char operator first second, consumed if at pos
+					bool pair(char first, char second){
+						if(peek(first) && end-pos >= 2 && pos[1] == char_type(second)){
+							pos += 2;
+							return true;
+						}
+						return false;
+					}
+
+					// [+-] (digits [. digits] | . digits) [(e|E) [+-] digits] | [+-] (inf | infinity | nan)
+					bool number(float& n){
+						char_type const* p = pos;
+						if(p != end && (*p=='+' || *p=='-')) ++p;
+						char_type const* digits = p;
+						while(p != end && isDigit(*p)) ++p;
+						bool mantissa = p != digits;
+						if(p != end && *p=='.'){
+							char_type const* frac = ++p;
+							while(p != end && isDigit(*p)) ++p;
+							mantissa = mantissa || p != frac;
+						}
+						if(mantissa){
+							if(p != end && (*p=='e' || *p=='E')){
+								char_type const* e = p++;
+								if(p != end && (*p=='+' || *p=='-')) ++p;
+								char_type const* exp = p;
+								while(p != end && isDigit(*p)) ++p;
+								if(p == exp) p = e;
+							}
+						}else{
+							p = special(digits);
+							if(p == digits){
+								return false;
+							}
+						}
+						n = toFloat(pos, p);
+						pos = p;
+						return true;
+					}
+
+					// end of inf, infinity or nan at p, p itself if none
+					char_type const* special(char_type const* p) const{
+						char const* words[] = {"infinity", "inf", "nan"};
+						for(char const* w : words){
+							char_type const* q = p;
+							char const* c = w;
+							while(*c && q != end && (*q|0x20) == *c){
+								++q;
+								++c;
+							}
+							if(!*c) return q;
+						}
+						return p;
+					}
+
+					static bool isDigit(char_type c){ return c>='0' && c<='9'; }
+
+					// strtof on a narrowed, terminated copy of the token, correctly rounded where float_
+					// may be off in the last bits. Literals beyond float range are rejected as by float_
+					float toFloat(char_type const* first, char_type const* last){
+						char buf[64];
+						std::string long_token;
+						char* s = buf;
+						if(last-first >= std::ptrdiff_t(sizeof(buf))){
+							long_token.resize(last-first+1);
+							s = &long_token[0];
+						}
+						std::size_t len = 0;
+						for(char_type const* p=first; p!=last; ++p){
+							s[len++] = char(*p);
+						}
+						s[len] = 0;
+						errno = 0;
+						float n = std::strtof(s, nullptr);
+						if(errno == ERANGE && std::isinf(n)){
+							fail();
+						}
+						return n;
+					}
+
+					// longest symbol starting at pos
+					bool symbol(uint32_t& index){
+						if(pos == end){
+							return false;
+						}
+						auto const& entries = parser.entries;
+						char_type c = *pos;
+						auto it = std::lower_bound(entries.begin(), entries.end(), c, [](Entry const& e, char_type first){
+							return e.name[0] < first;
+						});
+						Entry const* best = nullptr;
+						for(; it != entries.end() && it->name[0] == c; ++it){
+							std::size_t len = it->name.size();
+							if(std::size_t(end-pos) >= len && (!best || len > best->name.size())
+								&& std::equal(it->name.begin(), it->name.end(), pos)){
+								best = &*it;
+							}
+						}
+						if(!best){
+							return false;
+						}
+						pos += best->name.size();
+						index = best->symbol;
+						return true;
+					}
+
+					void fail(){
+						throw std::invalid_argument("invalid statement");
+					}
+			};
+
+			// a node takes at least one character, so the tree never grows past its reserve
+			ast::Tree doParse(char_type const* first, char_type const* last) const{
+				ast::Tree tree(table, last-first);
+				Cursor cursor{*this, tree, first, last};
+				try{
+					tree.SetRoot(cursor.Expression());
+					cursor.SkipSpace();
+					if(cursor.pos == last){
+						ast::Tree optimized = ast::Optimize(std::move(tree), optimize_options);
+						optimized.SetSource(std::string(first, last));
+						return optimized;
+					}
+				}catch(std::invalid_argument const&){
+				}
+				throw std::invalid_argument("invalid statement:"+string_type(first, last));
+			}
+
+			ast::OptimizeOptions optimize_options;
+			uint64_t optimize_generation = 0;
+			std::shared_ptr<ast::SymbolTable const> table;
+			std::vector<string_type> names;
+			// sorted by name
+			std::vector<Entry> entries;
+	};
+
+	template<class Keywords, class Functors,
+		class KeyIterator=typename IteratorFromKeywords<Keywords>::type,
+		class Functor=typename ContainedType<Functors>::type>
+	auto MakeParser(Keywords const& keywords, Functors const& fnList)
+	-> typename boost::enable_if<arg1_type<Functor>,CalcParser<KeyIterator, Functor,typename arg1_type<Functor>::type >>::type{
+		return {keywords, fnList};
+	}
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+// opt-in instrumentation of the evaluators, built with -DEXPR_PROFILE=1. Every evaluation
+// then counts its ops, symbol functor calls and cycles into counters of the evaluating
+// thread, per expression, read with profile::Snapshot or profile::Print. Without it the
+// hooks below expand to nothing
+#ifndef EXPR_PROFILE
+#define EXPR_PROFILE 0
+#endif
+
+#if EXPR_PROFILE
+
+#include <algorithm> // sort
+#include <atomic>
+#include <cstdint>
+#include <iomanip> // setw
+#include <map>
+#include <memory> // unique_ptr
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc
+#else
+#include <chrono>
+#endif
+
+namespace expr{
+	namespace profile{
+
+		// time stamp counter where there is one, nanoseconds elsewhere
+		inline uint64_t Cycles(){
+#if defined(__x86_64__) || defined(__i386__)
+			return __rdtsc();
+#else
+			return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+		}
+
+		// ops an evaluator may tell apart, e.g. vm::ByteCode
+		static const uint32_t kSlots = 64;
+
+		// one expression's counts in one thread. Only that thread writes them, with a plain
+		// load and store, atomic only so a report may read them meanwhile
+		struct Counters
+		{
+			std::atomic<uint64_t> evals;
+			std::atomic<uint64_t> items;
+			std::atomic<uint64_t> symbol_calls;
+			std::atomic<uint64_t> cycles;
+			std::atomic<uint64_t> ops[kSlots];
+			std::atomic<uint64_t> op_cycles[kSlots];
+		};
+
+		inline void Bump(std::atomic<uint64_t>& counter, uint64_t by){
+			counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		//  Expressions are registered once per evaluator built, and counted
+		//  in blocks owned by each thread, allocated on its first evaluation
+		//  of an expression of the block and never moved
+		///////////////////////////////////////////////////////////////////////
+		class Registry{
+			public:
+				static const uint32_t kBlockSites = 64;
+				static const uint32_t kBlocks = 1024;
+
+				struct Site
+				{
+					std::string text;
+					std::string evaluator;
+					// name of each op slot, none when only whole evaluations are timed
+					std::vector<std::string> slots;
+				};
+
+				struct Thread
+				{
+					std::atomic<Counters*> blocks[kBlocks];
+				};
+
+				static Registry& Instance(){
+					static Registry registry;
+					return registry;
+				}
+
+				// the site of text evaluated by evaluator, shared by every evaluator built from
+				// the same text
+				uint32_t Register(std::string const& text, std::string const& evaluator, std::vector<std::string> const& slots){
+					std::lock_guard<std::mutex> lock(mutex);
+					auto found = ids.find(std::make_pair(text, evaluator));
+					if(found != ids.end()){
+						return found->second;
+					}
+					uint32_t id = uint32_t(sites.size());
+					sites.push_back(Site{text, evaluator, slots});
+					ids[std::make_pair(text, evaluator)] = id;
+					return id;
+				}
+
+				// the calling thread's counters of site, null past the last block
+				Counters* Local(uint32_t site){
+					const uint32_t block = site / kBlockSites;
+					if(block >= kBlocks){
+						return nullptr;
+					}
+					Thread& thread = local();
+					Counters* counters = thread.blocks[block].load(std::memory_order_acquire);
+					if(!counters){
+						counters = new Counters[kBlockSites]();
+						thread.blocks[block].store(counters, std::memory_order_release);
+					}
+					return counters + site % kBlockSites;
+				}
+
+				// every site with its counts summed over live and exited threads
+				template<class Visit>
+				void Collect(Visit visit){
+					std::lock_guard<std::mutex> lock(mutex);
+					for(uint32_t id=0; id<sites.size() && id/kBlockSites < kBlocks; ++id){
+						Counters total = {};
+						add(total, retired, id);
+						for(Thread* thread : threads){
+							add(total, *thread, id);
+						}
+						visit(sites[id], total);
+					}
+				}
+
+			private:
+				Registry() = default;
+
+				// registered with the registry on first use, merged into the retired counts on exit
+				struct Owner
+				{
+					Thread* thread;
+
+					Owner() : thread(new Thread()){
+						Instance().attach(thread);
+					}
+
+					~Owner(){
+						Instance().detach(thread);
+					}
+				};
+
+				static Thread& local(){
+					static thread_local Owner owner;
+					return *owner.thread;
+				}
+
+				void attach(Thread* thread){
+					std::lock_guard<std::mutex> lock(mutex);
+					threads.push_back(thread);
+				}
+
+				void detach(Thread* thread){
+					std::lock_guard<std::mutex> lock(mutex);
+					for(uint32_t block=0; block<kBlocks; ++block){
+						std::unique_ptr<Counters[]> counters(thread->blocks[block].load(std::memory_order_acquire));
+						if(!counters){
+							continue;
+						}
+						Counters* into = retired.blocks[block].load(std::memory_order_relaxed);
+						if(!into){
+							into = new Counters[kBlockSites]();
+							retired.blocks[block].store(into, std::memory_order_relaxed);
+						}
+						for(uint32_t i=0; i<kBlockSites; ++i){
+							add(into[i], counters[i]);
+						}
+					}
+					threads.erase(std::find(threads.begin(), threads.end(), thread));
+					delete thread;
+				}
+
+				static void add(Counters& into, Thread const& thread, uint32_t site){
+					Counters const* block = thread.blocks[site / kBlockSites].load(std::memory_order_acquire);
+					if(block){
+						add(into, block[site % kBlockSites]);
+					}
+				}
+
+				static void add(Counters& into, Counters const& from){
+					Bump(into.evals, from.evals.load(std::memory_order_relaxed));
+					Bump(into.items, from.items.load(std::memory_order_relaxed));
+					Bump(into.symbol_calls, from.symbol_calls.load(std::memory_order_relaxed));
+					Bump(into.cycles, from.cycles.load(std::memory_order_relaxed));
+					for(uint32_t i=0; i<kSlots; ++i){
+						Bump(into.ops[i], from.ops[i].load(std::memory_order_relaxed));
+						Bump(into.op_cycles[i], from.op_cycles[i].load(std::memory_order_relaxed));
+					}
+				}
+
+			private:
+				std::mutex mutex;
+				std::vector<Site> sites;
+				std::map<std::pair<std::string, std::string>, uint32_t> ids;
+				std::vector<Thread*> threads;
+				// counts of threads gone
+				Thread retired = {};
+		};
+
+		inline uint32_t Register(std::string const& text, std::string const& evaluator, std::vector<std::string> const& slots = {}){
+			return Registry::Instance().Register(text.empty() ? "<no source>" : text, evaluator, slots);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		//  Times one evaluation, of an item or a batch: each op runs until the
+		//  next one starts, the last until the probe is gone
+		///////////////////////////////////////////////////////////////////////
+		class Probe{
+			public:
+				// items: scored by this evaluation. symbol_slot: the op calling a symbol functor
+				Probe(uint32_t site, uint64_t items, uint32_t symbol_slot = kSlots) :
+					counters(Registry::Instance().Local(site)), items(items), symbol_slot(symbol_slot){
+					start = last = Cycles();
+				}
+
+				Probe(Probe const&) = delete;
+				Probe& operator=(Probe const&) = delete;
+
+				// width: items the op is run for, 1 evaluating an item, a block's in a batch
+				void Op(uint32_t slot, uint64_t width){
+					if(!counters || slot >= kSlots){
+						return;
+					}
+					uint64_t now = Cycles();
+					if(previous < kSlots){
+						Bump(counters->op_cycles[previous], now - last);
+					}
+					Bump(counters->ops[slot], 1);
+					if(slot == symbol_slot){
+						Bump(counters->symbol_calls, width);
+					}
+					previous = slot;
+					last = now;
+				}
+
+				~Probe(){
+					if(!counters){
+						return;
+					}
+					uint64_t now = Cycles();
+					if(previous < kSlots){
+						Bump(counters->op_cycles[previous], now - last);
+					}
+					Bump(counters->evals, 1);
+					Bump(counters->items, items);
+					Bump(counters->cycles, now - start);
+				}
+
+			private:
+				Counters* counters;
+				uint64_t items;
+				uint32_t symbol_slot;
+				uint32_t previous = kSlots;
+				uint64_t start;
+				uint64_t last;
+		};
+
+		///////////////////////////////////////////////////////////////////////
+		//  Reports
+		///////////////////////////////////////////////////////////////////////
+		struct OpStat
+		{
+			std::string name;
+			uint64_t count;
+			uint64_t cycles;
+		};
+
+		struct ExpressionStat
+		{
+			std::string text;
+			std::string evaluator;
+			// calls of operator() or EvalBatch, and the items they scored
+			uint64_t evals;
+			uint64_t items;
+			uint64_t symbol_calls;
+			uint64_t cycles;
+			// ops run at least once, most cycles first
+			std::vector<OpStat> ops;
+		};
+
+		// counts so far of every expression evaluated, most cycles first
+		inline std::vector<ExpressionStat> Snapshot(){
+			std::vector<ExpressionStat> stats;
+			Registry::Instance().Collect([&](Registry::Site const& site, Counters const& c){
+				if(!c.evals.load(std::memory_order_relaxed)){
+					return;
+				}
+				ExpressionStat stat{site.text, site.evaluator, c.evals.load(std::memory_order_relaxed),
+					c.items.load(std::memory_order_relaxed), c.symbol_calls.load(std::memory_order_relaxed),
+					c.cycles.load(std::memory_order_relaxed), {}};
+				for(uint32_t i=0; i<site.slots.size() && i<kSlots; ++i){
+					if(uint64_t count = c.ops[i].load(std::memory_order_relaxed)){
+						stat.ops.push_back(OpStat{site.slots[i], count, c.op_cycles[i].load(std::memory_order_relaxed)});
+					}
+				}
+				std::sort(stat.ops.begin(), stat.ops.end(), [](OpStat const& a, OpStat const& b){
+					return a.cycles > b.cycles;
+				});
+				stats.push_back(std::move(stat));
+			});
+			std::sort(stats.begin(), stats.end(), [](ExpressionStat const& a, ExpressionStat const& b){
+				return a.cycles > b.cycles;
+			});
+			return stats;
+		}
+
+		// Snapshot as text, an expression per paragraph followed by its ops
+		inline void Print(std::ostream& os){
+			for(ExpressionStat const& e : Snapshot()){
+				os << e.evaluator << ": " << e.text << '\n'
+					<< "  evals " << e.evals << ", items " << e.items << ", symbol calls " << e.symbol_calls
+					<< ", cycles " << e.cycles << ", cycles/item " << (e.items ? e.cycles / e.items : 0) << '\n';
+				for(OpStat const& op : e.ops){
+					os << "    " << std::left << std::setw(16) << op.name << std::right
+						<< std::setw(14) << op.count << " runs " << std::setw(16) << op.cycles << " cycles "
+						<< std::setw(6) << (e.cycles ? 100 * op.cycles / e.cycles : 0) << "%\n";
+				}
+			}
+		}
+	}
+}
+
+#define EXPR_PROFILE_PROBE(name, site, items, symbol_slot) ::expr::profile::Probe name(site, items, symbol_slot)
+#define EXPR_PROFILE_OP(probe, slot, width) probe.Op(slot, width)
+
+#else
+
+#define EXPR_PROFILE_PROBE(name, site, items, symbol_slot)
+#define EXPR_PROFILE_OP(probe, slot, width)
+
+#endif
@@ -1,10 +1,12 @@
 #pragma once
 
-#include <boost/any.hpp> // any
 #include <boost/variant/recursive_variant.hpp> //variant
 #include <boost/fusion/include/adapt_struct.hpp> //BOOST_FUSION_ADAPT_STRUCT
 
 #include <list> // std::list
+#include <vector>
+#include <cstdint> // uint32_t
+#include <type_traits> // is_member_object_pointer
 
 namespace expr { namespace ast
 {
@@ -14,8 +16,14 @@ namespace expr { namespace ast
 	struct Nil {};
 	struct Signed;
 	struct Program;
+	struct Call;
 
-	using ScoreFn = boost::any;
+	// symbol's position in the grammar's symbol list, the functor itself is kept in the
+	// grammar's SymbolTable(flat_ast.h)
+	struct ScoreFn
+	{
+		uint32_t index;
+	};
 
 	typedef boost::variant<
 		Nil
@@ -23,6 +31,7 @@ namespace expr { namespace ast
 		, ScoreFn
 		, boost::recursive_wrapper<Signed>
 		, boost::recursive_wrapper<Program>
+		, boost::recursive_wrapper<Call>
 		>
 		Operand;
 
@@ -44,6 +53,28 @@ namespace expr { namespace ast
 		std::list<Operation> rest;
 	};
 
+	// built-in function fn(args), fn an ast::Builtin(flat_ast.h)
+	struct Call
+	{
+		char fn;
+		std::vector<Program> args;
+	};
+
+	template<class Functors>
+	std::vector<ScoreFn> MakeScoreFns(Functors const& fns){
+		std::vector<ScoreFn> score_fns;
+		for(auto it = fns.begin(); it != fns.end(); ++it){
+			score_fns.push_back(ScoreFn{uint32_t(score_fns.size())});
+		}
+		return score_fns;
+	}
+
+	// float data member, loadable straight from item memory without any call
+	template<class Functor>
+	struct IsFloatMember : std::false_type{};
+	template<class T>
+	struct IsFloatMember<float T::*> : std::true_type{};
+
 	template<class Functor, class Item>
 	auto EvalFn(Functor fn, Item*  u) 
 	->typename std::enable_if<std::is_member_object_pointer<Functor>::value, float>::type { 
@@ -56,8 +87,9 @@ namespace expr { namespace ast
 		return (u->*fn)(); 
 	}
 	
+	// by reference, a std::function or capturing lambda isn't copied per call
 	template<class Functor, class Item>
-	auto EvalFn(Functor fn, Item*  u) 
+	auto EvalFn(Functor const& fn, Item*  u) 
 	->typename std::enable_if<!std::is_member_pointer<Functor>::value, float>::type  { 
 		return fn(*u); 
 	}
@@ -75,6 +107,12 @@ BOOST_FUSION_ADAPT_STRUCT(
 		(expr::ast::Operand, operand)
 		)
 
+BOOST_FUSION_ADAPT_STRUCT(
+		expr::ast::Call,
+		(char, fn)
+		(std::vector<expr::ast::Program>, args)
+		)
+
 BOOST_FUSION_ADAPT_STRUCT(
 		expr::ast::Program,
 		(expr::ast::Operand, first)
@@ -1,81 +1,98 @@
 #pragma once
 
-#include "raw_ast.h"
+#include "flat_ast.h"
+#include "batch.h"
+#include "optimizer.h" // Apply
+#include "profile.h"
 
 namespace expr{
 
 	///////////////////////////////////////////////////////////////////////////
-	//  The AST evaluator
+	//  The raw evaluator, recursive walk over the tree casting each functor
+	//  out of the symbol table as it is reached
 	///////////////////////////////////////////////////////////////////////////
 	template<class Functor, class Evalee>
 	struct RawTransformer
 	{
+		ast::Tree const& tree;
 		// Evalee can't be qualified with const here in case non-const object or function
-		mutable  Evalee * eval_ptr=nullptr;
+		Evalee * eval_ptr;
 
 		typedef float result_type;
 
-		result_type operator()(ast::Nil) const { BOOST_ASSERT(0); return 0; }
-
-		result_type operator()(float n) const { return n; }
-
-		template<class F=Functor>
-		result_type operator()(ast::ScoreFn const& fn) const{
-			return ast::EvalFn(boost::any_cast<Functor>(fn), eval_ptr); 
-		}
-
-		result_type operator()(ast::Operation const& x, float lhs) const
-		{
-			result_type rhs = boost::apply_visitor(*this, x.operand);
-			switch (x.sign)
-			{
-				case '+': return lhs + rhs;
-				case '-': return lhs - rhs;
-				case '*': return lhs * rhs;
-				case '/': return lhs / rhs;
-			}
-			BOOST_ASSERT(0);
-			return 0;
-		}
-
-		result_type operator()(ast::Signed const& x) const
+		result_type operator()(uint32_t i) const
 		{
-			result_type rhs = boost::apply_visitor(*this, x.operand);
-			switch (x.sign)
+			ast::Node const& n = tree[i];
+			switch (n.kind)
 			{
-				case '-': return -rhs;
-				case '+': return +rhs;
+				case ast::node_const: return n.value;
+				case ast::node_symbol: return ast::EvalFn(tree.Fn<Functor>(n.lhs), eval_ptr);
+				case ast::node_neg: return -(*this)(n.lhs);
+				case ast::node_binary: {
+					result_type lhs = (*this)(n.lhs);
+					// rhs only evaluated when lhs doesn't decide the result
+					if(n.sign == '&'){
+						return lhs != 0 && (*this)(n.rhs) != 0;
+					}
+					if(n.sign == '|'){
+						return lhs != 0 || (*this)(n.rhs) != 0;
+					}
+					result_type rhs = (*this)(n.rhs);
+					switch (n.sign)
+					{
+						case '+': return lhs + rhs;
+						case '-': return lhs - rhs;
+						case '*': return lhs * rhs;
+						case '/': return lhs / rhs;
+					}
+					return ast::Apply(n.sign, lhs, rhs);
+				}
+				case ast::node_not: return (*this)(n.lhs) == 0;
+				case ast::node_select: return (*this)(n.lhs) != 0 ? (*this)(n.rhs) : (*this)(n.alt);
+				case ast::node_call: {
+					const uint32_t arity = ast::Builtins(n.sign).arity;
+					result_type a = (*this)(n.lhs);
+					result_type b = arity > 1 ? (*this)(n.rhs) : 0;
+					return ast::ApplyBuiltin(n.sign, a, b, arity > 2 ? (*this)(n.alt) : 0);
+				}
 			}
 			BOOST_ASSERT(0);
 			return 0;
 		}
-
-		result_type operator()(ast::Program const& x) const
-		{
-			result_type state = boost::apply_visitor(*this, x.first);
-			for(ast::Operation const& oper : x.rest)
-			{
-				state = (*this)(oper, state);
-			}
-			return state;
-		}
 	};
 
 	template<class Functor, class Evalee>
 	class RawEvaluator{
 		public:
 			using element_type = Evalee; 
-			RawEvaluator(ast::Program const& prog) : program(prog){}
+			RawEvaluator(ast::Tree const& t) : tree(t){
+#if EXPR_PROFILE
+				site = profile::Register(t.Source(), "raw");
+#endif
+			}
 
 			float operator()(element_type const& e) const{
-				eval.eval_ptr = const_cast<Evalee*>(&e);
-				return eval(program);
+				EXPR_PROFILE_PROBE(probe, site, 1, profile::kSlots);
+				// transformer is per call so concurrent evaluations don't share the item pointer
+				RawTransformer<Functor, element_type> eval{tree, const_cast<Evalee*>(&e)};
+				return eval(tree.Root());
+			}
+
+			// no dispatch to amortize here, batch is a plain loop kept for api parity
+			void EvalBatch(element_type const* items, std::size_t n, float* out) const{
+				for(std::size_t i=0; i<n; ++i) out[i] = (*this)(batch::At(items, i));
+			}
+
+			void EvalBatch(element_type const* const* items, std::size_t n, float* out) const{
+				for(std::size_t i=0; i<n; ++i) out[i] = (*this)(batch::At(items, i));
 			}
 
 		private:
-			ast::Program program;
-			RawTransformer<Functor, element_type> eval;
-			
+			ast::Tree tree;
+#if EXPR_PROFILE
+			// expression totals only, no per-op counts
+			uint32_t site;
+#endif
 	};
 
 }
@@ -0,0 +1,444 @@
+#pragma once
+
+#include <cstring> // memcpy
+#include <exception>
+#include <memory> // shared_ptr, unique_ptr
+#include <vector>
+#include "flat_ast.h"
+#include "optimizer.h"
+#include "small_array.h"
+#include "vm_evaluator.h" // StackSize, EXPR_VM_THREADED, VMEvaluator fallback
+
+namespace expr{
+	namespace regvm{
+
+		// one word per instruction: op | dst<<8 | a<<16 | b<<24, a and b are registers or,
+		// for ops reading symbols, functor table indices. ops with a constant take it from
+		// the following word
+		enum ByteCode
+		{
+			op_load_const,      //  r[d] = k
+			op_load_fn,         //  r[d] = fn[a](item)
+			op_neg,             //  r[d] = -r[a]
+			op_add,             //  r[d] = r[a] + r[b]
+			op_sub,             //  r[d] = r[a] - r[b]
+			op_mul,             //  r[d] = r[a] * r[b]
+			op_div,             //  r[d] = r[a] / r[b]
+			op_add_k,           //  r[d] = r[a] + k
+			op_sub_k,           //  r[d] = r[a] - k
+			op_mul_k,           //  r[d] = r[a] * k
+			op_div_k,           //  r[d] = r[a] / k
+			op_add_fn,          //  r[d] = r[a] + fn[b](item)
+			op_sub_fn,          //  r[d] = r[a] - fn[b](item)
+			op_mul_fn,          //  r[d] = r[a] * fn[b](item)
+			op_div_fn,          //  r[d] = r[a] / fn[b](item)
+			op_fn_add_fn,       //  r[d] = fn[a](item) + fn[b](item)
+			op_fn_sub_fn,       //  r[d] = fn[a](item) - fn[b](item)
+			op_fn_mul_k,        //  r[d] = fn[a](item) * k
+			op_k_mul_fn_add_fn, //  r[d] = k * fn[a](item) + fn[b](item)
+			op_ret              //  return r[a]
+		};
+
+		// register and functor fields are a byte wide
+		static const uint32_t kMaxRegisters = 256;
+
+		inline uint32_t Instruction(ByteCode op, uint32_t d, uint32_t a=0, uint32_t b=0){
+			return op | d<<8 | a<<16 | b<<24;
+		}
+
+		template<class Functor, class Evalee>
+		class RegisterMachine{
+			public:
+				// registers kept on the native stack by Eval, bigger programs fall back to heap
+				static const uint32_t kInlineRegisters = 32;
+				// instructions and functors kept within the machine, a short program a single allocation
+				static const uint32_t kInlineCode = 32;
+				static const uint32_t kInlineFunctors = 8;
+
+				RegisterMachine(std::vector<uint32_t> const& c, std::vector<Functor> const& f, uint32_t regs):
+					registers(regs), code(c.begin(), c.end()), fns(f.begin(), f.end()){}
+
+				uint32_t Registers() const{ return registers; }
+
+				float Eval(Evalee const& item) const{
+					if(registers <= kInlineRegisters){
+						float r[kInlineRegisters];
+						return Eval(item, r);
+					}
+					std::unique_ptr<float[]> r(new float[registers]);
+					return Eval(item, r.get());
+				}
+
+				// r: caller owned scratch of at least Registers() floats
+				float Eval(Evalee const& item, float* r) const{
+					Evalee* u = const_cast<Evalee *>(&item);
+					Functor const* fn = fns.data();
+					uint32_t const* pc = code.data();
+					uint32_t w;
+#define EXPR_REGVM_D (w>>8 & 0xff)
+#define EXPR_REGVM_A (w>>16 & 0xff)
+#define EXPR_REGVM_B (w>>24)
+#define EXPR_REGVM_K (*(float const*)(pc-1))
+#if EXPR_VM_THREADED
+					// one indirect jump per handler instead of the switch's shared one
+					static void* const handlers[] = {
+						&&l_op_load_const, &&l_op_load_fn, &&l_op_neg,
+						&&l_op_add, &&l_op_sub, &&l_op_mul, &&l_op_div,
+						&&l_op_add_k, &&l_op_sub_k, &&l_op_mul_k, &&l_op_div_k,
+						&&l_op_add_fn, &&l_op_sub_fn, &&l_op_mul_fn, &&l_op_div_fn,
+						&&l_op_fn_add_fn, &&l_op_fn_sub_fn, &&l_op_fn_mul_k, &&l_op_k_mul_fn_add_fn,
+						&&l_op_ret
+					};
+					static_assert(sizeof(handlers)/sizeof(handlers[0]) == op_ret+1, "one handler per ByteCode");
+#define EXPR_REGVM_OP(op, words) l_##op: pc += words;
+#define EXPR_REGVM_NEXT() w = *pc; goto *handlers[w & 0xff]
+					EXPR_REGVM_NEXT();
+#else
+#define EXPR_REGVM_OP(op, words) case op: pc += words;
+#define EXPR_REGVM_NEXT() break
+					// op_ret terminates every program, no bound check needed
+					for (;;)
+					{
+						w = *pc;
+						switch (w & 0xff)
+						{
+#endif
+							EXPR_REGVM_OP(op_load_const, 2)
+								r[EXPR_REGVM_D] = EXPR_REGVM_K;
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_load_fn, 1)
+								r[EXPR_REGVM_D] = ast::EvalFn(fn[EXPR_REGVM_A], u);
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_neg, 1)
+								r[EXPR_REGVM_D] = -r[EXPR_REGVM_A];
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_add, 1)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] + r[EXPR_REGVM_B];
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_sub, 1)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] - r[EXPR_REGVM_B];
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_mul, 1)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] * r[EXPR_REGVM_B];
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_div, 1)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] / r[EXPR_REGVM_B];
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_add_k, 2)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] + EXPR_REGVM_K;
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_sub_k, 2)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] - EXPR_REGVM_K;
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_mul_k, 2)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] * EXPR_REGVM_K;
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_div_k, 2)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] / EXPR_REGVM_K;
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_add_fn, 1)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] + ast::EvalFn(fn[EXPR_REGVM_B], u);
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_sub_fn, 1)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] - ast::EvalFn(fn[EXPR_REGVM_B], u);
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_mul_fn, 1)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] * ast::EvalFn(fn[EXPR_REGVM_B], u);
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_div_fn, 1)
+								r[EXPR_REGVM_D] = r[EXPR_REGVM_A] / ast::EvalFn(fn[EXPR_REGVM_B], u);
+								EXPR_REGVM_NEXT();
+
+							// functors are called left to right, as in the stack vm
+							EXPR_REGVM_OP(op_fn_add_fn, 1){
+								float lhs = ast::EvalFn(fn[EXPR_REGVM_A], u);
+								r[EXPR_REGVM_D] = lhs + ast::EvalFn(fn[EXPR_REGVM_B], u);
+							}
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_fn_sub_fn, 1){
+								float lhs = ast::EvalFn(fn[EXPR_REGVM_A], u);
+								r[EXPR_REGVM_D] = lhs - ast::EvalFn(fn[EXPR_REGVM_B], u);
+							}
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_fn_mul_k, 2)
+								r[EXPR_REGVM_D] = ast::EvalFn(fn[EXPR_REGVM_A], u) * EXPR_REGVM_K;
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_k_mul_fn_add_fn, 2){
+								float lhs = EXPR_REGVM_K * ast::EvalFn(fn[EXPR_REGVM_A], u);
+								r[EXPR_REGVM_D] = lhs + ast::EvalFn(fn[EXPR_REGVM_B], u);
+							}
+								EXPR_REGVM_NEXT();
+
+							EXPR_REGVM_OP(op_ret, 1)
+								return r[EXPR_REGVM_A];
+#if !EXPR_VM_THREADED
+							default:
+								throw std::invalid_argument("invalid ByteCode op");
+						}
+					}
+#endif
+#undef EXPR_REGVM_NEXT
+#undef EXPR_REGVM_OP
+#undef EXPR_REGVM_K
+#undef EXPR_REGVM_B
+#undef EXPR_REGVM_A
+#undef EXPR_REGVM_D
+				}
+
+			private:
+				uint32_t registers;
+				SmallArray<uint32_t, kInlineCode> code;
+				// one functor per distinct symbol of the program
+				SmallArray<Functor, kInlineFunctors> fns;
+		};
+
+		// a subexpression's result, symbols and constants stay unmaterialized until the
+		// instruction consuming them is known so it can be fused
+		struct Value
+		{
+			enum Kind{ reg, constant, fn, scaled_fn } kind;
+			uint32_t index; // register for reg, functor for fn and scaled_fn
+			float k;        // constant, or the factor of scaled_fn
+		};
+
+		// Registers [0, stack depth) hold temporaries, a subexpression at depth d computes
+		// into register d the way the stack vm would use slot d. Subexpressions occurring
+		// more than once get a register of their own after those, as vm::Compiler keeps
+		// them in locals. Functors are assumed pure, fusing may call them in another
+		// order than the stack vm.
+		template<class Functor, class Evalee>
+		struct Compiler
+		{
+			// nullptr when registers or distinct symbols exceed kMaxRegisters, or for conditions,
+			// comparisons, logical operators and built-in calls, which have no register ops
+			std::shared_ptr<RegisterMachine<Functor, Evalee> const> Compile(ast::Tree const& tree){
+				if(ast::HasConditions(tree) || ast::HasCalls(tree)){
+					return nullptr;
+				}
+				numbering.Number(tree);
+				stack_size = vm::StackSize(tree);
+				Value v = visit(tree, tree.Root(), 0);
+				emit(Instruction(op_ret, 0, materialize(v, 0)));
+				if(stack_size + pinned > kMaxRegisters || fns.size() > kMaxRegisters){
+					return nullptr;
+				}
+				return std::make_shared<RegisterMachine<Functor, Evalee> const>(code, fns, stack_size + pinned);
+			}
+
+			private:
+				// node i at register depth d
+				Value visit(ast::Tree const& tree, uint32_t i, uint32_t d){
+					ast::Node const& n = tree[i];
+					if(n.kind == ast::node_const){
+						return Value{Value::constant, 0, n.value};
+					}
+					uint32_t vn = numbering.Of(i);
+					if(cached(vn)){
+						return Value{Value::reg, locals[vn], 0};
+					}
+					switch (n.kind)
+					{
+						case ast::node_symbol: {
+							if(!shared(vn)){
+								return Value{Value::fn, functor(tree, n.lhs), 0};
+							}
+							uint32_t r = pin(vn);
+							emit(Instruction(op_load_fn, r, functor(tree, n.lhs)));
+							return Value{Value::reg, r, 0};
+						}
+						case ast::node_neg: {
+							uint32_t a = materialize(visit(tree, n.lhs, d), d);
+							uint32_t r = shared(vn) ? pin(vn) : d;
+							emit(Instruction(op_neg, r, a));
+							return Value{Value::reg, r, 0};
+						}
+						case ast::node_binary: {
+							Value acc = visit(tree, n.lhs, d);
+							return combine(acc, n.sign, visit(tree, n.rhs, d+1), vn, d);
+						}
+						default:
+							break;
+					}
+					BOOST_ASSERT(0);
+					return Value{Value::constant, 0, 0};
+				}
+
+				// acc op rhs with acc at register depth and rhs at depth+1, vn numbers the result
+				Value combine(Value acc, char sign, Value rhs, uint32_t vn, uint32_t depth){
+					const bool keep = shared(vn);
+					if(!keep && sign=='*'){
+						// fn*k and k*fn stay pending, a following +fn fuses into op_k_mul_fn_add_fn
+						if(acc.kind==Value::fn && rhs.kind==Value::constant){
+							return Value{Value::scaled_fn, acc.index, rhs.k};
+						}
+						if(acc.kind==Value::constant && rhs.kind==Value::fn){
+							return Value{Value::scaled_fn, rhs.index, acc.k};
+						}
+					}
+					const uint32_t d = keep ? pin(vn) : depth;
+					if(acc.kind==Value::fn && rhs.kind==Value::fn && (sign=='+' || sign=='-')){
+						emit(Instruction(sign=='+' ? op_fn_add_fn : op_fn_sub_fn, d, acc.index, rhs.index));
+					}else if(acc.kind==Value::fn && rhs.kind==Value::constant && sign=='*'){
+						emitConst(Instruction(op_fn_mul_k, d, acc.index), rhs.k);
+					}else if(acc.kind==Value::scaled_fn && rhs.kind==Value::fn && sign=='+'){
+						emitConst(Instruction(op_k_mul_fn_add_fn, d, acc.index, rhs.index), acc.k);
+					}else{
+						uint32_t a = materialize(acc, depth);
+						if(rhs.kind == Value::constant){
+							emitConst(Instruction(ByteCode(op_add_k + arith(sign)), d, a), rhs.k);
+						}else if(rhs.kind == Value::fn){
+							emit(Instruction(ByteCode(op_add_fn + arith(sign)), d, a, rhs.index));
+						}else{
+							emit(Instruction(ByteCode(op_add + arith(sign)), d, a, materialize(rhs, depth+1)));
+						}
+					}
+					return Value{Value::reg, d, 0};
+				}
+
+				// offset of sign's op from the add op of its group
+				static uint32_t arith(char sign){
+					switch (sign)
+					{
+						case '+': return 0;
+						case '-': return 1;
+						case '*': return 2;
+						case '/': return 3;
+					}
+					BOOST_ASSERT(0);
+					return 0;
+				}
+
+				// register holding v, computing it into register d unless it is in one already
+				uint32_t materialize(Value v, uint32_t d){
+					switch (v.kind)
+					{
+						case Value::reg: return v.index;
+						case Value::constant: emitConst(Instruction(op_load_const, d), v.k); break;
+						case Value::fn: emit(Instruction(op_load_fn, d, v.index)); break;
+						case Value::scaled_fn: emitConst(Instruction(op_fn_mul_k, d, v.index), v.k); break;
+					}
+					return d;
+				}
+
+				void emit(uint32_t word){
+					code.push_back(word);
+				}
+
+				void emitConst(uint32_t word, float k){
+					uint32_t bits;
+					std::memcpy(&bits, &k, sizeof(bits));
+					code.push_back(word);
+					code.push_back(bits);
+				}
+
+				// index of the symbol's functor in the machine's table
+				uint32_t functor(ast::Tree const& tree, uint32_t symbol){
+					if(symbol >= symbol2fn.size()){
+						symbol2fn.resize(symbol+1, uint32_t(-1));
+					}
+					if(symbol2fn[symbol] == uint32_t(-1)){
+						symbol2fn[symbol] = uint32_t(fns.size());
+						fns.push_back(tree.Fn<Functor>(symbol));
+					}
+					return symbol2fn[symbol];
+				}
+
+				bool cached(uint32_t vn) const{
+					return vn < locals.size() && locals[vn] != uint32_t(-1);
+				}
+
+				// computed once into a register of its own, constants are cheaper to reload
+				bool shared(uint32_t vn) const{
+					return numbering.Count(vn) >= 2 && !numbering.IsConstant(vn) && !cached(vn);
+				}
+
+				uint32_t pin(uint32_t vn){
+					if(vn >= locals.size()){
+						locals.resize(vn+1, uint32_t(-1));
+					}
+					locals[vn] = stack_size + pinned++;
+					return locals[vn];
+				}
+
+			private:
+				std::vector<uint32_t> code;
+				std::vector<Functor> fns;
+				// grammar symbol index -> functor table index
+				std::vector<uint32_t> symbol2fn;
+				ast::ValueNumbering numbering;
+				// value number -> register
+				std::vector<uint32_t> locals;
+				uint32_t  pinned = 0;
+				uint32_t  stack_size = 0;
+		};
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  The register vm evaluator, three-address code with fused symbol loads,
+	//  runs on the stack vm where the program needs more than 256 registers
+	//  or has conditions. Batches always run on the stack vm, whose columnar
+	//  ops beat scoring the items one by one
+	///////////////////////////////////////////////////////////////////////////
+	template<class Functor, class Evalee>
+	class RegVMEvaluator{
+		public:
+			using element_type = Evalee;
+
+			RegVMEvaluator(ast::Tree const& tree) : machine(regvm::Compiler<Functor, Evalee>().Compile(tree)),
+				fallback(std::make_shared<VMEvaluator<Functor, Evalee>>(tree)){
+#if EXPR_PROFILE
+				site = profile::Register(tree.Source(), "regvm");
+#endif
+			}
+
+			float operator()(element_type const& e) const{
+				EXPR_PROFILE_PROBE(probe, site, 1, profile::kSlots);
+				return machine ? machine->Eval(e) : (*fallback)(e);
+			}
+
+			// scratch: caller owned, at least ScratchSize() floats, e.g. one buffer per worker thread
+			float operator()(element_type const& e, float* scratch) const{
+				EXPR_PROFILE_PROBE(probe, site, 1, profile::kSlots);
+				return machine ? machine->Eval(e, scratch) : (*fallback)(e, scratch);
+			}
+
+			uint32_t ScratchSize() const{ return machine ? machine->Registers() : fallback->ScratchSize(); }
+
+			void EvalBatch(element_type const* items, std::size_t n, float* out) const{
+				EXPR_PROFILE_PROBE(probe, site, n, profile::kSlots);
+				fallback->EvalBatch(items, n, out);
+			}
+
+			void EvalBatch(element_type const* const* items, std::size_t n, float* out) const{
+				EXPR_PROFILE_PROBE(probe, site, n, profile::kSlots);
+				fallback->EvalBatch(items, n, out);
+			}
+
+		private:
+			// shared and immutable, copies of an evaluator run the same code
+			std::shared_ptr<regvm::RegisterMachine<Functor, Evalee> const> machine;
+			// batches, and items where there is no register program
+			std::shared_ptr<VMEvaluator<Functor, Evalee>> fallback;
+#if EXPR_PROFILE
+			// expression totals only, no per-op counts
+			uint32_t site;
+#endif
+	};
+}
@@ -0,0 +1,599 @@
+#pragma once
+
+#include <cmath> // sqrt, fabs, log, exp, pow
+#include <cstddef> // size_t
+#include <cstdint> // INT32_MAX
+#include <cstring> // memcpy
+#include <limits>
+
+#if defined(__SSE__) || defined(__AVX__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace expr { namespace simd
+{
+	///////////////////////////////////////////////////////////////////////////
+	//  Columnar float kernels, widest instruction set enabled at compile time
+	//  first(avx-512, avx/avx2, sse), remaining tail handled by narrower ones
+	///////////////////////////////////////////////////////////////////////////
+	struct Add{
+		static float Apply(float a, float b){ return a+b; }
+#if defined(__AVX512F__)
+		static __m512 Apply(__m512 a, __m512 b){ return _mm512_add_ps(a, b); }
+#endif
+#if defined(__AVX__)
+		static __m256 Apply(__m256 a, __m256 b){ return _mm256_add_ps(a, b); }
+#endif
+#if defined(__SSE__)
+		static __m128 Apply(__m128 a, __m128 b){ return _mm_add_ps(a, b); }
+#endif
+	};
+
+	struct Sub{
+		static float Apply(float a, float b){ return a-b; }
+#if defined(__AVX512F__)
+		static __m512 Apply(__m512 a, __m512 b){ return _mm512_sub_ps(a, b); }
+#endif
+#if defined(__AVX__)
+		static __m256 Apply(__m256 a, __m256 b){ return _mm256_sub_ps(a, b); }
+#endif
+#if defined(__SSE__)
+		static __m128 Apply(__m128 a, __m128 b){ return _mm_sub_ps(a, b); }
+#endif
+	};
+
+	struct Mul{
+		static float Apply(float a, float b){ return a*b; }
+#if defined(__AVX512F__)
+		static __m512 Apply(__m512 a, __m512 b){ return _mm512_mul_ps(a, b); }
+#endif
+#if defined(__AVX__)
+		static __m256 Apply(__m256 a, __m256 b){ return _mm256_mul_ps(a, b); }
+#endif
+#if defined(__SSE__)
+		static __m128 Apply(__m128 a, __m128 b){ return _mm_mul_ps(a, b); }
+#endif
+	};
+
+	struct Div{
+		static float Apply(float a, float b){ return a/b; }
+#if defined(__AVX512F__)
+		static __m512 Apply(__m512 a, __m512 b){ return _mm512_div_ps(a, b); }
+#endif
+#if defined(__AVX__)
+		static __m256 Apply(__m256 a, __m256 b){ return _mm256_div_ps(a, b); }
+#endif
+#if defined(__SSE__)
+		static __m128 Apply(__m128 a, __m128 b){ return _mm_div_ps(a, b); }
+#endif
+	};
+
+	// comparisons yield 1 or 0, NaN compares false to everything but by NotEqual. Masks
+	// are turned into 1 or 0 by and-ing them with 1.0f
+#if defined(__AVX512F__)
+#define EXPR_SIMD_CMP512(pred) \
+		static __m512 Apply(__m512 a, __m512 b){ return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(a, b, pred), _mm512_set1_ps(1)); }
+#else
+#define EXPR_SIMD_CMP512(pred)
+#endif
+#if defined(__AVX__)
+#define EXPR_SIMD_CMP256(pred) \
+		static __m256 Apply(__m256 a, __m256 b){ return _mm256_and_ps(_mm256_cmp_ps(a, b, pred), _mm256_set1_ps(1)); }
+#else
+#define EXPR_SIMD_CMP256(pred)
+#endif
+#if defined(__SSE__)
+#define EXPR_SIMD_CMP128(cmp) \
+		static __m128 Apply(__m128 a, __m128 b){ return _mm_and_ps(cmp(a, b), _mm_set1_ps(1)); }
+#else
+#define EXPR_SIMD_CMP128(cmp)
+#endif
+#define EXPR_SIMD_COMPARE(name, op, pred, cmp) \
+	struct name{ \
+		static float Apply(float a, float b){ return a op b; } \
+		EXPR_SIMD_CMP512(pred) \
+		EXPR_SIMD_CMP256(pred) \
+		EXPR_SIMD_CMP128(cmp) \
+	};
+
+	EXPR_SIMD_COMPARE(Less, <, _CMP_LT_OQ, _mm_cmplt_ps)
+	EXPR_SIMD_COMPARE(LessEqual, <=, _CMP_LE_OQ, _mm_cmple_ps)
+	EXPR_SIMD_COMPARE(Greater, >, _CMP_GT_OQ, _mm_cmpgt_ps)
+	EXPR_SIMD_COMPARE(GreaterEqual, >=, _CMP_GE_OQ, _mm_cmpge_ps)
+	EXPR_SIMD_COMPARE(Equal, ==, _CMP_EQ_OQ, _mm_cmpeq_ps)
+	EXPR_SIMD_COMPARE(NotEqual, !=, _CMP_NEQ_UQ, _mm_cmpneq_ps)
+#undef EXPR_SIMD_COMPARE
+#undef EXPR_SIMD_CMP128
+#undef EXPR_SIMD_CMP256
+#undef EXPR_SIMD_CMP512
+
+	// a < b ? a : b and a > b ? a : b, the second operand when either is NaN, as minps and maxps
+	struct Min{
+		static float Apply(float a, float b){ return a < b ? a : b; }
+#if defined(__AVX512F__)
+		static __m512 Apply(__m512 a, __m512 b){ return _mm512_min_ps(a, b); }
+#endif
+#if defined(__AVX__)
+		static __m256 Apply(__m256 a, __m256 b){ return _mm256_min_ps(a, b); }
+#endif
+#if defined(__SSE__)
+		static __m128 Apply(__m128 a, __m128 b){ return _mm_min_ps(a, b); }
+#endif
+	};
+
+	struct Max{
+		static float Apply(float a, float b){ return a > b ? a : b; }
+#if defined(__AVX512F__)
+		static __m512 Apply(__m512 a, __m512 b){ return _mm512_max_ps(a, b); }
+#endif
+#if defined(__AVX__)
+		static __m256 Apply(__m256 a, __m256 b){ return _mm256_max_ps(a, b); }
+#endif
+#if defined(__SSE__)
+		static __m128 Apply(__m128 a, __m128 b){ return _mm_max_ps(a, b); }
+#endif
+	};
+
+	// correctly rounded, so the same bits as std::sqrt
+	struct Sqrt{
+		static float Apply(float x){ return std::sqrt(x); }
+#if defined(__AVX512F__)
+		static __m512 Apply(__m512 x){ return _mm512_sqrt_ps(x); }
+#endif
+#if defined(__AVX__)
+		static __m256 Apply(__m256 x){ return _mm256_sqrt_ps(x); }
+#endif
+#if defined(__SSE__)
+		static __m128 Apply(__m128 x){ return _mm_sqrt_ps(x); }
+#endif
+	};
+
+	// clears the sign bit, NaN included
+	struct Abs{
+		static float Apply(float x){ return std::fabs(x); }
+#if defined(__AVX512F__)
+		static __m512 Apply(__m512 x){
+			return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(x), _mm512_set1_epi32(0x7fffffff)));
+		}
+#endif
+#if defined(__AVX__)
+		static __m256 Apply(__m256 x){ return _mm256_andnot_ps(_mm256_set1_ps(-0.f), x); }
+#endif
+#if defined(__SSE__)
+		static __m128 Apply(__m128 x){ return _mm_andnot_ps(_mm_set1_ps(-0.f), x); }
+#endif
+	};
+
+	// the standard library's functions, without vector kernels: see Serial
+	struct Log{
+		static float Apply(float x){ return std::log(x); }
+	};
+
+	struct Exp{
+		static float Apply(float x){ return std::exp(x); }
+	};
+
+	struct Sigmoid{
+		static float Apply(float x){ return 1 / (1 + std::exp(-x)); }
+	};
+
+	struct Pow{
+		static float Apply(float x, float y){ return std::pow(x, y); }
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	//  What the approximations below need beyond arithmetic, overloaded for a
+	//  single float and for each vector width
+	///////////////////////////////////////////////////////////////////////////
+
+	// c in every lane of like's type
+	inline float Splat(float, float c){ return c; }
+
+	// a < b ? then : other
+	inline float IfLess(float a, float b, float then, float other){ return a < b ? then : other; }
+
+	// a*b + c, fused wherever the vector widths fuse it so every width rounds alike.
+	// Left to the compiler it may contract some widths and not others
+#if defined(__FMA__)
+	inline float MulAdd(float a, float b, float c){ return std::fma(a, b, c); }
+#else
+	inline float MulAdd(float a, float b, float c){ return a*b + c; }
+#endif
+
+	// 2^n for n integral in [-126, 127]
+	inline float Pow2(float n){
+		uint32_t bits = uint32_t(int32_t(n) + 127) << 23;
+		float r;
+		std::memcpy(&r, &bits, sizeof(r));
+		return r;
+	}
+
+	// unbiased exponent of a positive normal x
+	inline float Exponent(float x){
+		uint32_t bits;
+		std::memcpy(&bits, &x, sizeof(bits));
+		return float(int32_t(bits >> 23) - 127);
+	}
+
+	// x with exponent 0, in [1, 2)
+	inline float Mantissa(float x){
+		uint32_t bits;
+		std::memcpy(&bits, &x, sizeof(bits));
+		bits = (bits & 0x007fffff) | 0x3f800000;
+		float r;
+		std::memcpy(&r, &bits, sizeof(r));
+		return r;
+	}
+
+#if defined(__SSE__)
+	inline __m128 Splat(__m128, float c){ return _mm_set1_ps(c); }
+
+	inline __m128 IfLess(__m128 a, __m128 b, __m128 then, __m128 other){
+		__m128 less = _mm_cmplt_ps(a, b);
+		return _mm_or_ps(_mm_and_ps(less, then), _mm_andnot_ps(less, other));
+	}
+
+#if defined(__FMA__)
+	inline __m128 MulAdd(__m128 a, __m128 b, __m128 c){ return _mm_fmadd_ps(a, b, c); }
+#else
+	inline __m128 MulAdd(__m128 a, __m128 b, __m128 c){ return _mm_add_ps(_mm_mul_ps(a, b), c); }
+#endif
+
+	inline __m128 Pow2(__m128 n){
+		return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23));
+	}
+
+	inline __m128 Exponent(__m128 x){
+		__m128i e = _mm_srli_epi32(_mm_castps_si128(x), 23);
+		return _mm_cvtepi32_ps(_mm_sub_epi32(e, _mm_set1_epi32(127)));
+	}
+
+	inline __m128 Mantissa(__m128 x){
+		__m128i bits = _mm_and_si128(_mm_castps_si128(x), _mm_set1_epi32(0x007fffff));
+		return _mm_castsi128_ps(_mm_or_si128(bits, _mm_set1_epi32(0x3f800000)));
+	}
+#endif
+
+#if defined(__AVX__)
+	inline __m256 Splat(__m256, float c){ return _mm256_set1_ps(c); }
+
+	inline __m256 IfLess(__m256 a, __m256 b, __m256 then, __m256 other){
+		return _mm256_blendv_ps(other, then, _mm256_cmp_ps(a, b, _CMP_LT_OQ));
+	}
+
+#if defined(__FMA__)
+	inline __m256 MulAdd(__m256 a, __m256 b, __m256 c){ return _mm256_fmadd_ps(a, b, c); }
+#else
+	inline __m256 MulAdd(__m256 a, __m256 b, __m256 c){ return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+
+#if defined(__AVX2__)
+	inline __m256 Pow2(__m256 n){
+		return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127)), 23));
+	}
+
+	inline __m256 Exponent(__m256 x){
+		__m256i e = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+		return _mm256_cvtepi32_ps(_mm256_sub_epi32(e, _mm256_set1_epi32(127)));
+	}
+
+	inline __m256 Mantissa(__m256 x){
+		__m256i bits = _mm256_and_si256(_mm256_castps_si256(x), _mm256_set1_epi32(0x007fffff));
+		return _mm256_castsi256_ps(_mm256_or_si256(bits, _mm256_set1_epi32(0x3f800000)));
+	}
+#else
+	// without avx2 the integer parts are done on each 128 bit half
+	inline __m256 Pow2(__m256 n){
+		__m256 lo = _mm256_castps128_ps256(Pow2(_mm256_castps256_ps128(n)));
+		return _mm256_insertf128_ps(lo, Pow2(_mm256_extractf128_ps(n, 1)), 1);
+	}
+
+	inline __m256 Exponent(__m256 x){
+		__m256 lo = _mm256_castps128_ps256(Exponent(_mm256_castps256_ps128(x)));
+		return _mm256_insertf128_ps(lo, Exponent(_mm256_extractf128_ps(x, 1)), 1);
+	}
+
+	inline __m256 Mantissa(__m256 x){
+		__m256 lo = _mm256_castps128_ps256(Mantissa(_mm256_castps256_ps128(x)));
+		return _mm256_insertf128_ps(lo, Mantissa(_mm256_extractf128_ps(x, 1)), 1);
+	}
+#endif
+#endif
+
+#if defined(__AVX512F__)
+	inline __m512 Splat(__m512, float c){ return _mm512_set1_ps(c); }
+
+	inline __m512 IfLess(__m512 a, __m512 b, __m512 then, __m512 other){
+		return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), other, then);
+	}
+
+	// avx512f always has fma
+	inline __m512 MulAdd(__m512 a, __m512 b, __m512 c){
+#if defined(__FMA__)
+		return _mm512_fmadd_ps(a, b, c);
+#else
+		return _mm512_add_ps(_mm512_mul_ps(a, b), c);
+#endif
+	}
+
+	inline __m512 Pow2(__m512 n){
+		return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(n), _mm512_set1_epi32(127)), 23));
+	}
+
+	inline __m512 Exponent(__m512 x){
+		__m512i e = _mm512_srli_epi32(_mm512_castps_si512(x), 23);
+		return _mm512_cvtepi32_ps(_mm512_sub_epi32(e, _mm512_set1_epi32(127)));
+	}
+
+	inline __m512 Mantissa(__m512 x){
+		__m512i bits = _mm512_and_si512(_mm512_castps_si512(x), _mm512_set1_epi32(0x007fffff));
+		return _mm512_castsi512_ps(_mm512_or_si512(bits, _mm512_set1_epi32(0x3f800000)));
+	}
+#endif
+
+	///////////////////////////////////////////////////////////////////////////
+	//  Polynomial approximations of exp and log after Cephes' expf and logf,
+	//  one template for a float and every vector width: the same operations
+	//  in the same order, so an item and a batch get the same bits. Results
+	//  are within a few ulp of std::exp and std::log, exp flushes results
+	//  below the smallest normal float to 0
+	///////////////////////////////////////////////////////////////////////////
+	template<class V>
+	inline V FastExpOf(V x){
+		// lanes flushed to 0 below compute exp(0) instead, keeping the arithmetic off
+		// subnormals and their slow path. NaN is kept
+		V t = IfLess(x, Splat(x, -87.3365479f), Splat(x, 0), x);
+		// t = n*ln2 + r with |r| <= ln2/2, n rounded to nearest by adding and taking away 1.5*2^23.
+		// n is clamped before it is converted, NaN included, r keeps t's NaN
+		V n = Sub::Apply(MulAdd(t, Splat(x, 1.44269504f), Splat(x, 12582912.f)), Splat(x, 12582912.f));
+		n = Min::Apply(Max::Apply(n, Splat(x, -126.f)), Splat(x, 127.f));
+		V r = MulAdd(n, Splat(x, 2.12194440e-4f), MulAdd(n, Splat(x, -0.693359375f), t));
+		V z = Mul::Apply(r, r);
+		V p = Splat(x, 1.9875691500e-4f);
+		p = MulAdd(p, r, Splat(x, 1.3981999507e-3f));
+		p = MulAdd(p, r, Splat(x, 8.3334519073e-3f));
+		p = MulAdd(p, r, Splat(x, 4.1665795894e-2f));
+		p = MulAdd(p, r, Splat(x, 1.6666665459e-1f));
+		p = MulAdd(p, r, Splat(x, 5.0000001201e-1f));
+		p = Add::Apply(MulAdd(p, z, r), Splat(x, 1));
+		V y = Mul::Apply(p, Pow2(n));
+		y = IfLess(Splat(x, 88.7228394f), x, Splat(x, std::numeric_limits<float>::infinity()), y);
+		return IfLess(x, Splat(x, -87.3365479f), Splat(x, 0), y);
+	}
+
+	template<class V>
+	inline V FastLogOf(V x){
+		const V min_normal = Splat(x, std::numeric_limits<float>::min());
+		// subnormals scaled by 2^23 into the normals
+		V normal = IfLess(x, min_normal, Mul::Apply(x, Splat(x, 8388608.f)), x);
+		V e = Add::Apply(Exponent(normal), IfLess(x, min_normal, Splat(x, -23.f), Splat(x, 0)));
+		// x = 2^e * m with m in [sqrt(1/2), sqrt(2)), log x = e*ln2 + log(1+f)
+		V m = Mantissa(normal);
+		e = IfLess(Splat(x, 1.41421356f), m, Add::Apply(e, Splat(x, 1)), e);
+		m = IfLess(Splat(x, 1.41421356f), m, Mul::Apply(m, Splat(x, 0.5f)), m);
+		V f = Sub::Apply(m, Splat(x, 1));
+		V z = Mul::Apply(f, f);
+		V y = Splat(x, 7.0376836292e-2f);
+		y = MulAdd(y, f, Splat(x, -1.1514610310e-1f));
+		y = MulAdd(y, f, Splat(x, 1.1676998740e-1f));
+		y = MulAdd(y, f, Splat(x, -1.2420140846e-1f));
+		y = MulAdd(y, f, Splat(x, 1.4249322787e-1f));
+		y = MulAdd(y, f, Splat(x, -1.6668057665e-1f));
+		y = MulAdd(y, f, Splat(x, 2.0000714765e-1f));
+		y = MulAdd(y, f, Splat(x, -2.4999993993e-1f));
+		y = MulAdd(y, f, Splat(x, 3.3333331174e-1f));
+		y = Mul::Apply(Mul::Apply(y, f), z);
+		y = MulAdd(e, Splat(x, -2.12194440e-4f), y);
+		y = MulAdd(z, Splat(x, -0.5f), y);
+		V r = MulAdd(e, Splat(x, 0.693359375f), Add::Apply(f, y));
+		// log 0 = -inf, log of a negative is NaN, log inf = inf, NaN stays NaN
+		const float inf = std::numeric_limits<float>::infinity();
+		r = IfLess(Splat(x, 0), x, r, Splat(x, -inf));
+		r = IfLess(x, Splat(x, 0), Splat(x, std::numeric_limits<float>::quiet_NaN()), r);
+		return IfLess(x, Splat(x, inf), r, x);
+	}
+
+	struct FastExp{
+		template<class V>
+		static V Apply(V x){ return FastExpOf(x); }
+	};
+
+	struct FastLog{
+		template<class V>
+		static V Apply(V x){ return FastLogOf(x); }
+	};
+
+	// 1/(1+exp(-x))
+	struct FastSigmoid{
+		template<class V>
+		static V Apply(V x){
+			return Div::Apply(Splat(x, 1), Add::Apply(Splat(x, 1), FastExpOf(Mul::Apply(x, Splat(x, -1)))));
+		}
+	};
+
+	// exp(y*log(x)), NaN for a negative x and for 0^0
+	struct FastPow{
+		template<class V>
+		static V Apply(V x, V y){ return FastExpOf(Mul::Apply(y, FastLogOf(x))); }
+	};
+
+	// lhs[i] = Op(lhs[i], rhs[i])
+	template<class Op>
+	inline void Binary(float* lhs, float const* rhs, std::size_t n){
+		std::size_t i = 0;
+#if defined(__AVX512F__)
+		for(; i+16<=n; i+=16){
+			_mm512_storeu_ps(lhs+i, Op::Apply(_mm512_loadu_ps(lhs+i), _mm512_loadu_ps(rhs+i)));
+		}
+#endif
+#if defined(__AVX__)
+		for(; i+8<=n; i+=8){
+			_mm256_storeu_ps(lhs+i, Op::Apply(_mm256_loadu_ps(lhs+i), _mm256_loadu_ps(rhs+i)));
+		}
+#endif
+#if defined(__SSE__)
+		for(; i+4<=n; i+=4){
+			_mm_storeu_ps(lhs+i, Op::Apply(_mm_loadu_ps(lhs+i), _mm_loadu_ps(rhs+i)));
+		}
+#endif
+		for(; i<n; ++i){
+			lhs[i] = Op::Apply(lhs[i], rhs[i]);
+		}
+	}
+
+	// col[i] = Op(col[i])
+	template<class Op>
+	inline void Unary(float* col, std::size_t n){
+		std::size_t i = 0;
+#if defined(__AVX512F__)
+		for(; i+16<=n; i+=16){
+			_mm512_storeu_ps(col+i, Op::Apply(_mm512_loadu_ps(col+i)));
+		}
+#endif
+#if defined(__AVX__)
+		for(; i+8<=n; i+=8){
+			_mm256_storeu_ps(col+i, Op::Apply(_mm256_loadu_ps(col+i)));
+		}
+#endif
+#if defined(__SSE__)
+		for(; i+4<=n; i+=4){
+			_mm_storeu_ps(col+i, Op::Apply(_mm_loadu_ps(col+i)));
+		}
+#endif
+		for(; i<n; ++i){
+			col[i] = Op::Apply(col[i]);
+		}
+	}
+
+	// Unary and Binary one float at a time, for ops with a scalar Apply only
+	template<class Op>
+	inline void Serial(float* col, std::size_t n){
+		for(std::size_t i=0; i<n; ++i){
+			col[i] = Op::Apply(col[i]);
+		}
+	}
+
+	template<class Op>
+	inline void Serial(float* lhs, float const* rhs, std::size_t n){
+		for(std::size_t i=0; i<n; ++i){
+			lhs[i] = Op::Apply(lhs[i], rhs[i]);
+		}
+	}
+
+	// col[i] = -col[i], by flipping the sign bit
+	inline void Neg(float* col, std::size_t n){
+		std::size_t i = 0;
+#if defined(__AVX512F__)
+		const __m512i sign16 = _mm512_set1_epi32(int32_t(0x80000000u));
+		for(; i+16<=n; i+=16){
+			__m512i v = _mm512_castps_si512(_mm512_loadu_ps(col+i));
+			_mm512_storeu_ps(col+i, _mm512_castsi512_ps(_mm512_xor_si512(v, sign16)));
+		}
+#endif
+#if defined(__AVX__)
+		const __m256 sign8 = _mm256_set1_ps(-0.f);
+		for(; i+8<=n; i+=8){
+			_mm256_storeu_ps(col+i, _mm256_xor_ps(_mm256_loadu_ps(col+i), sign8));
+		}
+#endif
+#if defined(__SSE__)
+		const __m128 sign4 = _mm_set1_ps(-0.f);
+		for(; i+4<=n; i+=4){
+			_mm_storeu_ps(col+i, _mm_xor_ps(_mm_loadu_ps(col+i), sign4));
+		}
+#endif
+		for(; i<n; ++i){
+			col[i] = -col[i];
+		}
+	}
+
+	// col[i] = col[i] == 0 ? 1 : 0
+	inline void Not(float* col, std::size_t n){
+		std::size_t i = 0;
+#if defined(__AVX__)
+		for(; i+8<=n; i+=8){
+			__m256 zero = _mm256_cmp_ps(_mm256_loadu_ps(col+i), _mm256_setzero_ps(), _CMP_EQ_OQ);
+			_mm256_storeu_ps(col+i, _mm256_and_ps(zero, _mm256_set1_ps(1)));
+		}
+#endif
+#if defined(__SSE__)
+		for(; i+4<=n; i+=4){
+			__m128 zero = _mm_cmpeq_ps(_mm_loadu_ps(col+i), _mm_setzero_ps());
+			_mm_storeu_ps(col+i, _mm_and_ps(zero, _mm_set1_ps(1)));
+		}
+#endif
+		for(; i<n; ++i){
+			col[i] = col[i] == 0;
+		}
+	}
+
+	// cond[i] = cond[i] != 0 ? then[i] : other[i], both branches computed beforehand
+	inline void Select(float* cond, float const* then, float const* other, std::size_t n){
+		std::size_t i = 0;
+#if defined(__AVX__)
+		for(; i+8<=n; i+=8){
+			__m256 taken = _mm256_cmp_ps(_mm256_loadu_ps(cond+i), _mm256_setzero_ps(), _CMP_NEQ_UQ);
+			_mm256_storeu_ps(cond+i, _mm256_blendv_ps(_mm256_loadu_ps(other+i), _mm256_loadu_ps(then+i), taken));
+		}
+#endif
+#if defined(__SSE__)
+		for(; i+4<=n; i+=4){
+			__m128 taken = _mm_cmpneq_ps(_mm_loadu_ps(cond+i), _mm_setzero_ps());
+			__m128 blend = _mm_or_ps(_mm_and_ps(taken, _mm_loadu_ps(then+i)), _mm_andnot_ps(taken, _mm_loadu_ps(other+i)));
+			_mm_storeu_ps(cond+i, blend);
+		}
+#endif
+		for(; i<n; ++i){
+			cond[i] = cond[i] != 0 ? then[i] : other[i];
+		}
+	}
+
+	// col[i] = v
+	inline void Fill(float* col, float v, std::size_t n){
+		std::size_t i = 0;
+#if defined(__AVX512F__)
+		for(; i+16<=n; i+=16){
+			_mm512_storeu_ps(col+i, _mm512_set1_ps(v));
+		}
+#endif
+#if defined(__AVX__)
+		for(; i+8<=n; i+=8){
+			_mm256_storeu_ps(col+i, _mm256_set1_ps(v));
+		}
+#endif
+#if defined(__SSE__)
+		for(; i+4<=n; i+=4){
+			_mm_storeu_ps(col+i, _mm_set1_ps(v));
+		}
+#endif
+		for(; i<n; ++i){
+			col[i] = v;
+		}
+	}
+
+	// col[i] = *(float*)(base + i*stride), i.e. one float member loaded from each item of an array
+	inline void Gather(float* col, char const* base, std::size_t stride, std::size_t n){
+		std::size_t i = 0;
+#if defined(__AVX512F__) || defined(__AVX2__)
+		if(stride*n <= std::size_t(INT32_MAX)){
+			const int s = int(stride);
+#if defined(__AVX512F__)
+			const __m512i idx16 = _mm512_mullo_epi32(_mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15),
+				_mm512_set1_epi32(s));
+			for(; i+16<=n; i+=16){
+				_mm512_storeu_ps(col+i, _mm512_i32gather_ps(idx16, base+i*stride, 1));
+			}
+#endif
+#if defined(__AVX2__)
+			const __m256i idx8 = _mm256_mullo_epi32(_mm256_setr_epi32(0,1,2,3,4,5,6,7), _mm256_set1_epi32(s));
+			for(; i+8<=n; i+=8){
+				_mm256_storeu_ps(col+i, _mm256_i32gather_ps(reinterpret_cast<float const*>(base+i*stride), idx8, 1));
+			}
+#endif
+		}
+#endif
+		for(; i<n; ++i){
+			col[i] = *reinterpret_cast<float const*>(base+i*stride);
+		}
+	}
+}}
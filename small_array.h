@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef> // size_t
+#include <iterator> // distance, make_move_iterator
+#include <memory> // uninitialized_copy, uninitialized_fill_n
+#include <new>
+#include <type_traits> // aligned_storage, is_nothrow_move_constructible
+#include <utility> // move
+
+namespace expr
+{
+	///////////////////////////////////////////////////////////////////////////
+	//  An array sized once on construction, its elements kept within the
+	//  object up to N of them and in one heap block beyond. A short program
+	//  then lives in the same allocation as the object holding it
+	///////////////////////////////////////////////////////////////////////////
+	template<class T, std::size_t N>
+	class SmallArray{
+		public:
+			SmallArray() : ptr(local()){}
+
+			template<class Iterator>
+			SmallArray(Iterator first, Iterator last) : count(std::size_t(std::distance(first, last))){
+				allocate();
+				try{
+					std::uninitialized_copy(first, last, ptr);
+				}catch(...){
+					deallocate();
+					throw;
+				}
+			}
+
+			SmallArray(std::size_t n, T const& value) : count(n){
+				allocate();
+				try{
+					std::uninitialized_fill_n(ptr, n, value);
+				}catch(...){
+					deallocate();
+					throw;
+				}
+			}
+
+			SmallArray(SmallArray const& other) : SmallArray(other.begin(), other.end()){}
+
+			// noexcept whenever T's move is, so vectors of arrays move on reallocation
+			SmallArray(SmallArray&& other) noexcept(std::is_nothrow_move_constructible<T>::value) : ptr(local()){
+				steal(other);
+			}
+
+			SmallArray& operator=(SmallArray other){
+				release();
+				steal(other);
+				return *this;
+			}
+
+			~SmallArray(){
+				release();
+			}
+
+			std::size_t size() const{ return count; }
+			bool empty() const{ return count == 0; }
+			// whether the elements are kept within the object
+			bool Inline() const{ return ptr == local(); }
+
+			T* data(){ return ptr; }
+			T const* data() const{ return ptr; }
+			T* begin(){ return ptr; }
+			T const* begin() const{ return ptr; }
+			T* end(){ return ptr + count; }
+			T const* end() const{ return ptr + count; }
+			T& operator[](std::size_t i){ return ptr[i]; }
+			T const& operator[](std::size_t i) const{ return ptr[i]; }
+
+		private:
+			T* local(){ return reinterpret_cast<T*>(storage); }
+			T const* local() const{ return reinterpret_cast<T const*>(storage); }
+
+			void allocate(){
+				ptr = count <= N ? local() : static_cast<T*>(::operator new(count*sizeof(T)));
+			}
+
+			void deallocate(){
+				if(ptr != local()){
+					::operator delete(ptr);
+				}
+				ptr = local();
+				count = 0;
+			}
+
+			void release(){
+				for(std::size_t i=0; i<count; ++i){
+					ptr[i].~T();
+				}
+				deallocate();
+			}
+
+			// takes other's elements, leaving it empty. A heap block changes hands, inline
+			// elements are moved one by one
+			void steal(SmallArray& other){
+				if(!other.Inline()){
+					ptr = other.ptr;
+					count = other.count;
+					other.ptr = other.local();
+					other.count = 0;
+					return;
+				}
+				std::uninitialized_copy(std::make_move_iterator(other.begin()), std::make_move_iterator(other.end()), local());
+				count = other.count;
+				other.release();
+			}
+
+		private:
+			std::size_t count = 0;
+			T* ptr;
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage[N];
+	};
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <array>
+#include <exception> // invalid_argument
+#include <iterator> // distance, next
+#include <string>
+#include <type_traits>
+
+#include "binding.h"
+#include "optimizer.h" // Apply
+#include "raw_ast.h"
+
+namespace expr{
+	namespace ct{
+		///////////////////////////////////////////////////////////////////////////
+		//  Expression templates: a C++ expression over Symbol placeholders builds
+		//  a tree type evaluated with the grammar's left-fold semantics, all of it
+		//  visible to the compiler
+		///////////////////////////////////////////////////////////////////////////
+
+		// the symbol at position I of the grammar's symbol list
+		template<uint32_t I>
+		struct Symbol
+		{
+			template<class Functors, class Item>
+			float Eval(Functors const& fns, Item* u) const{
+				return ast::EvalFn(fns[I], u);
+			}
+		};
+
+		struct Constant
+		{
+			float value;
+
+			template<class Functors, class Item>
+			float Eval(Functors const&, Item*) const{
+				return value;
+			}
+		};
+
+		template<class E>
+		struct Negate
+		{
+			E operand;
+
+			template<class Functors, class Item>
+			float Eval(Functors const& fns, Item* u) const{
+				return -operand.Eval(fns, u);
+			}
+		};
+
+		template<char Sign, class L, class R>
+		struct Binary
+		{
+			L lhs;
+			R rhs;
+
+			// operands are evaluated left to right, as by the runtime evaluators
+			template<class Functors, class Item>
+			float Eval(Functors const& fns, Item* u) const{
+				float l = lhs.Eval(fns, u);
+				return ast::Apply(Sign, l, rhs.Eval(fns, u));
+			}
+		};
+
+		template<class E>
+		struct Not
+		{
+			E operand;
+
+			template<class Functors, class Item>
+			float Eval(Functors const& fns, Item* u) const{
+				return operand.Eval(fns, u) == 0;
+			}
+		};
+
+		// && and ||, rhs only evaluated when lhs doesn't decide the result
+		template<char Sign, class L, class R>
+		struct Logical
+		{
+			L lhs;
+			R rhs;
+
+			template<class Functors, class Item>
+			float Eval(Functors const& fns, Item* u) const{
+				bool l = lhs.Eval(fns, u) != 0;
+				if(l == (Sign=='|')){
+					return l;
+				}
+				return rhs.Eval(fns, u) != 0;
+			}
+		};
+
+		// built-in Fn(a, b, c), arguments past its arity are Constant 0 and ignored
+		template<char Fn, class A, class B, class C>
+		struct Call
+		{
+			A a;
+			B b;
+			C c;
+
+			template<class Functors, class Item>
+			float Eval(Functors const& fns, Item* u) const{
+				float x = a.Eval(fns, u);
+				float y = b.Eval(fns, u);
+				return ast::ApplyBuiltin(Fn, x, y, c.Eval(fns, u));
+			}
+		};
+
+		template<class T>
+		struct IsNode : std::false_type{};
+		template<uint32_t I>
+		struct IsNode<Symbol<I>> : std::true_type{};
+		template<>
+		struct IsNode<Constant> : std::true_type{};
+		template<class E>
+		struct IsNode<Negate<E>> : std::true_type{};
+		template<char Sign, class L, class R>
+		struct IsNode<Binary<Sign, L, R>> : std::true_type{};
+		template<class E>
+		struct IsNode<Not<E>> : std::true_type{};
+		template<char Sign, class L, class R>
+		struct IsNode<Logical<Sign, L, R>> : std::true_type{};
+		template<char Fn, class A, class B, class C>
+		struct IsNode<Call<Fn, A, B, C>> : std::true_type{};
+
+		// number of functors an expression refers to, i.e. its highest symbol position + 1
+		template<class T>
+		struct Arity : std::integral_constant<uint32_t, 0>{};
+		template<uint32_t I>
+		struct Arity<Symbol<I>> : std::integral_constant<uint32_t, I+1>{};
+		template<class E>
+		struct Arity<Negate<E>> : Arity<E>{};
+		template<char Sign, class L, class R>
+		struct Arity<Binary<Sign, L, R>> : std::integral_constant<uint32_t,
+			(Arity<L>::value > Arity<R>::value ? Arity<L>::value : Arity<R>::value)>{};
+		template<class E>
+		struct Arity<Not<E>> : Arity<E>{};
+		template<char Sign, class L, class R>
+		struct Arity<Logical<Sign, L, R>> : Arity<Binary<Sign, L, R>>{};
+		template<char Fn, class A, class B, class C>
+		struct Arity<Call<Fn, A, B, C>> : Arity<Binary<Fn, Binary<Fn, A, B>, C>>{};
+
+		// operand type of a node or number, numbers become float constants as parsed by the grammar.
+		// C++ computes an operation between two numbers before it's lifted, in int for integers, so
+		// 1/3*like would be 0*like. Integers are rejected to catch that, write 1.0/3*like instead
+		template<class T, class Enable=void>
+		struct Lifted{};
+		template<class T>
+		struct Lifted<T, typename std::enable_if<IsNode<T>::value>::type>{
+			typedef T type;
+			static T const& Lift(T const& x){ return x; }
+		};
+		template<class T>
+		struct Lifted<T, typename std::enable_if<std::is_floating_point<T>::value>::type>{
+			typedef Constant type;
+			static Constant Lift(T x){ return Constant{float(x)}; }
+		};
+		template<class T>
+		struct Lifted<T, typename std::enable_if<std::is_integral<T>::value>::type>{
+			typedef Constant type;
+			static Constant Lift(T x){
+				static_assert(!std::is_integral<T>::value,
+					"integer operand in a static expression, write numbers as floating point(2.0, not 2)");
+				return Constant{float(x)};
+			}
+		};
+
+		// 0..N-1 as a parameter pack
+		template<uint32_t... I>
+		struct Indices{};
+		template<uint32_t N, uint32_t... I>
+		struct MakeIndices : MakeIndices<N-1, N-1, I...>{};
+		template<uint32_t... I>
+		struct MakeIndices<0, I...>{
+			typedef Indices<I...> type;
+		};
+
+		// the grammar's operators, at least one side has to be a node. ?: can't be overloaded
+		// and has no expression template
+#define EXPR_CT_BINARY(op, sign, Node)  \
+		template<class L, class R> \
+		auto operator op(L const& lhs, R const& rhs) \
+		-> typename std::enable_if<IsNode<L>::value || IsNode<R>::value, \
+			Node<sign, typename Lifted<L>::type, typename Lifted<R>::type>>::type{ \
+			return {Lifted<L>::Lift(lhs), Lifted<R>::Lift(rhs)}; \
+		}
+
+		EXPR_CT_BINARY(+, '+', Binary)
+		EXPR_CT_BINARY(-, '-', Binary)
+		EXPR_CT_BINARY(*, '*', Binary)
+		EXPR_CT_BINARY(/, '/', Binary)
+		EXPR_CT_BINARY(<, '<', Binary)
+		EXPR_CT_BINARY(>, '>', Binary)
+		EXPR_CT_BINARY(<=, 'l', Binary)
+		EXPR_CT_BINARY(>=, 'g', Binary)
+		EXPR_CT_BINARY(==, '=', Binary)
+		EXPR_CT_BINARY(!=, '!', Binary)
+		EXPR_CT_BINARY(&&, '&', Logical)
+		EXPR_CT_BINARY(||, '|', Logical)
+#undef EXPR_CT_BINARY
+
+		template<class E>
+		auto operator!(E const& e) -> typename std::enable_if<IsNode<E>::value, Not<E>>::type{
+			return {e};
+		}
+
+		template<class E>
+		auto operator-(E const& e) -> typename std::enable_if<IsNode<E>::value, Negate<E>>::type{
+			return {e};
+		}
+
+		template<class E>
+		auto operator+(E const& e) -> typename std::enable_if<IsNode<E>::value, E>::type{
+			return e;
+		}
+
+		// the grammar's built-ins, spelled as parsed and found by argument dependent lookup
+#define EXPR_CT_CALL1(name, fn) \
+		template<class A> \
+		auto name(A const& a) -> typename std::enable_if<IsNode<A>::value, Call<fn, A, Constant, Constant>>::type{ \
+			return {a, Constant{0}, Constant{0}}; \
+		}
+#define EXPR_CT_CALL2(name, fn) \
+		template<class A, class B> \
+		auto name(A const& a, B const& b) \
+		-> typename std::enable_if<IsNode<A>::value || IsNode<B>::value, \
+			Call<fn, typename Lifted<A>::type, typename Lifted<B>::type, Constant>>::type{ \
+			return {Lifted<A>::Lift(a), Lifted<B>::Lift(b), Constant{0}}; \
+		}
+
+		EXPR_CT_CALL1(log, ast::fn_log)
+		EXPR_CT_CALL1(exp, ast::fn_exp)
+		EXPR_CT_CALL1(sqrt, ast::fn_sqrt)
+		EXPR_CT_CALL1(abs, ast::fn_abs)
+		EXPR_CT_CALL1(sigmoid, ast::fn_sigmoid)
+		EXPR_CT_CALL2(pow, ast::fn_pow)
+		EXPR_CT_CALL2(min, ast::fn_min)
+		EXPR_CT_CALL2(max, ast::fn_max)
+#undef EXPR_CT_CALL1
+#undef EXPR_CT_CALL2
+
+		template<class X, class Lo, class Hi>
+		auto clamp(X const& x, Lo const& lo, Hi const& hi)
+		-> typename std::enable_if<IsNode<X>::value || IsNode<Lo>::value || IsNode<Hi>::value,
+			Call<ast::fn_clamp, typename Lifted<X>::type, typename Lifted<Lo>::type, typename Lifted<Hi>::type>>::type{
+			return {Lifted<X>::Lift(x), Lifted<Lo>::Lift(lo), Lifted<Hi>::Lift(hi)};
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	//  The compile-time specialized evaluator, Expr is the tree type built by
+	//  EXPR_STATIC, functors are bound by symbol position as in MakeGrammar
+	///////////////////////////////////////////////////////////////////////////
+	template<class Expr, class Functor, class Item>
+	class StaticEvaluator{
+		public:
+			using element_type = Item;
+
+			template<class Functors>
+			StaticEvaluator(Functors const& fnList, Expr const& e, std::string t) :
+				fns(bind(fnList)), expression(e), text(std::move(t)){}
+
+			float operator()(element_type const& e) const{
+				return expression.Eval(fns, const_cast<element_type*>(&e));
+			}
+
+			void EvalBatch(element_type const* items, std::size_t n, float* out) const{
+				for(std::size_t i=0; i<n; ++i) out[i] = (*this)(items[i]);
+			}
+
+			void EvalBatch(element_type const* const* items, std::size_t n, float* out) const{
+				for(std::size_t i=0; i<n; ++i) out[i] = (*this)(*items[i]);
+			}
+
+			// source of the expression, accepted as is by CalcGrammar::Parse
+			std::string const& Text() const{ return text; }
+
+		private:
+			// a fixed array held by value, so functors known where the evaluator is built can be
+			// propagated into the inlined calls
+			typedef std::array<Functor, ct::Arity<Expr>::value> Functors;
+
+			template<class List>
+			static Functors bind(List const& fnList){
+				if(std::size_t(std::distance(fnList.begin(), fnList.end())) < ct::Arity<Expr>::value){
+					throw std::invalid_argument("too few functors for the static expression");
+				}
+				return bind(fnList, typename ct::MakeIndices<ct::Arity<Expr>::value>::type());
+			}
+
+			// each functor copy constructed in place, Functor needn't be default constructible
+			template<class List, uint32_t... I>
+			static Functors bind(List const& fnList, ct::Indices<I...>){
+				return Functors{{Functor(*std::next(fnList.begin(), I))...}};
+			}
+
+		private:
+			Functors fns;
+			Expr expression;
+			std::string text;
+	};
+
+	template<class Functors, class Expr,
+		class Functor=typename ContainedType<Functors>::type>
+	auto MakeStatic(Functors const& fnList, Expr const& e, std::string text)
+	-> typename boost::enable_if<arg1_type<Functor>, StaticEvaluator<Expr, Functor, typename arg1_type<Functor>::type>>::type{
+		return {fnList, e, std::move(text)};
+	}
+}
+
+// EXPR_STATIC(fnList, like*follow/(comment-follow)) with `expr::ct::Symbol<0> like;` and so on declared for
+// each symbol. Builds a StaticEvaluator whose Text() is the expression spelled as written, so numbers
+// must be written the way the grammar reads them(0.1, not 0.1f) and as floating point(2.0, not 2).
+// An operation between two numbers is computed by C++ in double before the expression sees it, where
+// the grammar folds it in float, so keep numbers next to symbols or fold them by hand(0.5*like, not
+// 1.0/2*like) for results that match CalcGrammar::Parse(Text()) bit for bit
+#define EXPR_STATIC(fnList, ...) ::expr::MakeStatic((fnList), (__VA_ARGS__), #__VA_ARGS__)
+
+// same, with the item type given explicitly as with TypeHint
+#define EXPR_STATIC_HINT(Item, fnList, ...) ::expr::TypeHint<Item>::MakeStatic((fnList), (__VA_ARGS__), #__VA_ARGS__)
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm> // push_heap, pop_heap, sort_heap
+#include <cmath> // isnan
+#include <limits>
+#include <vector>
+
+#include "batch.h"
+
+namespace expr{
+	namespace topk{
+
+		struct Scored
+		{
+			std::size_t index;
+			float score;
+		};
+
+		// higher score first, the lower index on ties
+		inline bool Better(Scored const& a, Scored const& b){
+			return a.score > b.score || (a.score == b.score && a.index < b.index);
+		}
+
+		// every block may hold a winner
+		struct Unbounded
+		{
+			float operator()(std::size_t, std::size_t) const{
+				return std::numeric_limits<float>::infinity();
+			}
+		};
+
+		// items are scored a block at a time into a buffer on the stack and only those beating
+		// the k-th best so far touch the heap, whose top is that k-th best
+		template<class Evaluator, class Items, class Bound>
+		std::vector<Scored> Run(Evaluator const& evaluator, Items items, std::size_t n, std::size_t k, Bound const& bound){
+			std::vector<Scored> heap;
+			if(k == 0){
+				return heap;
+			}
+			heap.reserve(k < n ? k : n);
+			float scores[batch::kBlockSize];
+			for(std::size_t base=0; base<n; base+=batch::kBlockSize){
+				const std::size_t m = batch::BlockLen(base, n);
+				if(heap.size() == k && !(bound(base, base+m) > heap.front().score)){
+					continue;
+				}
+				evaluator.EvalBatch(items+base, m, scores);
+				for(std::size_t j=0; j<m; ++j){
+					const float s = scores[j];
+					if(std::isnan(s)){
+						continue;
+					}
+					if(heap.size() < k){
+						heap.push_back(Scored{base+j, s});
+						std::push_heap(heap.begin(), heap.end(), Better);
+					}else if(s > heap.front().score){
+						std::pop_heap(heap.begin(), heap.end(), Better);
+						heap.back() = Scored{base+j, s};
+						std::push_heap(heap.begin(), heap.end(), Better);
+					}
+				}
+			}
+			std::sort_heap(heap.begin(), heap.end(), Better);
+			return heap;
+		}
+	}
+
+	// the k best scored of n items, best first, ties to the lower index and NaN scores left
+	// out. Evaluator is any evaluator with EvalBatch
+	template<class Evaluator>
+	std::vector<topk::Scored> TopK(Evaluator const& evaluator, typename Evaluator::element_type const* items,
+			std::size_t n, std::size_t k){
+		return topk::Run(evaluator, items, n, k, topk::Unbounded());
+	}
+
+	template<class Evaluator>
+	std::vector<topk::Scored> TopK(Evaluator const& evaluator, typename Evaluator::element_type const* const* items,
+			std::size_t n, std::size_t k){
+		return topk::Run(evaluator, items, n, k, topk::Unbounded());
+	}
+
+	// bound(begin, end): an upper bound of the scores of items [begin, end), blocks of up to
+	// batch::kBlockSize items whose bound can't beat the k-th best so far are not scored.
+	// E.g. evaluator.Range(ranges).hi of VMEvaluator, ranges the min and max of each field
+	// over the block as kept by a columnar store
+	template<class Evaluator, class Bound>
+	std::vector<topk::Scored> TopK(Evaluator const& evaluator, typename Evaluator::element_type const* items,
+			std::size_t n, std::size_t k, Bound const& bound){
+		return topk::Run(evaluator, items, n, k, bound);
+	}
+
+	template<class Evaluator, class Bound>
+	std::vector<topk::Scored> TopK(Evaluator const& evaluator, typename Evaluator::element_type const* const* items,
+			std::size_t n, std::size_t k, Bound const& bound){
+		return topk::Run(evaluator, items, n, k, bound);
+	}
+}
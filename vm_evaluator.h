@@ -1,114 +1,472 @@
 #pragma once
 
-#include <boost/variant/apply_visitor.hpp> // apply_visitor
-
 #include <type_traits>
+#include <algorithm> // copy
+#include <cstring> // memcpy
 #include <exception>
 #include <iostream>
-#include "raw_ast.h"
+#include <memory> // unique_ptr, shared_ptr
+#include <vector>
+#include "flat_ast.h"
+#include "interval.h"
+#include "optimizer.h"
+#include "batch.h"
+#include "profile.h"
+#include "simd.h"
+#include "small_array.h"
+
+// direct threaded dispatch through gcc/clang labels-as-values, define EXPR_VM_THREADED=0
+// for the portable switch loop
+#ifndef EXPR_VM_THREADED
+#if defined(__GNUC__)
+#define EXPR_VM_THREADED 1
+#else
+#define EXPR_VM_THREADED 0
+#endif
+#endif
+
+// ops a verified program can't run into, the switch loops then skip their range check
+#if defined(__GNUC__)
+#define EXPR_VM_UNREACHABLE() __builtin_unreachable()
+#elif defined(_MSC_VER)
+#define EXPR_VM_UNREACHABLE() __assume(0)
+#else
+#define EXPR_VM_UNREACHABLE()
+#endif
 
 namespace expr{
 	namespace vm{
 
-		template<class Functor>
-		struct CodeSize
+		// stack slots each node needs: a binary node's rhs is computed above its lhs. Batch
+		// evaluation keeps a condition and both branches on the stack, as laid out by Compiler
+		inline std::vector<uint32_t> StackSizes(ast::Tree const& tree){
+			// children precede their parent, one forward pass sizes every node
+			std::vector<uint32_t> size(tree.Size(), 1);
+			for(uint32_t i=0; i<tree.Size(); ++i){
+				ast::Node const& n = tree[i];
+				if(n.kind == ast::node_neg || n.kind == ast::node_not){
+					size[i] = size[n.lhs];
+				}else if(n.kind == ast::node_select){
+					size[i] = std::max(std::max(size[n.lhs], 1 + size[n.rhs]), 2 + size[n.alt]);
+				}else if(n.kind == ast::node_binary && n.sign == '&'){
+					size[i] = std::max(std::max(size[n.lhs], 1 + size[n.rhs]), 3u);
+				}else if(n.kind == ast::node_binary && n.sign == '|'){
+					size[i] = std::max(size[n.lhs], 2 + size[n.rhs]);
+				}else if(n.kind == ast::node_binary){
+					size[i] = std::max(size[n.lhs], 1 + size[n.rhs]);
+				}else if(n.kind == ast::node_call){
+					// arguments are pushed left to right
+					const uint32_t arity = ast::Builtins(n.sign).arity;
+					size[i] = std::max(size[n.lhs], arity > 1 ? 1 + size[n.rhs] : 0);
+					size[i] = std::max(size[i], arity > 2 ? 2 + size[n.alt] : 0);
+				}
+			}
+			return size;
+		}
+
+		inline uint32_t StackSize(ast::Tree const& tree){
+			return tree.Size() ? StackSizes(tree)[tree.Root()] : 0;
+		}
+
+		enum ByteCode
 		{
-			typedef uint32_t result_type;
+			op_neg,     //  negate the top stack entry
+			op_add,     //  add top two stack entries
+			op_sub,     //  subtract top two stack entries
+			op_mul,     //  multiply top two stack entries
+			op_div,     //  divide top two stack entries
 
-			result_type operator()(ast::Nil) const { BOOST_ASSERT(0); return 0; }
+			op_int,     //  push constant integer into the stack
+			op_fn,	    //  call fn on user data, fn given as index into the vm's functor table
+			op_load_local,  //  push a local variable
+			op_store_local, //  copy the top stack entry into a local variable
+			op_ret,	    //  end of program, return the only stack entry
+			// ops are appended here, saved images depend on their values
+			op_out,	    //  pop the top stack entry into an output of a multi-output program
 
-			result_type operator()(float n) const { 
-				static_assert(sizeof(float)%sizeof(uint32_t)==0, "sizeof(float)%sizeof(uint32_t)==0");
-				// op_int + float
-				return 1+ sizeof(float)/sizeof(uint32_t); 
-			}
+			op_lt,	    //  compare top two stack entries, 1 if the comparison holds else 0
+			op_le,
+			op_gt,
+			op_ge,
+			op_eq,
+			op_ne,
+			op_not,     //  1 if the top stack entry is 0 else 0
+			// c ? a : b is laid out as `c op_branch a op_jump b op_select`, && and || as
+			// conditions choosing between the rhs and a constant. Jumps skip their operand
+			// count of words past the operand. Evaluating an item the jumps are taken and
+			// only one branch runs, a batch runs every op and blends both branches
+			op_branch,  //  jump if the top stack entry is 0, keeping it
+			op_jump,    //  jump
+			op_select,  //  item: drop the condition under the branch taken; batch: c ? a : b of the top three
+			// built-in functions in ast::Builtin order, of the top one, two or three stack entries
+			op_log,
+			op_exp,
+			op_sqrt,
+			op_abs,
+			op_sigmoid,
+			op_pow,
+			op_min,
+			op_max,
+			op_clamp,
+			op_fast_log,
+			op_fast_exp,
+			op_fast_sigmoid,
+			op_fast_pow
+		};
 
-			result_type operator()(ast::ScoreFn const& fn) const{
-				static_assert(sizeof(Functor)%sizeof(uint32_t)==0, "sizeof(Functor)%sizeof(uint32_t)==0");
-				// op_fn + fn
-				return 1 + sizeof(Functor)/sizeof(uint32_t); 
-			}
+		static_assert(op_fast_pow - op_log == ast::fn_fast_pow && op_fast_pow - op_log + 1 == ast::fn_count,
+			"one op per built-in function, in the same order");
+
+		inline ByteCode CallOp(char fn){
+			return ByteCode(op_log + fn);
+		}
+
+		inline char const* OpName(uint32_t op){
+			static char const* const names[] = {"neg", "add", "sub", "mul", "div", "int", "fn", "load_local",
+				"store_local", "ret", "out", "lt", "le", "gt", "ge", "eq", "ne", "not", "branch", "jump", "select",
+				"log", "exp", "sqrt", "abs", "sigmoid", "pow", "min", "max", "clamp",
+				"fast_log", "fast_exp", "fast_sigmoid", "fast_pow"};
+			static_assert(sizeof(names)/sizeof(names[0]) == op_fast_pow+1, "one name per ByteCode");
+			return op <= op_fast_pow ? names[op] : "invalid";
+		}
 
-			result_type operator()(ast::Operand const& op) const{
-				return boost::apply_visitor(*this,op);
+		// the node op computes from its operands, the top `operands` stack entries with the
+		// deepest as child 0 (lhs), then 1 (rhs) and 2 (alt). False for ops computing no node
+		inline bool OpNode(uint32_t op, ast::Node& node, uint32_t& operands){
+			static char const signs[] = "+-*/";
+			static char const comparisons[] = "<l>g=!";
+			node = ast::Node{ast::node_binary, 0, 0, 1, 0, 2};
+			operands = 2;
+			if(op == op_neg || op == op_not){
+				node.kind = op == op_neg ? ast::node_neg : ast::node_not;
+				node.sign = op == op_neg ? '-' : '!';
+				operands = 1;
+			}else if(op >= op_add && op <= op_div){
+				node.sign = signs[op - op_add];
+			}else if(op >= op_lt && op <= op_ne){
+				node.sign = comparisons[op - op_lt];
+			}else if(op == op_select){
+				node.kind = ast::node_select;
+				node.sign = '?';
+				operands = 3;
+			}else if(op >= op_log && op <= op_fast_pow){
+				node.kind = ast::node_call;
+				node.sign = char(op - op_log);
+				operands = ast::Builtins(node.sign).arity;
+				// arguments past the arity read the first, as in the tree
+				node.rhs = operands > 1 ? 1 : 0;
+				node.alt = operands > 2 ? 2 : 0;
+			}else{
+				return false;
 			}
+			return true;
+		}
 
-			result_type operator()(ast::Signed const& x) const{
-				return (*this)(x.operand) + (x.sign=='-'? 1 : 0);
+		// words following an op in the code
+		inline uint32_t OperandWords(uint32_t op){
+			switch (op)
+			{
+				case op_int: return sizeof(float)/sizeof(uint32_t);
+				case op_fn:
+				case op_load_local:
+				case op_store_local:
+				case op_out:
+				case op_branch:
+				case op_jump: return 1;
 			}
+			return 0;
+		}
 
-			result_type operator()(ast::Program const& x) const{
-				result_type size = (*this)(x.first);				
-				for(ast::Operation const& oper : x.rest){
-					size += (*this)(oper.operand) + 1;
+		template<class Functor, class Evalee>
+		class VirtualMachine{
+			public:
+				// stack slots kept on the native stack by Eval/EvalBatch, bigger programs fall back to heap
+				static const uint32_t kInlineStack = 32;
+				static const uint32_t kInlineBatchStack = 16;
+				// code words (twice over when threaded) and symbols, and functors, kept within the
+				// machine, so a short program is a single allocation with it
+				static const uint32_t kInlineWords = 64;
+				static const uint32_t kInlineFunctors = 8;
+
+				// symbols: grammar symbol position of each functor, what a saved program is bound by.
+				// outs: scores per item, all but the last written by op_out, the last returned by op_ret.
+				// The code is verified here, compiled, loaded or built by hand alike, so evaluation runs
+				// without any check: throws invalid_argument if it doesn't pass Verify
+				VirtualMachine(std::vector<uint32_t> const& code, std::vector<Functor> functors, std::vector<uint32_t> const& syms,
+					uint32_t vsize, uint32_t lsize, uint32_t outs=1): code_size(uint32_t(code.size())), stack_size(vsize),
+					local_size(lsize), outputs(outs), words(code.size()*(1+EXPR_VM_THREADED) + syms.size(), 0),
+					fns(std::make_move_iterator(functors.begin()), std::make_move_iterator(functors.end())){
+					if(syms.size() != fns.size()){
+						throw std::invalid_argument("vm symbol count differs from the functor count");
+					}
+					Verify(code.data(), code_size, uint32_t(fns.size()), stack_size, local_size, outputs);
+					std::copy(code.begin(), code.end(), words.begin());
+					std::copy(syms.begin(), syms.end(), words.end() - syms.size());
+#if EXPR_VM_THREADED
+					threaded(code, words.begin() + code_size);
+#endif
 				}
-				return size;
-			}
-		};
 
-		template<class Functor>
-		struct StackSize
-		{
-			typedef uint32_t result_type;
+#if EXPR_VM_THREADED
+				// handler label offsets from the op_neg handler, indexed by ByteCode
+				static int32_t const* Handlers(){
+					int32_t const* handlers = nullptr;
+					run(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, &handlers);
+					return handlers;
+				}
+#endif
 
-			result_type operator()(ast::Nil) const { BOOST_ASSERT(0); return 0; }
+				// appends the program as a relocatable record: stack size, local size, functor count,
+				// code size, the symbol position of each functor, then the code. No functor bytes are
+				// written, op_fn operands index the functor list. Single output programs only
+				void Save(std::vector<uint32_t>& out) const{
+					BOOST_ASSERT(outputs == 1);
+					out.push_back(stack_size);
+					out.push_back(local_size);
+					out.push_back(uint32_t(fns.size()));
+					out.push_back(code_size);
+					out.insert(out.end(), symbols(), symbols() + fns.size());
+					out.insert(out.end(), code(), code() + code_size);
+				}
 
-			result_type operator()(float n) const { 
-				static_assert(sizeof(float)%sizeof(uint32_t)==0, "sizeof(float)%sizeof(uint32_t)==0");
-				// op_int + float
-				return sizeof(float)/sizeof(uint32_t); 
-			}
+				// the program of a record written by Save, its functors taken from table. The record may
+				// come from a file, it is verified as any program: throws invalid_argument if an op,
+				// operand or stack depth is out of bounds, bad_any_cast if table holds another Functor type
+				static std::shared_ptr<VirtualMachine const> Load(uint32_t const* record, std::size_t words,
+						ast::SymbolTable const& table){
+					if(words < kRecordHeader){
+						throw std::invalid_argument("truncated vm record");
+					}
+					const uint32_t vsize = record[0], lsize = record[1], fn_count = record[2], code_size = record[3];
+					if(words - kRecordHeader < std::size_t(fn_count) + code_size){
+						throw std::invalid_argument("truncated vm record");
+					}
+					uint32_t const* syms = record + kRecordHeader;
+					uint32_t const* code = syms + fn_count;
+					std::vector<Functor> functors;
+					for(uint32_t i=0; i<fn_count; ++i){
+						if(syms[i] >= table.size()){
+							throw std::invalid_argument("vm record symbol out of the symbol table");
+						}
+						functors.push_back(boost::any_cast<Functor>(table[syms[i]]));
+					}
+					return std::make_shared<VirtualMachine const>(std::vector<uint32_t>(code, code+code_size),
+						std::move(functors), std::vector<uint32_t>(syms, syms+fn_count), vsize, lsize);
+				}
 
-			result_type operator()(ast::ScoreFn const& fn) const{
-				static_assert(sizeof(Functor)%sizeof(uint32_t)==0, "sizeof(Functor)%sizeof(uint32_t)==0");
-				// op_fn + fn -> float(fn)(user)
-				return sizeof(float)/sizeof(uint32_t); 
-			}
+				// proves once what evaluation then takes for granted: every op known, operands in range
+				// and the stack within [1, vsize] before op_ret, which ends the code with exactly one
+				// entry. op_out, of programs of outs > 1 scores, pops an entry into a row slot below
+				// outs-1. The stack is followed both as a batch runs every
+				// op and as an item takes the jumps: jumps go forward onto an op and every path reaching
+				// an op does so at the same depth. Each slot takes an op to fill, so sizes beyond the
+				// code size are rejected too
+				static void Verify(uint32_t const* code, uint32_t size, uint32_t fn_count, uint32_t vsize, uint32_t lsize, uint32_t outs=1){
+					if(vsize > size || lsize > size){
+						throw std::invalid_argument("invalid vm record size");
+					}
+					const uint32_t none = uint32_t(-1);
+					// item depth of the jumps to each op, none if no jump goes there
+					std::vector<uint32_t> arrive(size, none);
+					uint32_t pending = 0;
+					// batch and item depth, whether an item falls through to pc
+					uint32_t depth = 0, item = 0;
+					bool reached = true;
+					for(uint32_t pc=0; pc<size; ){
+						if(arrive[pc] != none){
+							if(reached && item != arrive[pc]){
+								throw std::invalid_argument("invalid ByteCode Eval");
+							}
+							item = arrive[pc];
+							reached = true;
+							--pending;
+						}
+						uint32_t op = code[pc++];
+						if(op > op_fast_pow || size-pc < OperandWords(op)){
+							throw std::invalid_argument("invalid ByteCode op");
+						}
+						bool valid = reached;
+						switch (op)
+						{
+							case op_neg:
+							case op_not:
+							case op_log:
+							case op_exp:
+							case op_sqrt:
+							case op_abs:
+							case op_sigmoid:
+							case op_fast_log:
+							case op_fast_exp:
+							case op_fast_sigmoid: valid = valid && item >= 1; break;
+							case op_pow:
+							case op_min:
+							case op_max:
+							case op_fast_pow:
+							case op_add:
+							case op_sub:
+							case op_mul:
+							case op_div:
+							case op_lt:
+							case op_le:
+							case op_gt:
+							case op_ge:
+							case op_eq:
+							case op_ne: valid = valid && item >= 2; --depth; --item; break;
+							case op_int: ++depth; ++item; break;
+							case op_fn: valid = valid && code[pc] < fn_count; ++depth; ++item; break;
+							case op_load_local: valid = valid && code[pc] < lsize; ++depth; ++item; break;
+							case op_store_local: valid = valid && item >= 1 && code[pc] < lsize; break;
+							case op_ret: valid = valid && depth == 1 && item == 1 && pc == size && !pending; break;
+							case op_out: valid = valid && item >= 1 && outs > 1 && code[pc] < outs-1; --depth; --item; break;
+							case op_branch:
+							case op_jump: {
+								valid = valid && item >= (op == op_branch) && code[pc] < size-pc-1;
+								if(!valid){
+									break;
+								}
+								uint32_t target = pc + 1 + code[pc];
+								if(arrive[target] == none){
+									arrive[target] = item;
+									++pending;
+								}
+								valid = arrive[target] == item;
+								reached = op == op_branch;
+								break;
+							}
+							case op_select: valid = valid && depth >= 3 && item >= 2; depth -= 2; --item; break;
+							case op_clamp: valid = valid && item >= 3; depth -= 2; item -= 2; break;
+						}
+						// a batch runs at least as deep as any item
+						if(!valid || item > depth || depth > vsize){
+							throw std::invalid_argument("invalid ByteCode Eval");
+						}
+						if(op == op_ret){
+							return;
+						}
+						pc += OperandWords(op);
+					}
+					throw std::invalid_argument("vm record without op_ret");
+				}
 
-			result_type operator()(ast::Operand const& op) const{
-				return boost::apply_visitor(*this,op);
-			}
+				// floats of scratch needed by Eval(item, scratch): stack followed by locals
+				uint32_t StackSize() const{ return stack_size + local_size; }
 
-			result_type operator()(ast::Signed const& x) const{
-				return (*this)(x.operand);
-			}
+				// the vm itself is never written while evaluating, so one instance
+				// can be shared by any number of threads
+				float Eval(Evalee const& item) const{
+					if(StackSize() <= kInlineStack){
+						float var_stack[kInlineStack];
+						return Eval(item, var_stack);
+					}
+					std::unique_ptr<float[]> var_stack(new float[StackSize()]);
+					return Eval(item, var_stack.get());
+				}
 
-			result_type operator()(ast::Program const& x) const{
-				result_type left_max = (*this)(x.first);				
-				for(ast::Operation const& oper : x.rest){
-					left_max = std::max(left_max, 1 + (*this)(oper.operand) );
+				// var_stack: caller owned scratch of at least StackSize() floats
+				float Eval(Evalee const& item, float* var_stack) const{
+					return exec(item, var_stack, nullptr);
 				}
-				return left_max;
-			}
-		};
 
-		enum ByteCode
-		{
-			op_neg,     //  negate the top stack entry
-			op_add,     //  add top two stack entries
-			op_sub,     //  subtract top two stack entries
-			op_mul,     //  multiply top two stack entries
-			op_div,     //  divide top two stack entries
+				// scores per item
+				uint32_t Outputs() const{ return outputs; }
 
-			//	op_load,    //  load a variable
-			//	op_store,   //  store a variable
-			op_int,     //  push constant integer into the stack
-			//	op_stk_adj, //  adjust the stack for local variables
-			op_fn	    //  call fn on user data
-		};
+#if EXPR_PROFILE
+				// counts this program's evaluations under text, see profile.h
+				void Profile(std::string const& text){
+					site = profile::Register(text, "vm", opNames());
+				}
+#endif
 
-		template<class Functor, class Evalee>
-		class VirtualMachine{
-			public:	
-				VirtualMachine(uint32_t* code, uint32_t csize, uint32_t vsize): code_stack(code), 
-					code_size(csize), var_stack(new float[vsize]){}
+				// row: Outputs() floats receiving every score of item
+				void EvalRow(Evalee const& item, float* row) const{
+					if(StackSize() <= kInlineStack){
+						float var_stack[kInlineStack];
+						EvalRow(item, row, var_stack);
+						return;
+					}
+					std::unique_ptr<float[]> var_stack(new float[StackSize()]);
+					EvalRow(item, row, var_stack.get());
+				}
 
-				float Eval(Evalee const& item) const{
-					uint32_t* pc = code_stack;
+				void EvalRow(Evalee const& item, float* row, float* var_stack) const{
+					row[outputs-1] = exec(item, var_stack, row);
+				}
+
+				// bounds of the score over all items whose symbols lie in ranges, indexed by grammar
+				// symbol position. The code itself is run on intervals, so whatever the compiler
+				// folded or shared is bounded exactly as it is evaluated, each op as ast::NodeRange
+				// bounds its node. The last output's for multi-output programs
+				Interval Range(Interval const* ranges, std::size_t count) const{
+					static const std::vector<Interval> no_symbols;
+					Interval inline_stack[kInlineStack];
+					std::unique_ptr<Interval[]> heap_stack(StackSize() > kInlineStack ? new Interval[StackSize()] : nullptr);
+					Interval* stack_ptr = heap_stack ? heap_stack.get() : inline_stack;
+					Interval* locals = stack_ptr + stack_size;
+					for(uint32_t const* pc = code(); ; ){
+						const uint32_t op = *pc++;
+						ast::Node node;
+						uint32_t operands;
+						if(OpNode(op, node, operands)){
+							stack_ptr -= operands;
+							*stack_ptr = ast::NodeRange(node, stack_ptr, no_symbols);
+							++stack_ptr;
+							continue;
+						}
+						switch (op)
+						{
+							case op_int:
+								*stack_ptr++ = Interval::Point(*(float const*)(pc));
+								pc += sizeof(float)/sizeof(uint32_t);
+								break;
+							case op_fn:
+								if(symbols()[*pc] >= count){
+									throw std::invalid_argument("no range for a symbol of the program");
+								}
+								*stack_ptr++ = ranges[symbols()[*pc++]];
+								break;
+							case op_load_local: *stack_ptr++ = locals[*pc++]; break;
+							case op_store_local: locals[*pc++] = stack_ptr[-1]; break;
+							case op_out: --stack_ptr; ++pc; break;
+							// both branches are bounded, as in a batch, and op_select bounds the blend
+							case op_branch:
+							case op_jump: ++pc; break;
+							case op_ret: return stack_ptr[-1];
+							default:
+								throw std::invalid_argument("invalid ByteCode op");
+						}
+					}
+				}
+
+
+				// each stack slot is a column of batch::kBlockSize floats, so every op is
+				// dispatched once per block instead of once per item. Multi-output programs
+				// write n rows of Outputs() floats
+				void EvalBatch(Evalee const* items, std::size_t n, float* out) const{
+					evalBatch(items, n, out);
+				}
+
+				void EvalBatch(Evalee const* const* items, std::size_t n, float* out) const{
+					evalBatch(items, n, out);
+				}
+
+			private:
+				// words of Save's record before the symbols
+				static const uint32_t kRecordHeader = 4;
+
+				// row: where op_out stores, unused by single output programs
+				float exec(Evalee const& item, float* var_stack, float* row) const{
+					// profiled builds run the switch loop, rdtsc around every op costs far more than the dispatch
+#if EXPR_VM_THREADED && !EXPR_PROFILE
+					return run(code() + code_size, fns.data(), &item, var_stack, var_stack+stack_size, row);
+#else
+					uint32_t const* pc = code();
 					float* stack_ptr = var_stack;
-					const uint32_t * end_pc = code_stack + code_size;
-					while (pc < end_pc)
+					float* locals = var_stack + stack_size;
+					EXPR_PROFILE_PROBE(probe, site, 1, op_fn);
+					// verified: op_ret terminates every program with one entry left, no check needed
+					for (;;)
 					{
+						EXPR_PROFILE_OP(probe, *pc, 1);
 						switch (*pc++)
 						{
 							case op_neg:
@@ -136,178 +494,874 @@ namespace expr{
 								break;
 
 							case op_int:
-								*stack_ptr++ = *(float*)(pc);
+								*stack_ptr++ = *(float const*)(pc);
 								pc += sizeof(float)/sizeof(uint32_t);
 								break;
 
 							case op_fn:
-								*stack_ptr++ = expr::ast::EvalFn(*(Functor*)(pc), const_cast<Evalee *>(&item));
-								pc += sizeof(Functor)/sizeof(uint32_t);
+								*stack_ptr++ = expr::ast::EvalFn(fns[*pc++], const_cast<Evalee *>(&item));
+								break;
+
+							case op_load_local:
+								*stack_ptr++ = locals[*pc++];
+								break;
+
+							case op_store_local:
+								locals[*pc++] = stack_ptr[-1];
+								break;
+
+							case op_ret:
+								return *var_stack;
+
+							case op_out:
+								row[*pc++] = *--stack_ptr;
+								break;
+
+							case op_lt:
+								--stack_ptr;
+								stack_ptr[-1] = stack_ptr[-1] < stack_ptr[0];
+								break;
+
+							case op_le:
+								--stack_ptr;
+								stack_ptr[-1] = stack_ptr[-1] <= stack_ptr[0];
+								break;
+
+							case op_gt:
+								--stack_ptr;
+								stack_ptr[-1] = stack_ptr[-1] > stack_ptr[0];
+								break;
+
+							case op_ge:
+								--stack_ptr;
+								stack_ptr[-1] = stack_ptr[-1] >= stack_ptr[0];
+								break;
+
+							case op_eq:
+								--stack_ptr;
+								stack_ptr[-1] = stack_ptr[-1] == stack_ptr[0];
+								break;
+
+							case op_ne:
+								--stack_ptr;
+								stack_ptr[-1] = stack_ptr[-1] != stack_ptr[0];
+								break;
+
+							case op_not:
+								stack_ptr[-1] = stack_ptr[-1] == 0;
+								break;
+
+							case op_branch:
+								pc += stack_ptr[-1] == 0 ? 1 + *pc : 1;
+								break;
+
+							case op_jump:
+								pc += 1 + *pc;
+								break;
+
+							case op_select:
+								--stack_ptr;
+								stack_ptr[-1] = stack_ptr[0];
+								break;
+
+							case op_log:
+								stack_ptr[-1] = simd::Log::Apply(stack_ptr[-1]);
+								break;
+
+							case op_exp:
+								stack_ptr[-1] = simd::Exp::Apply(stack_ptr[-1]);
+								break;
+
+							case op_sqrt:
+								stack_ptr[-1] = simd::Sqrt::Apply(stack_ptr[-1]);
+								break;
+
+							case op_abs:
+								stack_ptr[-1] = simd::Abs::Apply(stack_ptr[-1]);
+								break;
+
+							case op_sigmoid:
+								stack_ptr[-1] = simd::Sigmoid::Apply(stack_ptr[-1]);
 								break;
+
+							case op_pow:
+								--stack_ptr;
+								stack_ptr[-1] = simd::Pow::Apply(stack_ptr[-1], stack_ptr[0]);
+								break;
+
+							case op_min:
+								--stack_ptr;
+								stack_ptr[-1] = simd::Min::Apply(stack_ptr[-1], stack_ptr[0]);
+								break;
+
+							case op_max:
+								--stack_ptr;
+								stack_ptr[-1] = simd::Max::Apply(stack_ptr[-1], stack_ptr[0]);
+								break;
+
+							case op_clamp:
+								stack_ptr -= 2;
+								stack_ptr[-1] = simd::Min::Apply(simd::Max::Apply(stack_ptr[-1], stack_ptr[0]), stack_ptr[1]);
+								break;
+
+							case op_fast_log:
+								stack_ptr[-1] = simd::FastLog::Apply(stack_ptr[-1]);
+								break;
+
+							case op_fast_exp:
+								stack_ptr[-1] = simd::FastExp::Apply(stack_ptr[-1]);
+								break;
+
+							case op_fast_sigmoid:
+								stack_ptr[-1] = simd::FastSigmoid::Apply(stack_ptr[-1]);
+								break;
+
+							case op_fast_pow:
+								--stack_ptr;
+								stack_ptr[-1] = simd::FastPow::Apply(stack_ptr[-1], stack_ptr[0]);
+								break;
+
 							default:
-								throw std::invalid_argument("invalid ByteCode op");
+								EXPR_VM_UNREACHABLE();
 						}
 					}
+#endif
+				}
 
-					if(stack_ptr-1 != var_stack){
-						throw std::invalid_argument("invalid ByteCode Eval");					
+#if EXPR_VM_THREADED
+				// code into out, with every op replaced by its Handlers() offset
+				static void threaded(std::vector<uint32_t> const& code, uint32_t* out){
+					int32_t const* handlers = Handlers();
+					std::copy(code.begin(), code.end(), out);
+					for(std::size_t pc=0; pc<code.size(); pc+=1+OperandWords(code[pc])){
+						out[pc] = uint32_t(handlers[code[pc]]);
 					}
-					return *var_stack; 
 				}
-	
 
-				~VirtualMachine() {
-					uint32_t* pc = code_stack;
-					const uint32_t * end_pc = code_stack + code_size;
-					while (pc < end_pc)
-					{
-						switch (*pc++)
+				// handlers: when set, only fetches the handler offset table
+				static float run(uint32_t const* pc, Functor const* fns, Evalee const* item, float* var_stack, float* locals,
+					float* row, int32_t const** handlers = nullptr){
+					static const int32_t offsets[] = {
+						int32_t(static_cast<char*>(&&l_neg) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_add) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_sub) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_mul) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_div) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_int) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_fn) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_load_local) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_store_local) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_ret) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_out) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_lt) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_le) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_gt) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_ge) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_eq) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_ne) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_not) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_branch) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_jump) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_select) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_log) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_exp) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_sqrt) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_abs) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_sigmoid) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_pow) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_min) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_max) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_clamp) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_fast_log) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_fast_exp) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_fast_sigmoid) - static_cast<char*>(&&l_neg)),
+						int32_t(static_cast<char*>(&&l_fast_pow) - static_cast<char*>(&&l_neg))
+					};
+					static_assert(sizeof(offsets)/sizeof(offsets[0]) == op_fast_pow+1, "one handler per ByteCode");
+					if(handlers){
+						*handlers = offsets;
+						return 0;
+					}
+
+					float* stack_ptr = var_stack;
+#define EXPR_VM_DISPATCH() goto *(static_cast<char*>(&&l_neg) + int32_t(*pc++))
+					EXPR_VM_DISPATCH();
+
+				l_neg:
+					stack_ptr[-1] = -stack_ptr[-1];
+					EXPR_VM_DISPATCH();
+
+				l_add:
+					--stack_ptr;
+					stack_ptr[-1] += stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_sub:
+					--stack_ptr;
+					stack_ptr[-1] -= stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_mul:
+					--stack_ptr;
+					stack_ptr[-1] *= stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_div:
+					--stack_ptr;
+					stack_ptr[-1] /= stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_int:
+					*stack_ptr++ = *(float const*)(pc);
+					pc += sizeof(float)/sizeof(uint32_t);
+					EXPR_VM_DISPATCH();
+
+				l_fn:
+					*stack_ptr++ = expr::ast::EvalFn(fns[*pc++], const_cast<Evalee *>(item));
+					EXPR_VM_DISPATCH();
+
+				l_load_local:
+					*stack_ptr++ = locals[*pc++];
+					EXPR_VM_DISPATCH();
+
+				l_store_local:
+					locals[*pc++] = stack_ptr[-1];
+					EXPR_VM_DISPATCH();
+
+				l_ret:
+					return stack_ptr[-1];
+
+				l_out:
+					row[*pc++] = *--stack_ptr;
+					EXPR_VM_DISPATCH();
+
+				l_lt:
+					--stack_ptr;
+					stack_ptr[-1] = stack_ptr[-1] < stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_le:
+					--stack_ptr;
+					stack_ptr[-1] = stack_ptr[-1] <= stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_gt:
+					--stack_ptr;
+					stack_ptr[-1] = stack_ptr[-1] > stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_ge:
+					--stack_ptr;
+					stack_ptr[-1] = stack_ptr[-1] >= stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_eq:
+					--stack_ptr;
+					stack_ptr[-1] = stack_ptr[-1] == stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_ne:
+					--stack_ptr;
+					stack_ptr[-1] = stack_ptr[-1] != stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_not:
+					stack_ptr[-1] = stack_ptr[-1] == 0;
+					EXPR_VM_DISPATCH();
+
+				l_branch:
+					pc += stack_ptr[-1] == 0 ? 1 + *pc : 1;
+					EXPR_VM_DISPATCH();
+
+				l_jump:
+					pc += 1 + *pc;
+					EXPR_VM_DISPATCH();
+
+				l_select:
+					--stack_ptr;
+					stack_ptr[-1] = stack_ptr[0];
+					EXPR_VM_DISPATCH();
+
+				l_log:
+					stack_ptr[-1] = simd::Log::Apply(stack_ptr[-1]);
+					EXPR_VM_DISPATCH();
+
+				l_exp:
+					stack_ptr[-1] = simd::Exp::Apply(stack_ptr[-1]);
+					EXPR_VM_DISPATCH();
+
+				l_sqrt:
+					stack_ptr[-1] = simd::Sqrt::Apply(stack_ptr[-1]);
+					EXPR_VM_DISPATCH();
+
+				l_abs:
+					stack_ptr[-1] = simd::Abs::Apply(stack_ptr[-1]);
+					EXPR_VM_DISPATCH();
+
+				l_sigmoid:
+					stack_ptr[-1] = simd::Sigmoid::Apply(stack_ptr[-1]);
+					EXPR_VM_DISPATCH();
+
+				l_pow:
+					--stack_ptr;
+					stack_ptr[-1] = simd::Pow::Apply(stack_ptr[-1], stack_ptr[0]);
+					EXPR_VM_DISPATCH();
+
+				l_min:
+					--stack_ptr;
+					stack_ptr[-1] = simd::Min::Apply(stack_ptr[-1], stack_ptr[0]);
+					EXPR_VM_DISPATCH();
+
+				l_max:
+					--stack_ptr;
+					stack_ptr[-1] = simd::Max::Apply(stack_ptr[-1], stack_ptr[0]);
+					EXPR_VM_DISPATCH();
+
+				l_clamp:
+					stack_ptr -= 2;
+					stack_ptr[-1] = simd::Min::Apply(simd::Max::Apply(stack_ptr[-1], stack_ptr[0]), stack_ptr[1]);
+					EXPR_VM_DISPATCH();
+
+				l_fast_log:
+					stack_ptr[-1] = simd::FastLog::Apply(stack_ptr[-1]);
+					EXPR_VM_DISPATCH();
+
+				l_fast_exp:
+					stack_ptr[-1] = simd::FastExp::Apply(stack_ptr[-1]);
+					EXPR_VM_DISPATCH();
+
+				l_fast_sigmoid:
+					stack_ptr[-1] = simd::FastSigmoid::Apply(stack_ptr[-1]);
+					EXPR_VM_DISPATCH();
+
+				l_fast_pow:
+					--stack_ptr;
+					stack_ptr[-1] = simd::FastPow::Apply(stack_ptr[-1], stack_ptr[0]);
+					EXPR_VM_DISPATCH();
+#undef EXPR_VM_DISPATCH
+				}
+#endif
+
+				template<class Items>
+				void evalBatch(Items items, std::size_t n, float* out) const{
+					if(StackSize() <= kInlineBatchStack){
+						float batch_stack[kInlineBatchStack*batch::kBlockSize];
+						evalBatch(items, n, out, batch_stack);
+					}else{
+						std::unique_ptr<float[]> batch_stack(new float[StackSize()*batch::kBlockSize]);
+						evalBatch(items, n, out, batch_stack.get());
+					}
+				}
+
+				template<class Items>
+				void evalBatch(Items items, std::size_t n, float* out, float* batch_stack) const{
+					const std::size_t B = batch::kBlockSize;
+					float* locals = batch_stack + stack_size*B;
+					EXPR_PROFILE_PROBE(probe, site, n, op_fn);
+					for(std::size_t base=0; base<n; base+=B){
+						const std::size_t m = batch::BlockLen(base, n);
+						uint32_t const* pc = code();
+						float* stack_ptr = batch_stack;
+						for (bool running=true; running;)
 						{
-							case op_neg:
-							case op_add:
-							case op_sub:
-							case op_mul:
-							case op_div:
-								break;
-							case op_int:
-								pc += sizeof(float)/sizeof(uint32_t);
-								break;
-							case op_fn:
-								destruct((Functor*)(pc));
-								pc += sizeof(Functor)/sizeof(uint32_t);
-								break;
+							EXPR_PROFILE_OP(probe, *pc, m);
+							switch (*pc++)
+							{
+								case op_neg:
+									simd::Neg(stack_ptr-B, m);
+									break;
+
+								case op_add:
+									stack_ptr -= B;
+									simd::Binary<simd::Add>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_sub:
+									stack_ptr -= B;
+									simd::Binary<simd::Sub>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_mul:
+									stack_ptr -= B;
+									simd::Binary<simd::Mul>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_div:
+									stack_ptr -= B;
+									simd::Binary<simd::Div>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_int:
+									simd::Fill(stack_ptr, *(float const*)(pc), m);
+									stack_ptr += B;
+									pc += sizeof(float)/sizeof(uint32_t);
+									break;
+
+								case op_fn:
+									loadColumn(fns[*pc++], items, base, m, stack_ptr);
+									stack_ptr += B;
+									break;
+
+								case op_load_local:
+									std::copy(locals + *pc*B, locals + *pc*B + m, stack_ptr);
+									stack_ptr += B;
+									++pc;
+									break;
+
+								case op_store_local:
+									std::copy(stack_ptr-B, stack_ptr-B+m, locals + *pc*B);
+									++pc;
+									break;
+
+								case op_ret:
+									running = false;
+									break;
+
+								case op_out:
+									stack_ptr -= B;
+									for(std::size_t j=0; j<m; ++j){
+										out[(base+j)*outputs + *pc] = stack_ptr[j];
+									}
+									++pc;
+									break;
+
+								case op_lt:
+									stack_ptr -= B;
+									simd::Binary<simd::Less>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_le:
+									stack_ptr -= B;
+									simd::Binary<simd::LessEqual>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_gt:
+									stack_ptr -= B;
+									simd::Binary<simd::Greater>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_ge:
+									stack_ptr -= B;
+									simd::Binary<simd::GreaterEqual>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_eq:
+									stack_ptr -= B;
+									simd::Binary<simd::Equal>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_ne:
+									stack_ptr -= B;
+									simd::Binary<simd::NotEqual>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_not:
+									simd::Not(stack_ptr-B, m);
+									break;
+
+								// items of a block may go either way, both branches are computed
+								case op_branch:
+								case op_jump:
+									++pc;
+									break;
+
+								case op_select:
+									stack_ptr -= 2*B;
+									simd::Select(stack_ptr-B, stack_ptr, stack_ptr+B, m);
+									break;
+
+								// the standard library's log, exp, sigmoid and pow one item at a time, their
+								// approximations and everything else in vector kernels
+								case op_log:
+									simd::Serial<simd::Log>(stack_ptr-B, m);
+									break;
+
+								case op_exp:
+									simd::Serial<simd::Exp>(stack_ptr-B, m);
+									break;
+
+								case op_sqrt:
+									simd::Unary<simd::Sqrt>(stack_ptr-B, m);
+									break;
+
+								case op_abs:
+									simd::Unary<simd::Abs>(stack_ptr-B, m);
+									break;
+
+								case op_sigmoid:
+									simd::Serial<simd::Sigmoid>(stack_ptr-B, m);
+									break;
+
+								case op_pow:
+									stack_ptr -= B;
+									simd::Serial<simd::Pow>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_min:
+									stack_ptr -= B;
+									simd::Binary<simd::Min>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_max:
+									stack_ptr -= B;
+									simd::Binary<simd::Max>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								case op_clamp:
+									stack_ptr -= 2*B;
+									simd::Binary<simd::Max>(stack_ptr-B, stack_ptr, m);
+									simd::Binary<simd::Min>(stack_ptr-B, stack_ptr+B, m);
+									break;
+
+								case op_fast_log:
+									simd::Unary<simd::FastLog>(stack_ptr-B, m);
+									break;
+
+								case op_fast_exp:
+									simd::Unary<simd::FastExp>(stack_ptr-B, m);
+									break;
+
+								case op_fast_sigmoid:
+									simd::Unary<simd::FastSigmoid>(stack_ptr-B, m);
+									break;
+
+								case op_fast_pow:
+									stack_ptr -= B;
+									simd::Binary<simd::FastPow>(stack_ptr-B, stack_ptr, m);
+									break;
+
+								default:
+									EXPR_VM_UNREACHABLE();
+							}
+						}
+
+						if(outputs == 1){
+							std::copy(batch_stack, batch_stack+m, out+base);
+						}else{
+							for(std::size_t j=0; j<m; ++j){
+								out[(base+j)*outputs + outputs-1] = batch_stack[j];
+							}
 						}
 					}
-					delete [] code_stack;
-					delete [] var_stack;
 				}
 
-			private:
-				template<class T>
-				auto destruct(T* p)
-				-> typename std::enable_if<std::is_trivial<T>::value>::type{
+				// float members of a contiguous item array are gathered with a fixed stride
+				template<class F>
+				static auto loadColumn(F const& fn, Evalee const* items, std::size_t base, std::size_t m, float* col)
+				-> typename std::enable_if<ast::IsFloatMember<F>::value>::type{
+					simd::Gather(col, reinterpret_cast<char const*>(&(items[base].*fn)), sizeof(Evalee), m);
 				}
 
-				template<class T>
-				auto destruct(T* p)
-				-> typename std::enable_if<!std::is_trivial<T>::value && std::is_copy_constructible<T>::value>::type{
-					p -> ~T();	
+				template<class F, class Items>
+				static auto loadColumn(F const& fn, Items items, std::size_t base, std::size_t m, float* col)
+				-> typename std::enable_if<!ast::IsFloatMember<F>::value || !std::is_same<Items, Evalee const*>::value>::type{
+					for(std::size_t i=0; i<m; ++i){
+						col[i] = expr::ast::EvalFn(fn, const_cast<Evalee *>(&batch::At(items, base+i)));
+					}
 				}
 
+				uint32_t const* code() const{ return words.data(); }
+				// the grammar symbol position of each functor
+				uint32_t const* symbols() const{ return words.end() - fns.size(); }
+
 			private:
-				uint32_t* code_stack;
 				uint32_t  code_size;
-				float* 	  var_stack;
+				uint32_t  stack_size;
+				uint32_t  local_size;
+				uint32_t  outputs;
+				// the code, its threaded copy when EXPR_VM_THREADED, then the symbols
+				SmallArray<uint32_t, kInlineWords> words;
+				// one functor per distinct symbol of the program
+				SmallArray<Functor, kInlineFunctors> fns;
+#if EXPR_PROFILE
+				static std::vector<std::string> opNames(){
+					std::vector<std::string> names;
+					for(uint32_t op=0; op<=op_fast_pow; ++op){
+						names.push_back(OpName(op));
+					}
+					return names;
+				}
+
+				// programs without a source, e.g. loaded from an image, are counted together
+				uint32_t site = profile::Register("", "vm", opNames());
+#endif
 		};
 
+		// Subexpressions occurring more than once, symbol loads included, are computed on
+		// first use, kept in a local and loaded from there afterwards, so every symbol
+		// functor is called at most once per item.
 		template<class Functor, class Evalee>
-		struct Compiler 
+		struct Compiler
 		{
-			typedef VirtualMachine<Functor, Evalee>* result_type;
+			typedef std::shared_ptr<VirtualMachine<Functor, Evalee>> result_type;
 
-			result_type operator()(ast::Nil) { BOOST_ASSERT(0); return nullptr; }
-
-			result_type operator()(float n) { 
-				code_stack[pc++] = ByteCode::op_int;
-				*(float*)(code_stack+pc) = n ;
-				pc += sizeof(float)/sizeof(uint32_t);
-				return nullptr;
+			result_type Compile(ast::Tree const& tree){
+				source = tree.Source();
+				numbering.Number(tree);
+				stack_size = StackSize(tree);
+				compile(tree, tree.Root());
+				emit(ByteCode::op_ret);
+				return vm();
 			}
 
-			result_type operator()(ast::ScoreFn const& fn) {
-				Functor f = boost::any_cast<Functor>(fn);
-				code_stack[pc++] = ByteCode::op_fn;
-				assign((Functor*)(code_stack+pc), f);
-				pc += sizeof(Functor)/sizeof(uint32_t);
-				return nullptr;
+			// one program scoring every root of tree, numbered together so symbol loads and
+			// subexpressions are shared across them. Each score but the last is popped into
+			// its output once computed, the stack is empty again when the next one starts
+			result_type Compile(ast::Tree const& tree, std::vector<uint32_t> const& roots){
+				BOOST_ASSERT(!roots.empty());
+				source = tree.Source();
+				numbering.Number(tree, roots);
+				std::vector<uint32_t> sizes = StackSizes(tree);
+				for(std::size_t k=0; k<roots.size(); ++k){
+					stack_size = std::max(stack_size, sizes[roots[k]]);
+					compile(tree, roots[k]);
+					if(k+1 < roots.size()){
+						emit(ByteCode::op_out);
+						emitOperand(uint32_t(k));
+					}
+				}
+				emit(ByteCode::op_ret);
+				outputs = uint32_t(roots.size());
+				return vm();
 			}
 
-			result_type operator()(ast::Operand const& op) {
-				return boost::apply_visitor(*this,op);
-				return nullptr;
-			}
+			private:
+				void compile(ast::Tree const& tree, uint32_t i){
+					ast::Node const& n = tree[i];
+					if(n.kind == ast::node_const){
+						constant(n.value);
+						return;
+					}
+					uint32_t vn = numbering.Of(i);
+					if(load(vn)){
+						return;
+					}
+					switch (n.kind)
+					{
+						case ast::node_symbol:
+							emit(ByteCode::op_fn);
+							emitOperand(functor(tree, n.lhs));
+							break;
+						case ast::node_neg:
+							compile(tree, n.lhs);
+							emit(ByteCode::op_neg);
+							break;
+						case ast::node_not:
+							compile(tree, n.lhs);
+							emit(ByteCode::op_not);
+							break;
+						case ast::node_select:
+							compile(tree, n.lhs);
+							branches([&]{ compile(tree, n.rhs); }, [&]{ compile(tree, n.alt); });
+							break;
+						case ast::node_call: {
+							const uint32_t arity = ast::Builtins(n.sign).arity;
+							compile(tree, n.lhs);
+							if(arity > 1){
+								compile(tree, n.rhs);
+							}
+							if(arity > 2){
+								compile(tree, n.alt);
+							}
+							emit(CallOp(n.sign));
+							break;
+						}
+						// a && b as a ? !!b : 0, a || b as a ? 1 : !!b
+						case ast::node_binary:
+							compile(tree, n.lhs);
+							if(n.sign == '&'){
+								branches([&]{ test(tree, n.rhs); }, [&]{ constant(0); });
+								break;
+							}
+							if(n.sign == '|'){
+								branches([&]{ constant(1); }, [&]{ test(tree, n.rhs); });
+								break;
+							}
+							compile(tree, n.rhs);
+							switch (n.sign)
+							{
+								case '+': emit(ByteCode::op_add); break;
+								case '-': emit(ByteCode::op_sub); break;
+								case '*': emit(ByteCode::op_mul); break;
+								case '/': emit(ByteCode::op_div); break;
+								case '<': emit(ByteCode::op_lt); break;
+								case 'l': emit(ByteCode::op_le); break;
+								case '>': emit(ByteCode::op_gt); break;
+								case 'g': emit(ByteCode::op_ge); break;
+								case '=': emit(ByteCode::op_eq); break;
+								case '!': emit(ByteCode::op_ne); break;
+							}
+							break;
+						default:
+							break;
+					}
+					store(vn);
+				}
 
-			result_type operator()(ast::Signed const& x) {
-				(*this)(x.operand);
-				if(x.sign=='-'){
-					code_stack[pc++] = ByteCode::op_neg;
+				void constant(float v){
+					uint32_t bits;
+					std::memcpy(&bits, &v, sizeof(bits));
+					emit(ByteCode::op_int);
+					emitOperand(bits);
 				}
-				return nullptr;
-			}
 
-			result_type operator()(ast::Program const& x) {
-				bool outer_prog = false;
-				if(code_stack == nullptr){
-					code_capacity = CodeSize<Functor>()(x);
-					code_stack = new uint32_t[code_capacity];
-					stack_size = StackSize<Functor>()(x);
-					outer_prog = true;
+				// node i != 0, comparisons and logical operators are 1 or 0 already
+				void test(ast::Tree const& tree, uint32_t i){
+					compile(tree, i);
+					ast::Node const& n = tree[i];
+					if(n.kind != ast::node_not && !(n.kind == ast::node_binary && ast::IsBoolean(n.sign))){
+						emit(ByteCode::op_not);
+						emit(ByteCode::op_not);
+					}
 				}
 
-				(*this)(x.first);				
-				for(ast::Operation const& oper : x.rest){
-					(*this)(oper.operand);
-					switch (oper.sign)
-					{
-						case '+': code_stack[pc++] = ByteCode::op_add; break;
-						case '-': code_stack[pc++] = ByteCode::op_sub; break;
-						case '*': code_stack[pc++] = ByteCode::op_mul; break;
-						case '/': code_stack[pc++] = ByteCode::op_div; break;
+				// the condition on the stack chooses then or other. A value kept in a local within
+				// a branch isn't there when the other branch runs instead, so locals stored by a
+				// branch are forgotten once it is laid out
+				template<class Then, class Other>
+				void branches(Then then, Other other){
+					uint32_t skip_then = jump(ByteCode::op_branch);
+					std::vector<uint32_t> known = locals;
+					then();
+					locals = known;
+					uint32_t skip_other = jump(ByteCode::op_jump);
+					land(skip_then);
+					other();
+					locals = known;
+					land(skip_other);
+					emit(ByteCode::op_select);
+				}
+
+				// position of the jump's operand, set by land
+				uint32_t jump(ByteCode op){
+					emit(op);
+					emitOperand(0);
+					return uint32_t(code_stack.size()-1);
+				}
+
+				// the jump with operand at lands on the next op emitted
+				void land(uint32_t at){
+					code_stack[at] = uint32_t(code_stack.size()) - (at+1);
+				}
+
+				void emit(ByteCode op){
+					code_stack.push_back(op);
+				}
+
+				void emitOperand(uint32_t word){
+					code_stack.push_back(word);
+				}
+
+				// index of the symbol's functor in the vm's table
+				uint32_t functor(ast::Tree const& tree, uint32_t symbol){
+					if(symbol >= symbol2fn.size()){
+						symbol2fn.resize(symbol+1, uint32_t(-1));
 					}
+					if(symbol2fn[symbol] == uint32_t(-1)){
+						symbol2fn[symbol] = uint32_t(fns.size());
+						fns.push_back(tree.Fn<Functor>(symbol));
+						symbols.push_back(symbol);
+					}
+					return symbol2fn[symbol];
 				}
-				return outer_prog ? vm() : nullptr;
-			}
 
-			private:
-				template<class T>
-				auto assign(T* dest, T const& v)
-				-> typename std::enable_if<std::is_trivial<T>::value>::type{
-					*dest = v;	
+				bool cached(uint32_t vn) const{
+					return vn < locals.size() && locals[vn] != uint32_t(-1);
 				}
 
-				template<class T>
-				auto assign(T* dest, T const& v)
-				-> typename std::enable_if<!std::is_trivial<T>::value && std::is_copy_constructible<T>::value>::type{
-					new (dest) T(v);	
+				bool load(uint32_t vn){
+					if(!cached(vn)){
+						return false;
+					}
+					emit(ByteCode::op_load_local);
+					emitOperand(locals[vn]);
+					return true;
 				}
 
-				result_type  vm() {
-					if(pc != code_capacity){
-						throw std::invalid_argument("wrong stack size calculation");
+				// keep the top of stack for later occurrences, constants are cheaper to push again
+				void store(uint32_t vn){
+					if(numbering.Count(vn) < 2 || numbering.IsConstant(vn) || cached(vn)){
+						return;
 					}
-					auto vm = new VirtualMachine<Functor, Evalee>{code_stack, code_capacity, stack_size};
-					code_stack = nullptr;
-					code_capacity = 0;
-					stack_size = 0;
-					pc = 0;
-					return vm;
+					if(vn >= locals.size()){
+						locals.resize(vn+1, uint32_t(-1));
+					}
+					locals[vn] = local_size++;
+					emit(ByteCode::op_store_local);
+					emitOperand(locals[vn]);
+				}
+
+				result_type  vm() {
+					result_type machine = std::make_shared<VirtualMachine<Functor, Evalee>>(code_stack, std::move(fns), symbols,
+						stack_size, local_size, outputs);
+#if EXPR_PROFILE
+					machine->Profile(source);
+#endif
+					return machine;
 				}
 
 			private:
-				uint32_t* code_stack = nullptr;
-				uint32_t  code_capacity = 0;
-				uint32_t  pc = 0;
+				std::vector<uint32_t> code_stack;
+				std::vector<Functor> fns;
+				// functor table index -> grammar symbol index, and back
+				std::vector<uint32_t> symbols;
+				std::vector<uint32_t> symbol2fn;
+				ast::ValueNumbering numbering;
+				// value number -> local slot
+				std::vector<uint32_t> locals;
+				uint32_t  local_size = 0;
 				uint32_t  stack_size = 0;
+				uint32_t  outputs = 1;
+				std::string source;
 		};
 	}
 
 	template<class Functor, class Evalee>
 	class VMEvaluator{
 		public:
-			static_assert(std::is_trivial<Functor>::value || std::is_copy_constructible<Functor>::value, 
+			static_assert(std::is_trivial<Functor>::value || std::is_copy_constructible<Functor>::value,
 				"Functor required to be trival or copy constructible");
 
-			using element_type = Evalee; 
+			using element_type = Evalee;
 
-			VMEvaluator(expr::ast::Program const& prog) : vm_ptr(vm::Compiler<Functor, Evalee>()(prog)){}
+			VMEvaluator(ast::Tree const& tree) : vm_ptr(vm::Compiler<Functor, Evalee>().Compile(tree)){}
+
+			// a program loaded with vm::VirtualMachine::Load, e.g. by vm::Image
+			explicit VMEvaluator(std::shared_ptr<vm::VirtualMachine<Functor, Evalee> const> machine) : vm_ptr(std::move(machine)){}
 
 			float operator()(element_type const& e) const{
 				return vm_ptr->Eval(e);
 			}
 
-			~VMEvaluator() { delete vm_ptr; }
+			// scratch: caller owned, at least ScratchSize() floats, e.g. one buffer per worker thread
+			float operator()(element_type const& e, float* scratch) const{
+				return vm_ptr->Eval(e, scratch);
+			}
+
+			uint32_t ScratchSize() const{ return vm_ptr->StackSize(); }
+
+			// score n items into out[0..n)
+			void EvalBatch(element_type const* items, std::size_t n, float* out) const{
+				vm_ptr->EvalBatch(items, n, out);
+			}
+
+			void EvalBatch(element_type const* const* items, std::size_t n, float* out) const{
+				vm_ptr->EvalBatch(items, n, out);
+			}
+
+			// appends the program as a relocatable record, see vm::ImageWriter
+			void Save(std::vector<uint32_t>& out) const{
+				vm_ptr->Save(out);
+			}
+
+			// bounds of the score given bounds of every symbol, ranges indexed by symbol position,
+			// e.g. the min and max of each field over a block of items to prune it with TopK
+			Interval Range(std::vector<Interval> const& ranges) const{
+				return vm_ptr->Range(ranges.data(), ranges.size());
+			}
 
 		private:
-			vm::VirtualMachine<Functor, Evalee> * vm_ptr; 
+			// immutable once compiled, copies of the evaluator share it
+			std::shared_ptr<vm::VirtualMachine<Functor, Evalee> const> vm_ptr;
 	};
 }
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstdint> // uint32_t
+#include <cstring> // memcpy
+#include <memory> // shared_ptr
+#include <ostream>
+#include <stdexcept> // invalid_argument, out_of_range, runtime_error
+#include <string>
+#include <type_traits> // make_unsigned
+#include <vector>
+
+#include "flat_ast.h"
+#include "vm_evaluator.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define EXPR_VM_MMAP 1
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close
+#else
+#define EXPR_VM_MMAP 0
+#endif
+
+namespace expr{
+	namespace vm{
+		///////////////////////////////////////////////////////////////////////////
+		//  Image of compiled programs, in native byte order and 32-bit words so it
+		//  can be used in place from a read-only mapping:
+		//
+		//	magic, version, symbol table size, symbol names hash, program count
+		//	per program: record offset, record words, key offset, key bytes
+		//	records as written by VirtualMachine::Save
+		//	keys, padded to a word
+		//
+		//  offsets are from the start of the image, in words for records and in
+		//  bytes for keys. Functors are referred to by symbol position, so an
+		//  image is bound at load time to a grammar made with the same symbol list,
+		//  names and order checked by their hash
+		///////////////////////////////////////////////////////////////////////////
+		static const uint32_t kImageMagic = 0x4d565845; // "EXVM" little endian
+		static const uint32_t kImageVersion = 2;
+		static const uint32_t kImageHeader = 5;
+
+		// fnv-1a of the names in order, each followed by a 0 so "ab","c" and "a","bc" differ
+		template<class String>
+		uint32_t SymbolsHash(std::vector<String> const& names){
+			uint32_t h = 2166136261u;
+			for(String const& name : names){
+				for(auto c : name){
+					h = (h ^ uint32_t(typename std::make_unsigned<decltype(c)>::type(c))) * 16777619u;
+				}
+				h *= 16777619u;
+			}
+			return h;
+		}
+
+		class ImageWriter{
+			public:
+				// grammar: CalcGrammar or CalcParser programs are parsed by, whose symbols are checked
+				// against those of the grammar programs are loaded with
+				template<class Grammar>
+				explicit ImageWriter(Grammar const& grammar) :
+					symbol_count(uint32_t(grammar.Symbols()->size())), symbols_hash(SymbolsHash(grammar.SymbolNames())){}
+
+				// program i of the image, looked up by key, e.g. its text
+				template<class Functor, class Evalee>
+				uint32_t Add(std::string const& key, VMEvaluator<Functor, Evalee> const& program){
+					Entry e{uint32_t(records.size()), 0, uint32_t(keys.size()), uint32_t(key.size())};
+					program.Save(records);
+					e.words = uint32_t(records.size()) - e.record;
+					keys += key;
+					entries.push_back(e);
+					return uint32_t(entries.size()-1);
+				}
+
+				std::vector<uint32_t> Data() const{
+					const uint32_t header = kImageHeader + 4*uint32_t(entries.size());
+					const uint32_t key_base = 4*(header + uint32_t(records.size()));
+					std::vector<uint32_t> image{kImageMagic, kImageVersion, symbol_count, symbols_hash, uint32_t(entries.size())};
+					for(Entry const& e : entries){
+						image.insert(image.end(), {header + e.record, e.words, key_base + e.key, e.key_size});
+					}
+					image.insert(image.end(), records.begin(), records.end());
+					std::size_t at = image.size();
+					image.resize(at + (keys.size()+3)/4);
+					if(!keys.empty()){
+						std::memcpy(&image[at], keys.data(), keys.size());
+					}
+					return image;
+				}
+
+				void Write(std::ostream& out) const{
+					std::vector<uint32_t> image = Data();
+					out.write(reinterpret_cast<char const*>(image.data()), std::streamsize(image.size()*sizeof(uint32_t)));
+				}
+
+			private:
+				struct Entry
+				{
+					uint32_t record;
+					uint32_t words;
+					uint32_t key;
+					uint32_t key_size;
+				};
+
+				uint32_t symbol_count;
+				uint32_t symbols_hash;
+				std::vector<Entry> entries;
+				std::vector<uint32_t> records;
+				std::string keys;
+		};
+
+		// read-only view of an image, which must stay alive and unchanged while viewed.
+		// The header and directory are checked here, each record when it is loaded
+		class Image{
+			public:
+				// data: word aligned, as a mapping or a vector<uint32_t> is
+				Image(void const* data, std::size_t bytes) : words(static_cast<uint32_t const*>(data)), size(bytes/4){
+					if(reinterpret_cast<std::uintptr_t>(data) % alignof(uint32_t) != 0){
+						throw std::invalid_argument("vm image not word aligned");
+					}
+					if(size < kImageHeader || words[0] != kImageMagic || words[1] != kImageVersion){
+						throw std::invalid_argument("not a vm image of this version and byte order");
+					}
+					if((size - kImageHeader)/4 < words[4]){
+						throw std::invalid_argument("truncated vm image");
+					}
+					for(uint32_t i=0; i<Size(); ++i){
+						uint32_t const* e = entry(i);
+						if(e[0] > size || e[1] > size - e[0] || e[2] > 4*size || e[3] > 4*size - e[2]){
+							throw std::invalid_argument("vm image entry out of bounds");
+						}
+					}
+				}
+
+				uint32_t Size() const{ return words[4]; }
+
+				std::string Key(uint32_t i) const{
+					uint32_t const* e = entry(i);
+					return std::string(reinterpret_cast<char const*>(words) + e[2], e[3]);
+				}
+
+				// program i bound to the grammar's functors, the grammar (CalcGrammar or CalcParser)
+				// made with the symbol names, in the same order, the image was written with. The
+				// program is copied out, it doesn't refer to the image once loaded
+				template<class Grammar>
+				VMEvaluator<typename Grammar::func_type, typename Grammar::item_type> Load(uint32_t i, Grammar const& grammar) const{
+					typedef vm::VirtualMachine<typename Grammar::func_type, typename Grammar::item_type> machine_type;
+					ast::SymbolTable const& table = *grammar.Symbols();
+					if(table.size() != words[2] || SymbolsHash(grammar.SymbolNames()) != words[3]){
+						throw std::invalid_argument("vm image written for another symbol table");
+					}
+					uint32_t const* e = entry(i);
+					return VMEvaluator<typename Grammar::func_type, typename Grammar::item_type>(
+						machine_type::Load(words + e[0], e[1], table));
+				}
+
+			private:
+				uint32_t const* entry(uint32_t i) const{
+					if(i >= Size()){
+						throw std::out_of_range("vm image program index");
+					}
+					return words + kImageHeader + 4*i;
+				}
+
+			private:
+				uint32_t const* words;
+				std::size_t size;
+		};
+
+#if EXPR_VM_MMAP
+		// a file mapped read-only, e.g. an image written at build time and shared by every
+		// process on the host through the page cache
+		class MappedFile{
+			public:
+				explicit MappedFile(std::string const& path){
+					int fd = ::open(path.c_str(), O_RDONLY);
+					if(fd < 0){
+						throw std::runtime_error("cannot open "+path);
+					}
+					struct stat st;
+					if(::fstat(fd, &st) == 0 && st.st_size > 0){
+						size = std::size_t(st.st_size);
+						void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+						page = p == MAP_FAILED ? nullptr : p;
+					}
+					::close(fd);
+					if(!page){
+						throw std::runtime_error("cannot map "+path);
+					}
+				}
+
+				MappedFile(MappedFile const&) = delete;
+				MappedFile& operator=(MappedFile const&) = delete;
+
+				~MappedFile(){
+					::munmap(page, size);
+				}
+
+				void const* Data() const{ return page; }
+				std::size_t Size() const{ return size; }
+
+			private:
+				void* 	    page = nullptr;
+				std::size_t size = 0;
+		};
+#endif
+	}
+}